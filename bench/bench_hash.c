@@ -0,0 +1,107 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmarks the object hash on realistic key sets against the libcad
+ * string hash (previously used by objects). Not part of the test
+ * suite; build it like a test and run it by hand:
+ *
+ *   gcc -O2 -I include bench/bench_hash.c -L target -lyacjp -lcad -o bench_hash
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cad_hash.h>
+
+#include "json.h"
+
+#define ROUNDS 200
+
+static const char *api_keys[] = {
+     "id", "user_id", "name", "email", "created_at", "updated_at", "type",
+     "status", "url", "html_url", "avatar_url", "description", "login",
+     "node_id", "followers", "following", "public_repos", "site_admin",
+     "location", "company", "timestamp", "version", "tags", "data", NULL,
+};
+
+static double now(void) {
+     struct timespec t;
+     clock_gettime(CLOCK_MONOTONIC, &t);
+     return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static void bench(const char *title, const char **keys, int n) {
+     json_object_t *object = json_new_object(stdlib_memory);
+     cad_hash_t *hash = cad_new_hash(stdlib_memory, cad_hash_strings);
+     json_value_t *t = (json_value_t*)json_const(json_true);
+     double start, object_time, hash_time;
+     int i, r;
+
+     for (i = 0; i < n; i++) {
+          object->set(object, keys[i], t);
+          hash->set(hash, keys[i], t);
+     }
+
+     start = now();
+     for (r = 0; r < ROUNDS; r++) {
+          for (i = 0; i < n; i++) {
+               if (object->get(object, keys[i]) != t) abort();
+          }
+     }
+     object_time = now() - start;
+
+     start = now();
+     for (r = 0; r < ROUNDS; r++) {
+          for (i = 0; i < n; i++) {
+               if (hash->get(hash, keys[i]) != t) abort();
+          }
+     }
+     hash_time = now() - start;
+
+     printf("%-24s %6d keys: json_object %6.1f ns/get, cad_hash %6.1f ns/get\n",
+            title, n, object_time / (ROUNDS * n), hash_time / (ROUNDS * n));
+
+     object->free(object);
+     hash->free(hash);
+}
+
+int main() {
+     static char buffer[10000][40];
+     const char *keys[10000];
+     int i, n;
+
+     for (n = 0; api_keys[n]; n++) {
+          keys[n] = api_keys[n];
+     }
+     bench("API field names", keys, n);
+
+     for (i = 0; i < 10000; i++) {
+          snprintf(buffer[i], 40, "key%d", i);
+          keys[i] = buffer[i];
+     }
+     bench("Sequential keys", keys, 10000);
+
+     for (i = 0; i < 10000; i++) {
+          snprintf(buffer[i], 40, "%08x-%04x-%04x-%04x-%012x", i * 2654435761U, i & 0xffff, (i * 31) & 0xffff, (i * 17) & 0xffff, i * 40503U);
+          keys[i] = buffer[i];
+     }
+     bench("UUID keys", keys, 10000);
+
+     return 0;
+}
@@ -61,6 +61,119 @@ typedef void (*json_on_error_fn)(cad_input_stream_t *stream, int line, int colum
  */
 __PUBLIC__ json_value_t *json_parse(cad_input_stream_t *stream, json_on_error_fn on_error, void *error_data, cad_memory_t memory);
 
+/**
+ * An argument to json_parse_with() to obtain lazy numbers: the parser
+ * only validates numbers and records their text, which is written
+ * back as is by json_write_to() (hence exactly, whatever the
+ * precision). The conversions are done on demand, and cached.
+ *
+ * Note that lazy numbers are never stored inline in arrays and
+ * objects.
+ */
+__PUBLIC__ extern short json_lazy_numbers;
+
+/**
+ * Parses a stream, with options.
+ *
+ * @param[in] stream the stream that contains the JSON data to parse
+ * @param[in] on_error the function to call if a parse error occurs
+ * @param[in] error_data error data payload
+ * @param[in] memory the memory manager that will allocate memory for the parsed JSON objects
+ * @param[in] options 0 (same as json_parse()), or @ref json_lazy_numbers
+ *
+ * @return the parsed JSON value, or NULL if an error occured (in the
+ * latter case, the on_error function was also called).
+ */
+__PUBLIC__ json_value_t *json_parse_with(cad_input_stream_t *stream, json_on_error_fn on_error, void *error_data, cad_memory_t memory, short options);
+
+/**
+ * The nesting limit of json_parse() and json_parse_with().
+ */
+#define JSON_DEFAULT_MAX_DEPTH 1024
+
+/**
+ * Parses a stream, with options and a nesting limit. The parser does
+ * not recurse, whatever the depth of the document; but a deeper
+ * document than `max_depth` is an error (reported to the on_error
+ * function, the containers parsed until then being returned).
+ *
+ * @param[in] stream the stream that contains the JSON data to parse
+ * @param[in] on_error the function to call if a parse error occurs
+ * @param[in] error_data error data payload
+ * @param[in] memory the memory manager that will allocate memory for the parsed JSON objects
+ * @param[in] options the same options as json_parse_with()
+ * @param[in] max_depth the maximum number of nested arrays and objects,
+ * or 0 for no limit
+ *
+ * @return the parsed JSON value, or NULL if an error occured (in the
+ * latter case, the on_error function was also called).
+ */
+__PUBLIC__ json_value_t *json_parse_with_depth(cad_input_stream_t *stream, json_on_error_fn on_error, void *error_data, cad_memory_t memory, short options, int max_depth);
+
+typedef struct json_parser json_parser_t;
+
+/**
+ * Frees the parser; the values it parsed are not freed.
+ *
+ * @param[in] this the target JSON parser
+ */
+typedef void (*json_parser_free_fn)(json_parser_t *this);
+
+/**
+ * Parses a stream, like json_parse_with_depth() with the error
+ * function, options and depth limit given to json_new_parser().
+ *
+ * @param[in] this the target JSON parser
+ * @param[in] stream the stream that contains the JSON data to parse
+ *
+ * @return the parsed JSON value, or NULL if an error occured (in the
+ * latter case, the on_error function was also called).
+ */
+typedef json_value_t *(*json_parser_parse_fn)(json_parser_t *this, cad_input_stream_t *stream);
+
+/**
+ * Shrinks the parser buffers back to their initial size, after they
+ * grew to parse a large document.
+ *
+ * @param[in] this the target JSON parser
+ */
+typedef void (*json_parser_reset_fn)(json_parser_t *this);
+
+/**
+ * A JSON parser that keeps its buffers from a document to the next one
+ * (the encoding adapter, the object keys, the nesting stack...), which
+ * saves their allocation when parsing many small documents. A parser
+ * must not be used by several threads at the same time.
+ */
+struct json_parser {
+     /**
+      * @see json_parser_free_fn
+      */
+     json_parser_free_fn  free ;
+     /**
+      * @see json_parser_parse_fn
+      */
+     json_parser_parse_fn parse;
+     /**
+      * @see json_parser_reset_fn
+      */
+     json_parser_reset_fn reset;
+};
+
+/**
+ * Creates a reusable JSON parser.
+ *
+ * @param[in] on_error the function to call if a parse error occurs
+ * @param[in] error_data error data payload
+ * @param[in] memory the memory manager that will allocate memory for the parsed JSON objects
+ * @param[in] options the same options as json_parse_with()
+ * @param[in] max_depth the maximum number of nested arrays and objects,
+ * or 0 for no limit (see JSON_DEFAULT_MAX_DEPTH)
+ *
+ * @return the new parser
+ */
+__PUBLIC__ json_parser_t *json_new_parser(json_on_error_fn on_error, void *error_data, cad_memory_t memory, short options, int max_depth);
+
 /**
  * @}
  */
@@ -71,13 +184,48 @@ __PUBLIC__ json_value_t *json_parse(cad_input_stream_t *stream, json_on_error_fn
  */
 
 /**
- * This visitor kills a JSON value by recursively free()ing all the
- * values contained in objects and arrays.
+ * This visitor kills a JSON value by free()ing all the values
+ * contained in objects and arrays, nested ones included. It does not
+ * recurse, so the depth of the value is not limited by the C stack.
  *
- * @return a singleton object able to recursively kill any JSON value.
+ * @return a singleton object able to kill any JSON value.
  */
 __PUBLIC__ json_visitor_t *json_kill();
 
+/**
+ * Kills a JSON value in the background: objects and arrays are queued
+ * to a reclaimer thread (started on first use) that frees them, so that
+ * the caller does not wait for the teardown of a large tree. Other
+ * values are freed at once.
+ *
+ * If the queue is full, the value is killed synchronously.
+ *
+ * The value must not be used anymore, and its memory manager must be
+ * usable from another thread.
+ *
+ * @param[in] value the value to kill
+ */
+__PUBLIC__ void json_kill_async(json_value_t *value);
+
+/**
+ * Configures the reclaimer used by json_kill_async().
+ *
+ * @param[in] queue_size the maximum number of trees waiting to be
+ * freed, 0 for the default (1024)
+ * @param[in] rate the maximum number of values (objects, arrays,
+ * strings, numbers and constants) freed per second, 0 for no limit
+ * (the default); the numbers stored inline in arrays and objects cost
+ * nothing
+ */
+__PUBLIC__ void json_reclaimer_configure(unsigned int queue_size, unsigned long rate);
+
+/**
+ * Waits until all the values given to json_kill_async() are freed; the
+ * rate limit does not apply meanwhile. Useful at shutdown, and in
+ * tests.
+ */
+__PUBLIC__ void json_reclaimer_drain(void);
+
 typedef union json_stop {
      char *key;
      int   index;
@@ -92,13 +240,35 @@ __PUBLIC__ json_stop_t json_stop();
  */
 #define JSON_STOP (json_stop())
 
+/**
+ * The marker used by @ref JSON_K; not meant to be used directly.
+ */
+__PUBLIC__ extern const char json_key_marker[];
+
+/**
+ * A path element that looks up a pre-hashed key in an object. It
+ * expands to two arguments: a marker, and the given @ref json_key_t
+ * pointer. Like a string, it must only be given where the path reaches
+ * an object (see json_lookup()).
+ *
+ * @see json_lookup()
+ */
+#define JSON_K(key) ((char*)json_key_marker), ((json_key_t*)(key))
+
 /**
  * Returns a value represented by the path given as arguments. Each
- * argument may be a string (to lookup in an object), an int (to
+ * argument may be a string (to lookup in an object), a @ref JSON_K
+ * pre-hashed key (to lookup in an object without hashing), an int (to
  * lookup in an array), @ref JSON_STOP (to stop the lookup). The
  * lookup stops if a string, a number, or a const is found, or if an
  * argument is @ref JSON_STOP.
  *
+ * The arguments are read with va_arg() according to the type of the
+ * value reached so far, so the path must match the structure: a string
+ * or a @ref JSON_K reaching an array, or an int reaching an object, is
+ * undefined behaviour. Check json_type() along the way when the
+ * structure is not known.
+ *
  * @param[in] value the value to lookup into
  * @param[in] ... the path of the value to find
  *
@@ -144,6 +314,29 @@ __PUBLIC__ extern short json_extend_unicode;
  */
 __PUBLIC__ extern short json_extend_spaces;
 
+/**
+ * An argument to json_write_to() to keep the output of each object and
+ * array, and write again only the ones that changed since: the write
+ * time is then that of the changed paths. The whole output is buffered
+ * until complete, and each container keeps a copy of its own.
+ *
+ * The containers see the changes made through their own functions;
+ * use json_touch() after changing a string or a number in place.
+ */
+__PUBLIC__ extern short json_cache_subtrees;
+
+/**
+ * An argument to json_write_to() to obtain the canonical JSON of RFC
+ * 8785: compact, with the keys sorted by UTF-16 code units, minimal
+ * escaping, and the numbers written as ECMAScript does (as doubles, in
+ * their shortest form; NaN and infinities as null, like
+ * JSON.stringify()). The sorted order of the keys of each object is
+ * kept until its keys change.
+ *
+ * The streaming writer writes the keys in the given order.
+ */
+__PUBLIC__ extern short json_canonical;
+
 /**
  * Builds a visitor that can write any given JSON data to the `stream`.
  *
@@ -153,11 +346,287 @@ __PUBLIC__ extern short json_extend_spaces;
  * json_extend_unicode, @ref json_extend_spaces, or the combined @ref
  * json_extend_unicode || @ref json_extend_spaces.
  *
+ * Numbers that are NaN or infinite are written as null.
+ *
  * @return a visitor that is able to write a JSON value to the given
  * `stream`.
  */
 __PUBLIC__ json_visitor_t *json_write_to(cad_output_stream_t *stream, cad_memory_t memory, short options);
 
+/**
+ * Builds a visitor that can write any given JSON data to the file
+ * descriptor `fd`, gathering the output with writev(2) (see
+ * json_new_fd_writer()).
+ *
+ * @param[in] fd the file descriptor onto which the JSON data will be written
+ * @param[in] memory the memory manager that will allocate memory if needed
+ * @param[in] options the same options as json_write_to()
+ *
+ * @return a visitor that is able to write a JSON value to the given
+ * file descriptor; check json_write_error() once the value is written
+ */
+__PUBLIC__ json_visitor_t *json_write_to_fd(int fd, cad_memory_t memory, short options);
+
+/**
+ * Returns the output error of a visitor built by json_write_to_fd().
+ * Once a write fails the visitor stops writing: the rest of the output
+ * is dropped.
+ *
+ * @param[in] visitor a visitor built by json_write_to(),
+ * json_write_to_fd() or json_write_to_parallel()
+ *
+ * @return 0, or the errno of the first failed write
+ */
+__PUBLIC__ int json_write_error(json_visitor_t *visitor);
+
+/**
+ * Builds a visitor that writes the same output as json_write_to(), but
+ * splits the large arrays and objects into ranges written by several
+ * threads into separate buffers, then concatenated in order.
+ *
+ * The memory manager must be thread-safe, and the written value must
+ * not be changed meanwhile.
+ *
+ * @param[in] stream the stream onto which the JSON data will be written
+ * @param[in] memory the memory manager that will allocate memory if needed
+ * @param[in] options the same options as json_write_to()
+ * @param[in] threads the number of threads writing a large container,
+ * the calling one included
+ *
+ * @return a visitor that is able to write a JSON value to the given
+ * `stream`.
+ */
+__PUBLIC__ json_visitor_t *json_write_to_parallel(cad_output_stream_t *stream, cad_memory_t memory, short options, int threads);
+
+/**
+ * Invalidates the output kept for the container and the ones that hold
+ * it (see @ref json_cache_subtrees).
+ *
+ * @param[in] value the object or array that changed
+ */
+__PUBLIC__ void json_touch(json_value_t *value);
+
+/**
+ * Computes the exact length of the output json_write_to() would
+ * produce for the `value`, without writing it.
+ *
+ * @param[in] value the value to measure
+ * @param[in] options the same options as json_write_to()
+ *
+ * @return the length in bytes of the written JSON data
+ */
+__PUBLIC__ size_t json_measure(json_value_t *value, short options);
+
+/**
+ * Writes the `value` into a buffer allocated once, at the size given
+ * by json_measure().
+ *
+ * @param[in] value the value to write
+ * @param[in] options the same options as json_write_to()
+ * @param[in] memory the memory manager that allocates the result
+ * @param[out] length if not NULL, receives the length of the result
+ * (not counting the trailing '\\0')
+ *
+ * @return the '\\0'-terminated JSON data, to be freed by the caller
+ * with `memory`
+ */
+__PUBLIC__ char *json_serialize(json_value_t *value, short options, cad_memory_t memory, size_t *length);
+
+/**
+ * A streaming writer, to emit JSON without building values first.
+ */
+typedef struct json_writer json_writer_t;
+
+/**
+ * Frees the writer, flushing any pending output. The output of a
+ * complete top-level value is already flushed: check error() before
+ * freeing.
+ *
+ * @param[in] this the target writer
+ */
+typedef void (*json_writer_free_fn        ) (json_writer_t *this);
+
+/**
+ * Opens an object or an array (the opening function depends on the
+ * function pointer called: `begin_object` or `begin_array`).
+ *
+ * @param[in] this the target writer
+ *
+ * @return 0 on success, -1 if a value is not expected here
+ */
+typedef int  (*json_writer_begin_fn       ) (json_writer_t *this);
+
+/**
+ * Closes the innermost object or array (the closing function must
+ * match: `end_object` or `end_array`).
+ *
+ * @param[in] this the target writer
+ *
+ * @return 0 on success, -1 if there is no such container to close, or
+ * if an object key has no value
+ */
+typedef int  (*json_writer_end_fn         ) (json_writer_t *this);
+
+/**
+ * Writes an object key; the next call must write its value.
+ *
+ * @param[in] this the target writer
+ * @param[in] key the utf-8 key
+ * @param[in] length the length of the key, in bytes
+ *
+ * @return 0 on success, -1 if not directly in an object, or if the
+ * previous key has no value
+ */
+typedef int  (*json_writer_key_fn         ) (json_writer_t *this, const char *key, size_t length);
+
+/**
+ * Writes a string value.
+ *
+ * @param[in] this the target writer
+ * @param[in] string the utf-8 string
+ * @param[in] length the length of the string, in bytes
+ *
+ * @return 0 on success, -1 if a value is not expected here
+ */
+typedef int  (*json_writer_string_fn      ) (json_writer_t *this, const char *string, size_t length);
+
+/**
+ * Writes an integer value.
+ *
+ * @param[in] this the target writer
+ * @param[in] value the value
+ *
+ * @return 0 on success, -1 if a value is not expected here
+ */
+typedef int  (*json_writer_int64_fn       ) (json_writer_t *this, int64_t value);
+
+/**
+ * Writes a double value, in the shortest form that reads back exactly.
+ * NaN and infinities have no JSON representation: they are written as
+ * `null`, as JSON.stringify() does.
+ *
+ * @param[in] this the target writer
+ * @param[in] value the value
+ *
+ * @return 0 on success, -1 if a value is not expected here
+ */
+typedef int  (*json_writer_double_fn      ) (json_writer_t *this, double value);
+
+/**
+ * Writes `true` or `false`.
+ *
+ * @param[in] this the target writer
+ * @param[in] value the value
+ *
+ * @return 0 on success, -1 if a value is not expected here
+ */
+typedef int  (*json_writer_bool_fn        ) (json_writer_t *this, int value);
+
+/**
+ * Writes `null`.
+ *
+ * @param[in] this the target writer
+ *
+ * @return 0 on success, -1 if a value is not expected here
+ */
+typedef int  (*json_writer_null_fn        ) (json_writer_t *this);
+
+/**
+ * Returns the output error, if any. Once a write fails the writer
+ * stops writing: the rest of the output is dropped, and completing a
+ * top-level value returns -1.
+ *
+ * @param[in] this the target writer
+ *
+ * @return 0, or the errno of the first failed write (only the writers
+ * built by json_new_fd_writer() write by themselves)
+ */
+typedef int  (*json_writer_error_fn       ) (json_writer_t *this);
+
+/**
+ * The streaming writer public interface. The calls must describe
+ * exactly one JSON value; the output is flushed to the stream when
+ * that value is complete.
+ */
+struct json_writer {
+     /**
+      * @see json_writer_free_fn
+      */
+     json_writer_free_fn   free        ;
+     /**
+      * @see json_writer_begin_fn
+      */
+     json_writer_begin_fn  begin_object;
+     /**
+      * @see json_writer_end_fn
+      */
+     json_writer_end_fn    end_object  ;
+     /**
+      * @see json_writer_begin_fn
+      */
+     json_writer_begin_fn  begin_array ;
+     /**
+      * @see json_writer_end_fn
+      */
+     json_writer_end_fn    end_array   ;
+     /**
+      * @see json_writer_key_fn
+      */
+     json_writer_key_fn    key         ;
+     /**
+      * @see json_writer_string_fn
+      */
+     json_writer_string_fn string      ;
+     /**
+      * @see json_writer_int64_fn
+      */
+     json_writer_int64_fn  int64       ;
+     /**
+      * @see json_writer_double_fn
+      */
+     json_writer_double_fn double_     ;
+     /**
+      * @see json_writer_bool_fn
+      */
+     json_writer_bool_fn   bool_       ;
+     /**
+      * @see json_writer_null_fn
+      */
+     json_writer_null_fn   null        ;
+     /**
+      * @see json_writer_error_fn
+      */
+     json_writer_error_fn  error       ;
+};
+
+/**
+ * Builds a streaming writer. It shares the escaping, number formatting
+ * and layout of json_write_to(), and only allocates when the nesting
+ * gets deeper than ever before.
+ *
+ * @param[in] stream the stream onto which the JSON data will be written
+ * @param[in] memory the memory manager that will allocate memory if needed
+ * @param[in] options the same options as json_write_to()
+ *
+ * @return the new writer
+ */
+__PUBLIC__ json_writer_t *json_new_writer(cad_output_stream_t *stream, cad_memory_t memory, short options);
+
+/**
+ * Builds a streaming writer onto a file descriptor. The output is
+ * gathered and written with writev(2); large runs of string and key
+ * text are handed to the kernel directly instead of being copied (they
+ * are written before the call that gave them returns).
+ *
+ * @param[in] fd the file descriptor onto which the JSON data will be written
+ * @param[in] memory the memory manager that will allocate memory if needed
+ * @param[in] options the same options as json_write_to()
+ *
+ * @return the new writer; see @ref json_writer_error_fn "error()" for
+ * the output errors
+ */
+__PUBLIC__ json_writer_t *json_new_fd_writer(int fd, cad_memory_t memory, short options);
+
 /**
  * @}
  */
@@ -23,10 +23,12 @@
  *
  * All value pointers may be cast to/from `json_value_t*` and provide
  * the @ref json_value_accept_fn "accept()" and @ref
- * json_value_free_fn "free()" functions.
+ * json_value_free_fn "free()" functions, and the type tag read by
+ * json_type().
  */
 
 #include <ctype.h>
+#include <stdint.h>
 #include <cad_shared.h>
 
 /**
@@ -53,6 +55,23 @@ typedef struct json_const   json_const_t;
 
 typedef struct json_visitor json_visitor_t;
 
+/**
+ * The type tag of a JSON value, readable without a visitor using
+ * json_type().
+ */
+typedef enum {
+     /** a @ref json_object */
+     json_type_object=0,
+     /** a @ref json_array */
+     json_type_array,
+     /** a @ref json_string */
+     json_type_string,
+     /** a @ref json_number */
+     json_type_number,
+     /** a @ref json_const */
+     json_type_const,
+} json_type_e;
+
 
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 
@@ -61,6 +80,40 @@ typedef struct json_visitor json_visitor_t;
  * @{
  */
 
+/**
+ * A pre-hashed object key. Keys are meant to be created once (either
+ * statically using @ref JSON_KEY or at init time using json_key()) and
+ * used many times with the @ref json_object_get_k_fn "get_k()", @ref
+ * json_object_set_k_fn "set_k()", and @ref json_object_del_k_fn
+ * "del_k()" functions, thus skipping key measurement and hashing.
+ *
+ * The hash seed is only known at run time, so a @ref JSON_KEY key
+ * computes its hash on first use and caches it in the handle: such
+ * keys must be writable (not declared `const`). They may be shared
+ * between threads.
+ */
+typedef struct json_key {
+     /**
+      * The key string; it must outlive the key handle.
+      */
+     const char   *string;
+     /**
+      * The length of the key string.
+      */
+     unsigned int  length;
+     /**
+      * The cached hash; 0 if not yet computed (it is computed on first
+      * use, and stored atomically).
+      */
+     unsigned int  hash  ;
+} json_key_t;
+
+/**
+ * A static initializer for a @ref json_key_t, given a string literal.
+ * The key must not be `const`, see @ref json_key_t.
+ */
+#define JSON_KEY(literal) {(literal), sizeof(literal) - 1, 0}
+
 /**
  * Accepts a visitor.
  *
@@ -87,7 +140,8 @@ typedef unsigned int         (*json_object_count_fn ) (json_object_t *this);
 
 /**
  * Fills the provided keys array, which MUST be large enough (at least
- * @ref json_object_count_fn "count()" locations).
+ * @ref json_object_count_fn "count()" locations). The keys are given
+ * in insertion order.
  *
  * @param[in] this the target JSON object
  */
@@ -123,6 +177,142 @@ typedef json_value_t        *(*json_object_set_fn   ) (json_object_t *this, cons
  */
 typedef json_value_t        *(*json_object_del_fn   ) (json_object_t *this, const char *key);
 
+/**
+ * Gets a field using a pre-hashed key.
+ *
+ * @param[in] this the target JSON object
+ * @param[in] key the field key handle
+ *
+ * @return a field value, given its key.
+ */
+typedef json_value_t        *(*json_object_get_k_fn ) (json_object_t *this, json_key_t *key);
+
+/**
+ * Sets the provided new `value` to the given pre-hashed `key`.
+ *
+ * @param[in] this the target JSON object
+ * @param[in] key the field key handle
+ * @param[in] value the new field value
+ *
+ * @return the previous value, or `NULL` if none was set.
+ */
+typedef json_value_t        *(*json_object_set_k_fn ) (json_object_t *this, json_key_t *key, json_value_t *value);
+
+/**
+ * Removes both the provided pre-hashed `key` and its associated value
+ * from the object.
+ *
+ * @param[in] this the target JSON object
+ * @param[in] key the field key handle
+ *
+ * @return the removed value, or `NULL` if none was set.
+ */
+typedef json_value_t        *(*json_object_del_k_fn ) (json_object_t *this, json_key_t *key);
+
+/**
+ * Fills the provided keys and lengths arrays, which MUST both be large
+ * enough (at least @ref json_object_count_fn "count()" locations). The
+ * keys are given in insertion order; `lengths[i]` is the length of
+ * `keys[i]`.
+ *
+ * @param[in] this the target JSON object
+ * @param[out] keys the keys array to fill
+ * @param[out] lengths the key lengths array to fill
+ */
+typedef void                 (*json_object_keys_n_fn) (json_object_t *this, const char **keys, size_t *lengths);
+
+/**
+ * Gets a field, given a length-delimited key (which does not need to
+ * be NUL-terminated).
+ *
+ * @param[in] this the target JSON object
+ * @param[in] key the field name
+ * @param[in] key_len the length of the field name
+ *
+ * @return a field value, given its key.
+ */
+typedef json_value_t        *(*json_object_get_n_fn ) (json_object_t *this, const char *key, size_t key_len);
+
+/**
+ * Sets the provided new `value` to the given length-delimited `key`
+ * (which does not need to be NUL-terminated; the object keeps its own
+ * copy).
+ *
+ * @param[in] this the target JSON object
+ * @param[in] key the field name
+ * @param[in] key_len the length of the field name
+ * @param[in] value the new field value
+ *
+ * @return the previous value, or `NULL` if none was set.
+ */
+typedef json_value_t        *(*json_object_set_n_fn ) (json_object_t *this, const char *key, size_t key_len, json_value_t *value);
+
+/**
+ * Removes both the provided length-delimited `key` and its associated
+ * value from the object.
+ *
+ * @param[in] this the target JSON object
+ * @param[in] key the field name
+ * @param[in] key_len the length of the field name
+ *
+ * @return the removed value, or `NULL` if none was set.
+ */
+typedef json_value_t        *(*json_object_del_n_fn ) (json_object_t *this, const char *key, size_t key_len);
+
+/**
+ * The function called for each field by @ref json_object_iterate_fn
+ * "iterate()".
+ *
+ * @param[in] object the iterated JSON object
+ * @param[in] index the index of the field (0 for the first field, then 1, and so on)
+ * @param[in] key the field name
+ * @param[in] key_len the length of the field name
+ * @param[in] value the field value
+ * @param[in] data the user data given to @ref json_object_iterate_fn "iterate()"
+ */
+typedef void                 (*json_object_iterator_fn) (json_object_t *object, unsigned int index, const char *key, size_t key_len, json_value_t *value, void *data);
+
+/**
+ * Calls the `iterator` for each field of the object, in insertion
+ * order, in a single pass over the object storage. The object must
+ * not be modified during the iteration.
+ *
+ * Inline numbers are given as transient values: they are only valid
+ * during the call (and freeing them does nothing). Use @ref
+ * json_object_get_fn "get()" to obtain a stable pointer.
+ *
+ * @param[in] this the target JSON object
+ * @param[in] iterator the function to call for each field
+ * @param[in] data user data passed to the `iterator`
+ */
+typedef void                 (*json_object_iterate_fn) (json_object_t *this, json_object_iterator_fn iterator, void *data);
+
+/**
+ * Sets an integer to the given `key`. The number is stored inline, and
+ * boxed into a @ref json_number only if a pointer is requested (by
+ * @ref json_object_get_fn "get()" and the like).
+ *
+ * @param[in] this the target JSON object
+ * @param[in] key the field name
+ * @param[in] value the integer
+ *
+ * @return the previous value, or `NULL` if none was set.
+ */
+typedef json_value_t        *(*json_object_set_int_fn   ) (json_object_t *this, const char *key, long value);
+
+/**
+ * Sets a double to the given `key`. The number is stored inline, and
+ * boxed into a @ref json_number only if a pointer is requested (by
+ * @ref json_object_get_fn "get()" and the like).
+ *
+ * @param[in] this the target JSON object
+ * @param[in] key the field name
+ * @param[in] value the double
+ *
+ * @return the previous value, or `NULL` if none was set.
+ */
+typedef json_value_t        *(*json_object_set_double_fn) (json_object_t *this, const char *key, double value);
+
 /**
  * The JSON object public interface.
  */
@@ -135,6 +325,10 @@ struct json_object {
       * @see json_object_free_fn
       */
      json_object_free_fn   free  ;
+     /**
+      * The value type tag, see json_type()
+      */
+     json_type_e           type  ;
      /**
       * @see json_object_count_fn
       */
@@ -155,6 +349,46 @@ struct json_object {
       * @see json_object_del_fn
       */
      json_object_del_fn    del   ;
+     /**
+      * @see json_object_get_k_fn
+      */
+     json_object_get_k_fn  get_k ;
+     /**
+      * @see json_object_set_k_fn
+      */
+     json_object_set_k_fn  set_k ;
+     /**
+      * @see json_object_del_k_fn
+      */
+     json_object_del_k_fn  del_k ;
+     /**
+      * @see json_object_keys_n_fn
+      */
+     json_object_keys_n_fn keys_n;
+     /**
+      * @see json_object_get_n_fn
+      */
+     json_object_get_n_fn  get_n ;
+     /**
+      * @see json_object_set_n_fn
+      */
+     json_object_set_n_fn  set_n ;
+     /**
+      * @see json_object_del_n_fn
+      */
+     json_object_del_n_fn  del_n ;
+     /**
+      * @see json_object_iterate_fn
+      */
+     json_object_iterate_fn iterate;
+     /**
+      * @see json_object_set_int_fn
+      */
+     json_object_set_int_fn    set_int   ;
+     /**
+      * @see json_object_set_double_fn
+      */
+     json_object_set_double_fn set_double;
 };
 
 /**
@@ -195,6 +429,13 @@ typedef unsigned int  (*json_array_count_fn ) (json_array_t *this);
 /**
  * Gets the `index`-th value in the array
  *
+ * The number held by a packed numeric array (see
+ * json_array_as_doubles()) is boxed on first request, and the same
+ * pointer returned afterwards; the rest of the array stays packed. Use
+ * @ref json_array_iterate_fn "iterate()" to read numbers without
+ * boxing them. Several threads may get() and iterate() at the same
+ * time, as long as the array is not changed meanwhile.
+ *
  * @param[in] this the target JSON array
  * @param[in] index the index of the value to get
  *
@@ -244,6 +485,52 @@ typedef void          (*json_array_add_fn   ) (json_array_t *this,            js
  */
 typedef void          (*json_array_del_fn   ) (json_array_t *this, unsigned int index);
 
+/**
+ * Adds an integer immediately after all the known values. The number
+ * is stored inline, and boxed into a @ref json_number only if a
+ * pointer is requested by @ref json_array_get_fn "get()".
+ *
+ * @param[in] this the target JSON array
+ * @param[in] value the integer to add
+ */
+typedef void          (*json_array_add_int_fn   ) (json_array_t *this, long value);
+
+/**
+ * Adds a double immediately after all the known values. The number
+ * is stored inline, and boxed into a @ref json_number only if a
+ * pointer is requested by @ref json_array_get_fn "get()".
+ *
+ * @param[in] this the target JSON array
+ * @param[in] value the double to add
+ */
+typedef void          (*json_array_add_double_fn) (json_array_t *this, double value);
+
+/**
+ * The function called for each value by @ref json_array_iterate_fn
+ * "iterate()".
+ *
+ * Inline numbers are given as transient values: they are only valid
+ * during the call (and freeing them does nothing). Use @ref
+ * json_array_get_fn "get()" to obtain a stable pointer.
+ *
+ * @param[in] array the iterated JSON array
+ * @param[in] index the index of the value
+ * @param[in] value the value
+ * @param[in] data the user data given to @ref json_array_iterate_fn "iterate()"
+ */
+typedef void          (*json_array_iterator_fn  ) (json_array_t *array, unsigned int index, json_value_t *value, void *data);
+
+/**
+ * Calls the `iterator` for each value of the array, in order, without
+ * boxing inline numbers. The array must not be modified during the
+ * iteration.
+ *
+ * @param[in] this the target JSON array
+ * @param[in] iterator the function to call for each value
+ * @param[in] data user data passed to the `iterator`
+ */
+typedef void          (*json_array_iterate_fn   ) (json_array_t *this, json_array_iterator_fn iterator, void *data);
+
 /**
  * The JSON array public interface.
  */
@@ -256,6 +543,10 @@ struct json_array {
       * @see json_array_free_fn
       */
      json_array_free_fn   free  ;
+     /**
+      * The value type tag, see json_type()
+      */
+     json_type_e          type  ;
      /**
       * @see json_array_count_fn
       */
@@ -280,6 +571,18 @@ struct json_array {
       * @see json_array_del_fn
       */
      json_array_del_fn    del   ;
+     /**
+      * @see json_array_add_int_fn
+      */
+     json_array_add_int_fn    add_int   ;
+     /**
+      * @see json_array_add_double_fn
+      */
+     json_array_add_double_fn add_double;
+     /**
+      * @see json_array_iterate_fn
+      */
+     json_array_iterate_fn    iterate   ;
 };
 
 /**
@@ -391,6 +694,10 @@ struct json_string {
       * @see json_string_free_fn
       */
      json_string_free_fn       free      ;
+     /**
+      * The value type tag, see json_type()
+      */
+     json_type_e               type      ;
      /**
       * @see json_string_count_fn
       */
@@ -484,7 +791,7 @@ typedef double (*json_number_to_double_fn) (json_number_t *this);
  * @param[in] decimal_exp the decimal exponent; the actual decimal part is `decimal * 10^-decimal_exp`
  * @param[in] exp the exponent
  */
-typedef void   (*json_number_set_fn      ) (json_number_t *this, int sign, unsigned long integral, unsigned long decimal, int decimal_exp, int exp);
+typedef void   (*json_number_set_fn      ) (json_number_t *this, int sign, uint64_t integral, uint64_t decimal, int decimal_exp, int exp);
 
 /**
  * Fills the string buffer with the exact representation of the JSON
@@ -502,6 +809,42 @@ typedef void   (*json_number_set_fn      ) (json_number_t *this, int sign, unsig
  */
 typedef int    (*json_number_to_string_fn) (json_number_t *this, char *buffer, size_t buffer_size);
 
+/**
+ * Sets the number from a double value.
+ *
+ * @param[in] this the target JSON number
+ * @param[in] value the double value
+ */
+typedef void   (*json_number_set_double_fn) (json_number_t *this, double value);
+
+/**
+ * Gets the number as a 64-bit signed integer. The conversion is exact
+ * (it does not go through floating point).
+ *
+ * @param[in] this the target JSON number
+ * @param[out] value the integer value; clamped to `INT64_MIN` or
+ * `INT64_MAX` if the number is out of range, and truncated towards
+ * zero if the number has a fractional part
+ *
+ * @return non-zero if `value` is exactly the number, 0 if it overflowed
+ * or was truncated
+ */
+typedef int    (*json_number_to_int64_fn ) (json_number_t *this, int64_t *value);
+
+/**
+ * Gets the number as a 64-bit unsigned integer. The conversion is
+ * exact (it does not go through floating point).
+ *
+ * @param[in] this the target JSON number
+ * @param[out] value the integer value; clamped to 0 or `UINT64_MAX`
+ * if the number is out of range, and truncated towards zero if the
+ * number has a fractional part
+ *
+ * @return non-zero if `value` is exactly the number, 0 if it overflowed
+ * or was truncated
+ */
+typedef int    (*json_number_to_uint64_fn) (json_number_t *this, uint64_t *value);
+
 /**
  * The JSON number public interface.
  */
@@ -514,6 +857,10 @@ struct json_number {
       * @see json_number_free_fn
       */
      json_number_free_fn      free     ;
+     /**
+      * The value type tag, see json_type()
+      */
+     json_type_e              type     ;
      /**
       * @see json_number_is_int_fn
       */
@@ -534,6 +881,18 @@ struct json_number {
       * @see json_number_to_string_fn
       */
      json_number_to_string_fn to_string;
+     /**
+      * @see json_number_set_double_fn
+      */
+     json_number_set_double_fn set_double;
+     /**
+      * @see json_number_to_int64_fn
+      */
+     json_number_to_int64_fn  to_int64 ;
+     /**
+      * @see json_number_to_uint64_fn
+      */
+     json_number_to_uint64_fn to_uint64;
 };
 
 /**
@@ -596,6 +955,10 @@ struct json_const {
       * @see json_const_free_fn
       */
      json_const_free_fn   free  ;
+     /**
+      * The value type tag, see json_type()
+      */
+     json_type_e          type  ;
      /**
       * @see json_const_value_fn
       */
@@ -637,6 +1000,10 @@ struct json_value {
       * @see json_value_free_fn
       */
      json_value_free_fn   free  ;
+     /**
+      * The value type tag, see json_type()
+      */
+     json_type_e          type  ;
 };
 
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
@@ -730,6 +1097,15 @@ struct json_visitor {
  */
 __PUBLIC__ json_object_t *json_new_object(cad_memory_t memory);
 
+/**
+ * Creates a new pre-hashed key handle.
+ *
+ * @param[in] string the key string, which must outlive the handle
+ *
+ * @return the key handle, with its length and hash already computed
+ */
+__PUBLIC__ json_key_t     json_key(const char *string);
+
 /**
  * Creates a new array and returns it.
  *
@@ -739,6 +1115,25 @@ __PUBLIC__ json_object_t *json_new_object(cad_memory_t memory);
  */
 __PUBLIC__ json_array_t  *json_new_array (cad_memory_t memory);
 
+/**
+ * Returns a contiguous view of the array values as doubles, converting
+ * the array to the packed doubles representation if needed. That is
+ * only possible if all the values are numbers exactly representable as
+ * doubles.
+ *
+ * The conversion is permanent: the integers of the array are doubles
+ * afterwards (see json_number_is_int_fn). Being a change of the array,
+ * it must not run while other threads read the array.
+ *
+ * The view is valid until the array is modified.
+ *
+ * @param[in] array the array, built by json_new_array()
+ *
+ * @return the values (an empty view for an empty array), or NULL if
+ * the array cannot be packed
+ */
+__PUBLIC__ const double  *json_array_as_doubles(json_array_t *array);
+
 /**
  * Creates a new string and returns it.
  *
@@ -766,6 +1161,74 @@ __PUBLIC__ json_number_t *json_new_number(cad_memory_t memory);
  */
 __PUBLIC__ json_const_t  *json_const(json_const_e value);
 
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/**
+ * Gets the type of a JSON value, without the cost of a visitor.
+ *
+ * @param[in] value the JSON value
+ *
+ * @return the type tag of the value
+ */
+static inline json_type_e json_type(json_value_t *value) {
+     return value->type;
+}
+
+/**
+ * Downcasts a JSON value to an object.
+ *
+ * @param[in] value the JSON value
+ *
+ * @return the value as an object, or `NULL` if it is `NULL` or not an object
+ */
+static inline json_object_t *json_as_object(json_value_t *value) {
+     return value && value->type == json_type_object ? (json_object_t*)value : NULL;
+}
+
+/**
+ * Downcasts a JSON value to an array.
+ *
+ * @param[in] value the JSON value
+ *
+ * @return the value as an array, or `NULL` if it is `NULL` or not an array
+ */
+static inline json_array_t *json_as_array(json_value_t *value) {
+     return value && value->type == json_type_array ? (json_array_t*)value : NULL;
+}
+
+/**
+ * Downcasts a JSON value to a string.
+ *
+ * @param[in] value the JSON value
+ *
+ * @return the value as a string, or `NULL` if it is `NULL` or not a string
+ */
+static inline json_string_t *json_as_string(json_value_t *value) {
+     return value && value->type == json_type_string ? (json_string_t*)value : NULL;
+}
+
+/**
+ * Downcasts a JSON value to a number.
+ *
+ * @param[in] value the JSON value
+ *
+ * @return the value as a number, or `NULL` if it is `NULL` or not a number
+ */
+static inline json_number_t *json_as_number(json_value_t *value) {
+     return value && value->type == json_type_number ? (json_number_t*)value : NULL;
+}
+
+/**
+ * Downcasts a JSON value to a const.
+ *
+ * @param[in] value the JSON value
+ *
+ * @return the value as a const, or `NULL` if it is `NULL` or not a const
+ */
+static inline json_const_t *json_as_const(json_value_t *value) {
+     return value && value->type == json_type_const ? (json_const_t*)value : NULL;
+}
+
 /**
  * @}
  */
@@ -19,81 +19,316 @@
  * @file
  *
  * This file contains the implementation of JSON arrays.
+ *
+ * As long as an array only contains inline numbers it is packed: its
+ * storage is a plain array of 64-bit integers or doubles. It falls back to the
+ * generic slots representation on the first insertion of another kind
+ * of value.
+ *
+ * The value pointers requested from a packed array are boxed one by one
+ * into a side table of chunks, so that the packed data never changes
+ * under concurrent readers; the boxes move into the slots when the
+ * array changes.
  */
 
 #include <string.h>
 
-#include "json_value.h"
+#include "json_internal.h"
+
+typedef enum {
+     array_packed_ints=0,
+     array_packed_doubles,
+     array_slots,
+} json_array_mode_e;
+
+/* integers beyond this magnitude may not be exactly represented as doubles */
+#define MAX_EXACT_DOUBLE_INT (INT64_C(1) << 53)
+
+/* the number of boxes per chunk of the side table */
+#define BOX_CHUNK 64
 
 struct json_array_impl {
      struct json_array fn;
      cad_memory_t memory;
 
-     int capacity;
-     int count;
-     json_value_t **values;
+     json_array_mode_e mode;
+     unsigned int capacity;
+     unsigned int count;
+     union {
+          void        *data;
+          int64_t     *ints;
+          double      *doubles;
+          json_slot_t *slots;
+     } u;
+
+     /* the values boxed by get() while packed: chunks of BOX_CHUNK pointers */
+     void **boxes;
+
+     json_output_cache_t cache;
 };
 
+static size_t item_size(json_array_mode_e mode) {
+     switch(mode) {
+     case array_packed_ints:
+          return sizeof(int64_t);
+     case array_packed_doubles:
+          return sizeof(double);
+     default:
+          return sizeof(json_slot_t);
+     }
+}
+
+static int exact_double(int64_t value) {
+     return value >= -MAX_EXACT_DOUBLE_INT && value <= MAX_EXACT_DOUBLE_INT;
+}
+
 static void accept(struct json_array_impl *this, json_visitor_t *visitor) {
      visitor->visit_array(visitor, (json_array_t*)this);
 }
 
 static void grow(struct json_array_impl *this) {
-     int new_capacity;
-     json_value_t **new_values;
+     size_t size = item_size(this->mode);
+     unsigned int new_capacity;
+     char *new_data;
      if (this->capacity == 0) {
           new_capacity = 4;
-          new_values = (json_value_t **)this->memory.malloc(new_capacity * sizeof(json_value_t*));
+          new_data = (char *)this->memory.malloc(new_capacity * size);
      }
      else {
           new_capacity = this->capacity * 2;
-          new_values = (json_value_t **)this->memory.malloc(new_capacity * sizeof(json_value_t*));
-          memset(new_values + this->capacity, 0, this->capacity * sizeof(json_value_t*));
-          memcpy(new_values, this->values, this->capacity * sizeof(json_value_t*));
-          this->memory.free(this->values);
+          new_data = (char *)this->memory.malloc(new_capacity * size);
+          memcpy(new_data, this->u.data, this->capacity * size);
+          this->memory.free(this->u.data);
      }
+     memset(new_data + this->capacity * size, 0, (new_capacity - this->capacity) * size);
      this->capacity = new_capacity;
-     this->values = new_values;
+     this->u.data = new_data;
+}
+
+static json_slot_t item_slot(struct json_array_impl *this, unsigned int index) {
+     json_slot_t result;
+     switch(this->mode) {
+     case array_packed_ints:
+          result.kind = json_slot_int;
+          result.u.int_value = this->u.ints[index];
+          break;
+     case array_packed_doubles:
+          result.kind = json_slot_double;
+          result.u.double_value = this->u.doubles[index];
+          break;
+     default:
+          result = this->u.slots[index];
+     }
+     return result;
+}
+
+/*
+ * Returns the table at *at, allocating it zeroed if needed. Of two
+ * readers racing to allocate it, the loser frees its own.
+ */
+static void *zeroed_table(void **at, size_t size, cad_memory_t memory) {
+     void *result = __atomic_load_n(at, __ATOMIC_ACQUIRE);
+     if (result == NULL) {
+          void *table = memory.malloc(size);
+          memset(table, 0, size);
+          if (__atomic_compare_exchange_n(at, &result, table, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+               result = table;
+          }
+          else {
+               memory.free(table);
+          }
+     }
+     return result;
+}
+
+/*
+ * Returns the stable value of an item of a packed array, boxing it
+ * into the side table if needed. Concurrent readers may box the same
+ * item: the first one to publish its box wins.
+ */
+static json_value_t *box(struct json_array_impl *this, unsigned int index) {
+     void **chunks = zeroed_table((void **)&(this->boxes), (this->capacity + BOX_CHUNK - 1) / BOX_CHUNK * sizeof(void*), this->memory);
+     void **chunk = zeroed_table(chunks + index / BOX_CHUNK, BOX_CHUNK * sizeof(void*), this->memory);
+     void *result = __atomic_load_n(chunk + index % BOX_CHUNK, __ATOMIC_ACQUIRE);
+     if (result == NULL) {
+          json_slot_t slot = item_slot(this, index);
+          json_value_t *number = json_slot_box(&slot, this->memory); /* boxes the copy */
+          if (__atomic_compare_exchange_n(chunk + index % BOX_CHUNK, &result, number, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+               result = number;
+          }
+          else {
+               number->free(number);
+          }
+     }
+     return (json_value_t *)result;
+}
+
+/*
+ * Returns the box of an item of a packed array, or NULL if the item
+ * was never requested.
+ */
+static json_value_t *boxed(struct json_array_impl *this, unsigned int index) {
+     void **chunk = this->boxes == NULL ? NULL : (void **)this->boxes[index / BOX_CHUNK];
+     return chunk == NULL ? NULL : (json_value_t *)chunk[index % BOX_CHUNK];
+}
+
+static void free_boxes(struct json_array_impl *this) {
+     unsigned int i;
+     if (this->boxes != NULL) {
+          for (i = 0; i < (this->capacity + BOX_CHUNK - 1) / BOX_CHUNK; i++) {
+               if (this->boxes[i] != NULL) this->memory.free(this->boxes[i]);
+          }
+          this->memory.free(this->boxes);
+          this->boxes = NULL;
+     }
+}
+
+/*
+ * Changes the storage representation, keeping the same capacity.
+ */
+static void convert(struct json_array_impl *this, json_array_mode_e mode) {
+     unsigned int i;
+     if (this->capacity > 0) {
+          char *new_data = (char *)this->memory.malloc(this->capacity * item_size(mode));
+          memset(new_data, 0, this->capacity * item_size(mode));
+          for (i = 0; i < this->count; i++) {
+               json_slot_t slot = item_slot(this, i);
+               json_value_t *box = boxed(this, i);
+               if (box != NULL && mode == array_slots) {
+                    slot.kind = json_slot_value;
+                    slot.u.value = box;
+               }
+               switch(mode) {
+               case array_packed_ints:
+                    ((int64_t*)new_data)[i] = slot.u.int_value;
+                    break;
+               case array_packed_doubles:
+                    ((double*)new_data)[i] = slot.kind == json_slot_int ? (double)slot.u.int_value : slot.u.double_value;
+                    break;
+               default:
+                    ((json_slot_t*)new_data)[i] = slot;
+               }
+          }
+          this->memory.free(this->u.data);
+          this->u.data = new_data;
+     }
+     if (mode == array_slots) {
+          free_boxes(this);
+     }
+     this->mode = mode;
+}
+
+/*
+ * Converts the array to packed doubles if all its values can be
+ * exactly represented as doubles. Returns non-zero on success.
+ */
+static int pack_doubles(struct json_array_impl *this) {
+     unsigned int i;
+     switch(this->mode) {
+     case array_packed_doubles:
+          return 1;
+     case array_packed_ints:
+          for (i = 0; i < this->count; i++) {
+               if (!exact_double(this->u.ints[i])) return 0;
+          }
+          break;
+     default:
+          for (i = 0; i < this->count; i++) {
+               json_slot_t *slot = this->u.slots + i;
+               if (slot->kind == json_slot_value || (slot->kind == json_slot_int && !exact_double(slot->u.int_value))) return 0;
+          }
+     }
+     convert(this, array_packed_doubles);
+     return 1;
 }
 
 static unsigned int count(struct json_array_impl *this) {
      return this->count;
 }
 
+/*
+ * The returned value must be stable: the number is boxed, but only
+ * the requested one.
+ */
 static json_value_t *get(struct json_array_impl *this, unsigned int index) {
      json_value_t *result = NULL;
-     if (index >= 0 && index < this->count) {
-          result = this->values[index];
+     if (index < this->count) {
+          if (this->mode != array_slots) {
+               result = box(this, index);
+          }
+          else {
+               result = json_slot_box(this->u.slots + index, this->memory);
+          }
      }
      return result;
 }
 
-static void set(struct json_array_impl *this, unsigned int index, json_value_t *value) {
-     if (index < this->count) {
-          this->values[index] = value;
+static void set_slot(struct json_array_impl *this, unsigned int index, json_slot_t slot) {
+     json_output_cache_invalidate(&(this->cache));
+     if (this->boxes != NULL) {
+          convert(this, array_slots);
      }
-     else {
-          while (index >= this->capacity) {
-               grow(this);
+     switch(this->mode) {
+     case array_packed_ints:
+          if (slot.kind == json_slot_double && pack_doubles(this)) break;
+          if (slot.kind != json_slot_int) convert(this, array_slots);
+          break;
+     case array_packed_doubles:
+          if (slot.kind == json_slot_double) break;
+          if (slot.kind == json_slot_int && exact_double(slot.u.int_value)) break;
+          convert(this, array_slots);
+          break;
+     default:
+          break;
+     }
+     if (index > this->count && this->mode != array_slots) {
+          /* holes are only supported by the generic representation */
+          convert(this, array_slots);
+     }
+
+     while (index >= this->capacity) {
+          grow(this);
+     }
+     switch(this->mode) {
+     case array_packed_ints:
+          this->u.ints[index] = slot.u.int_value;
+          break;
+     case array_packed_doubles:
+          this->u.doubles[index] = slot.kind == json_slot_int ? (double)slot.u.int_value : slot.u.double_value;
+          break;
+     default:
+          if (index < this->count) {
+               json_output_cache_link_slot(NULL, this->u.slots[index]);
           }
-          this->values[index] = value;
+          this->u.slots[index] = slot;
+     }
+     json_output_cache_link_slot(&(this->cache), slot);
+     if (index >= this->count) {
           this->count = index + 1;
      }
 }
 
+static void set(struct json_array_impl *this, unsigned int index, json_value_t *value) {
+     json_slot_t slot = { json_slot_value, { .value = value } };
+     set_slot(this, index, slot);
+}
+
 static void ins(struct json_array_impl *this, unsigned int index, json_value_t *value) {
      if (index >= this->count) {
           set(this, index, value);
      }
      else {
-          if (this->count == this->capacity) {
-               grow(this);
+          if (this->mode != array_slots) {
+               convert(this, array_slots);
           }
-          while (index > this->capacity) {
+          if (this->count == this->capacity) {
                grow(this);
           }
-          memmove(this->values + index + 1, this->values + index, this->count - index);
-          this->values[index] = value;
+          json_output_cache_invalidate(&(this->cache));
+          json_output_cache_link(&(this->cache), value);
+          memmove(this->u.slots + index + 1, this->u.slots + index, (this->count - index) * sizeof(json_slot_t));
+          this->u.slots[index].kind = json_slot_value;
+          this->u.slots[index].u.value = value;
           this->count++;
      }
 }
@@ -102,27 +337,84 @@ static void add(struct json_array_impl *this, json_value_t *value) {
      set(this, this->count, value);
 }
 
+static void add_int(struct json_array_impl *this, long value) {
+     json_slot_t slot = { json_slot_int, { .int_value = value } };
+     set_slot(this, this->count, slot);
+}
+
+static void add_double(struct json_array_impl *this, double value) {
+     json_slot_t slot = { json_slot_double, { .double_value = value } };
+     set_slot(this, this->count, slot);
+}
+
 static void del(struct json_array_impl *this, unsigned int index) {
-     if (index >= 0 && index < this->count) {
-          memmove(this->values + index, this->values + index + 1, this->count - index - 1);
+     if (index < this->count) {
+          size_t size;
+          char *data;
+          json_output_cache_invalidate(&(this->cache));
+          if (this->boxes != NULL) {
+               convert(this, array_slots);
+          }
+          size = item_size(this->mode);
+          data = (char*)this->u.data;
+          if (this->mode == array_slots) {
+               json_output_cache_link_slot(NULL, this->u.slots[index]);
+          }
+          memmove(data + index * size, data + (index + 1) * size, (this->count - index - 1) * size);
           this->count--;
      }
 }
 
+static void iterate_range(struct json_array_impl *this, unsigned int from, unsigned int to, json_array_iterator_fn iterator, void *data) {
+     struct json_number_impl transient;
+     json_slot_t slot;
+     unsigned int i;
+     switch(this->mode) {
+     case array_packed_ints:
+          slot.kind = json_slot_int;
+          for (i = from; i < to; i++) {
+               slot.u.int_value = this->u.ints[i];
+               iterator((json_array_t*)this, i, json_slot_peek(&slot, &transient), data);
+          }
+          break;
+     case array_packed_doubles:
+          slot.kind = json_slot_double;
+          for (i = from; i < to; i++) {
+               slot.u.double_value = this->u.doubles[i];
+               iterator((json_array_t*)this, i, json_slot_peek(&slot, &transient), data);
+          }
+          break;
+     default:
+          for (i = from; i < to; i++) {
+               iterator((json_array_t*)this, i, json_slot_peek(this->u.slots + i, &transient), data);
+          }
+     }
+}
+
+static void iterate(struct json_array_impl *this, json_array_iterator_fn iterator, void *data) {
+     iterate_range(this, 0, this->count, iterator, data);
+}
+
 static void free_(struct json_array_impl *this) {
-     if (this->values) this->memory.free(this->values);
+     free_boxes(this);
+     if (this->u.data) this->memory.free(this->u.data);
+     json_output_cache_free(&(this->cache));
      this->memory.free(this);
 }
 
 static json_array_t fn = {
      (json_array_accept_fn)accept,
      (json_array_free_fn  )free_ ,
+     (json_type_e         )json_type_array,
      (json_array_count_fn )count ,
      (json_array_get_fn   )get   ,
      (json_array_set_fn   )set   ,
      (json_array_set_fn   )ins   ,
      (json_array_add_fn   )add   ,
      (json_array_del_fn   )del   ,
+     (json_array_add_int_fn   )add_int   ,
+     (json_array_add_double_fn)add_double,
+     (json_array_iterate_fn   )iterate   ,
 };
 
 __PUBLIC__ json_array_t *json_new_array(cad_memory_t memory) {
@@ -130,8 +422,64 @@ __PUBLIC__ json_array_t *json_new_array(cad_memory_t memory) {
      if (!result) return NULL;
      result->fn       = fn;
      result->memory   = memory;
+     result->mode     = array_packed_ints;
      result->capacity = 0;
      result->count    = 0;
-     result->values   = NULL;
+     result->u.data   = NULL;
+     result->boxes    = NULL;
+     result->cache.parent = NULL;
+     result->cache.entry  = NULL;
      return &(result->fn);
 }
+
+void json_array_add_slot(json_array_t *array, json_slot_t slot) {
+     struct json_array_impl *this = (struct json_array_impl*)array;
+     set_slot(this, this->count, slot);
+}
+
+void json_array_iterate_range(json_array_t *array, unsigned int from, unsigned int to, json_array_iterator_fn iterator, void *data) {
+     struct json_array_impl *this = (struct json_array_impl*)array;
+     iterate_range(this, from, to < this->count ? to : this->count, iterator, data);
+}
+
+json_output_cache_t *json_array_output_cache(json_array_t *array) {
+     return &(((struct json_array_impl*)array)->cache);
+}
+
+__PUBLIC__ const double *json_array_as_doubles(json_array_t *array) {
+     static const double empty[1] = { 0 };
+     struct json_array_impl *this = (struct json_array_impl*)array;
+     if (!pack_doubles(this)) {
+          return NULL;
+     }
+     return this->count == 0 ? empty : this->u.doubles;
+}
+
+json_value_t *json_array_kill_next(json_array_t *array, unsigned int *at, unsigned int *budget) {
+     struct json_array_impl *this = (struct json_array_impl*)array;
+     json_value_t *result;
+     unsigned int i = *at;
+     if (this->mode != array_slots) {
+          /* packed arrays only hold immediate numbers, and their boxes */
+          if (this->boxes == NULL) {
+               i = this->count;
+          }
+          for (; i < this->count && *budget > 0; i++) {
+               json_value_t *number = boxed(this, i);
+               if (number != NULL) {
+                    number->free(number);
+                    (*budget)--;
+               }
+          }
+          *at = i;
+          return NULL;
+     }
+     for (; i < this->count && *budget > 0; i++) {
+          if ((result = json_kill_slot(this->u.slots[i], budget)) != NULL) {
+               *at = i + 1;
+               return result;
+          }
+     }
+     *at = i;
+     return NULL;
+}
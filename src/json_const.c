@@ -44,9 +44,9 @@ static void free_(struct json_const_impl *this) {
 }
 
 struct json_const_impl _json_const[] = {
-     {{(json_const_accept_fn)accept, (json_const_free_fn)free_, (json_const_value_fn )value}, json_false},
-     {{(json_const_accept_fn)accept, (json_const_free_fn)free_, (json_const_value_fn )value}, json_true },
-     {{(json_const_accept_fn)accept, (json_const_free_fn)free_, (json_const_value_fn )value}, json_null },
+     {{(json_const_accept_fn)accept, (json_const_free_fn)free_, json_type_const, (json_const_value_fn )value}, json_false},
+     {{(json_const_accept_fn)accept, (json_const_free_fn)free_, json_type_const, (json_const_value_fn )value}, json_true },
+     {{(json_const_accept_fn)accept, (json_const_free_fn)free_, json_type_const, (json_const_value_fn )value}, json_null },
 };
 
 __PUBLIC__ json_const_t *json_const(json_const_e value) {
@@ -0,0 +1,517 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @ingroup json_number
+ * @file
+ *
+ * This file contains the number formatters used by the writer: a
+ * table-driven integer formatter, and a Grisu3 double formatter
+ * (Florian Loitsch, "Printing Floating-Point Numbers Quickly and
+ * Accurately with Integers", PLDI 2010) that produces the shortest
+ * representation that reads back exactly, falling back to printf()
+ * for the few values Grisu3 cannot decide.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_internal.h"
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Integers                                                               */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+static const char digit_pairs[] =
+     "00010203040506070809"
+     "10111213141516171819"
+     "20212223242526272829"
+     "30313233343536373839"
+     "40414243444546474849"
+     "50515253545556575859"
+     "60616263646566676869"
+     "70717273747576777879"
+     "80818283848586878889"
+     "90919293949596979899";
+
+int json_format_uint64(char *buffer, uint64_t value) {
+     char digits[20];
+     char *p = digits + sizeof(digits);
+     int length;
+     while (value >= 100) {
+          int pair = (int)(value % 100) * 2;
+          value /= 100;
+          *--p = digit_pairs[pair + 1];
+          *--p = digit_pairs[pair];
+     }
+     if (value >= 10) {
+          int pair = (int)value * 2;
+          *--p = digit_pairs[pair + 1];
+          *--p = digit_pairs[pair];
+     }
+     else {
+          *--p = (char)('0' + value);
+     }
+     length = digits + sizeof(digits) - p;
+     memcpy(buffer, p, length);
+     buffer[length] = '\0';
+     return length;
+}
+
+int json_format_int64(char *buffer, int64_t value) {
+     if (value < 0) {
+          *buffer = '-';
+          return 1 + json_format_uint64(buffer + 1, 0 - (uint64_t)value);
+     }
+     return json_format_uint64(buffer, (uint64_t)value);
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Doubles                                                                */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/* a "do-it-yourself" floating point number: f * 2^e */
+typedef struct diyfp {
+     uint64_t f;
+     int e;
+} diyfp_t;
+
+typedef struct cached_power {
+     uint64_t f;
+     int e;
+     int k;
+} cached_power_t;
+
+/* normalized approximations of 10^k, k = -300, -292, ..., 324 */
+static const cached_power_t cached_powers[] = {
+     { 0xAB70FE17C79AC6CAULL, -1060, -300 },
+     { 0xFF77B1FCBEBCDC4FULL, -1034, -292 },
+     { 0xBE5691EF416BD60CULL, -1007, -284 },
+     { 0x8DD01FAD907FFC3CULL,  -980, -276 },
+     { 0xD3515C2831559A83ULL,  -954, -268 },
+     { 0x9D71AC8FADA6C9B5ULL,  -927, -260 },
+     { 0xEA9C227723EE8BCBULL,  -901, -252 },
+     { 0xAECC49914078536DULL,  -874, -244 },
+     { 0x823C12795DB6CE57ULL,  -847, -236 },
+     { 0xC21094364DFB5637ULL,  -821, -228 },
+     { 0x9096EA6F3848984FULL,  -794, -220 },
+     { 0xD77485CB25823AC7ULL,  -768, -212 },
+     { 0xA086CFCD97BF97F4ULL,  -741, -204 },
+     { 0xEF340A98172AACE5ULL,  -715, -196 },
+     { 0xB23867FB2A35B28EULL,  -688, -188 },
+     { 0x84C8D4DFD2C63F3BULL,  -661, -180 },
+     { 0xC5DD44271AD3CDBAULL,  -635, -172 },
+     { 0x936B9FCEBB25C996ULL,  -608, -164 },
+     { 0xDBAC6C247D62A584ULL,  -582, -156 },
+     { 0xA3AB66580D5FDAF6ULL,  -555, -148 },
+     { 0xF3E2F893DEC3F126ULL,  -529, -140 },
+     { 0xB5B5ADA8AAFF80B8ULL,  -502, -132 },
+     { 0x87625F056C7C4A8BULL,  -475, -124 },
+     { 0xC9BCFF6034C13053ULL,  -449, -116 },
+     { 0x964E858C91BA2655ULL,  -422, -108 },
+     { 0xDFF9772470297EBDULL,  -396, -100 },
+     { 0xA6DFBD9FB8E5B88FULL,  -369,  -92 },
+     { 0xF8A95FCF88747D94ULL,  -343,  -84 },
+     { 0xB94470938FA89BCFULL,  -316,  -76 },
+     { 0x8A08F0F8BF0F156BULL,  -289,  -68 },
+     { 0xCDB02555653131B6ULL,  -263,  -60 },
+     { 0x993FE2C6D07B7FACULL,  -236,  -52 },
+     { 0xE45C10C42A2B3B06ULL,  -210,  -44 },
+     { 0xAA242499697392D3ULL,  -183,  -36 },
+     { 0xFD87B5F28300CA0EULL,  -157,  -28 },
+     { 0xBCE5086492111AEBULL,  -130,  -20 },
+     { 0x8CBCCC096F5088CCULL,  -103,  -12 },
+     { 0xD1B71758E219652CULL,   -77,   -4 },
+     { 0x9C40000000000000ULL,   -50,    4 },
+     { 0xE8D4A51000000000ULL,   -24,   12 },
+     { 0xAD78EBC5AC620000ULL,     3,   20 },
+     { 0x813F3978F8940984ULL,    30,   28 },
+     { 0xC097CE7BC90715B3ULL,    56,   36 },
+     { 0x8F7E32CE7BEA5C70ULL,    83,   44 },
+     { 0xD5D238A4ABE98068ULL,   109,   52 },
+     { 0x9F4F2726179A2245ULL,   136,   60 },
+     { 0xED63A231D4C4FB27ULL,   162,   68 },
+     { 0xB0DE65388CC8ADA8ULL,   189,   76 },
+     { 0x83C7088E1AAB65DBULL,   216,   84 },
+     { 0xC45D1DF942711D9AULL,   242,   92 },
+     { 0x924D692CA61BE758ULL,   269,  100 },
+     { 0xDA01EE641A708DEAULL,   295,  108 },
+     { 0xA26DA3999AEF774AULL,   322,  116 },
+     { 0xF209787BB47D6B85ULL,   348,  124 },
+     { 0xB454E4A179DD1877ULL,   375,  132 },
+     { 0x865B86925B9BC5C2ULL,   402,  140 },
+     { 0xC83553C5C8965D3DULL,   428,  148 },
+     { 0x952AB45CFA97A0B3ULL,   455,  156 },
+     { 0xDE469FBD99A05FE3ULL,   481,  164 },
+     { 0xA59BC234DB398C25ULL,   508,  172 },
+     { 0xF6C69A72A3989F5CULL,   534,  180 },
+     { 0xB7DCBF5354E9BECEULL,   561,  188 },
+     { 0x88FCF317F22241E2ULL,   588,  196 },
+     { 0xCC20CE9BD35C78A5ULL,   614,  204 },
+     { 0x98165AF37B2153DFULL,   641,  212 },
+     { 0xE2A0B5DC971F303AULL,   667,  220 },
+     { 0xA8D9D1535CE3B396ULL,   694,  228 },
+     { 0xFB9B7CD9A4A7443CULL,   720,  236 },
+     { 0xBB764C4CA7A44410ULL,   747,  244 },
+     { 0x8BAB8EEFB6409C1AULL,   774,  252 },
+     { 0xD01FEF10A657842CULL,   800,  260 },
+     { 0x9B10A4E5E9913129ULL,   827,  268 },
+     { 0xE7109BFBA19C0C9DULL,   853,  276 },
+     { 0xAC2820D9623BF429ULL,   880,  284 },
+     { 0x80444B5E7AA7CF85ULL,   907,  292 },
+     { 0xBF21E44003ACDD2DULL,   933,  300 },
+     { 0x8E679C2F5E44FF8FULL,   960,  308 },
+     { 0xD433179D9C8CB841ULL,   986,  316 },
+     { 0x9E19DB92B4E31BA9ULL,  1013,  324 },
+};
+
+#define CACHED_POWERS_MIN_DEC_EXP -300
+#define CACHED_POWERS_DEC_STEP       8
+
+/* the target range of the binary exponent of the scaled numbers */
+#define ALPHA -60
+#define GAMMA -32
+
+static diyfp_t diyfp(uint64_t f, int e) {
+     diyfp_t result = { f, e };
+     return result;
+}
+
+static diyfp_t mul(diyfp_t x, diyfp_t y) {
+     unsigned __int128 p = (unsigned __int128)x.f * y.f;
+     uint64_t h = (uint64_t)(p >> 64);
+     uint64_t l = (uint64_t)p;
+     h += l >> 63; /* round */
+     return diyfp(h, x.e + y.e + 64);
+}
+
+static diyfp_t normalize(diyfp_t x) {
+     int shift = __builtin_clzll(x.f);
+     return diyfp(x.f << shift, x.e - shift);
+}
+
+static diyfp_t normalize_to(diyfp_t x, int e) {
+     return diyfp(x.f << (x.e - e), e);
+}
+
+/*
+ * Computes the normalized value and its (normalized) boundaries
+ * m- and m+, halfway to the neighbouring doubles. The value must be
+ * finite and positive.
+ */
+static diyfp_t boundaries(double value, diyfp_t *m_minus, diyfp_t *m_plus) {
+     uint64_t bits, F;
+     int E;
+     diyfp_t v, plus, minus;
+     memcpy(&bits, &value, sizeof(bits));
+     E = (int)(bits >> 52);
+     F = bits & ((1ULL << 52) - 1);
+     if (E == 0) {
+          v = diyfp(F, 1 - 1075);
+     }
+     else {
+          v = diyfp(F + (1ULL << 52), E - 1075);
+     }
+     plus = diyfp(2 * v.f + 1, v.e - 1);
+     if (F == 0 && E > 1) {
+          /* the lower boundary is closer */
+          minus = diyfp(4 * v.f - 1, v.e - 2);
+     }
+     else {
+          minus = diyfp(2 * v.f - 1, v.e - 1);
+     }
+     *m_plus = normalize(plus);
+     *m_minus = normalize_to(minus, m_plus->e);
+     return normalize(v);
+}
+
+static cached_power_t cached_power(int e) {
+     int f = ALPHA - e - 1;
+     int k = (f * 78913) / (1 << 18) + (f > 0); /* ceil(f * log10(2)) */
+     int index = (-CACHED_POWERS_MIN_DEC_EXP + k + (CACHED_POWERS_DEC_STEP - 1)) / CACHED_POWERS_DEC_STEP;
+     return cached_powers[index];
+}
+
+static int largest_pow10(uint32_t n, uint32_t *pow10) {
+     static const uint32_t pow10s[] = {
+          1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+     };
+     int k = 10;
+     while (k > 1 && n < pow10s[k - 1]) {
+          k--;
+     }
+     *pow10 = pow10s[k - 1];
+     return k;
+}
+
+/*
+ * Moves the last digit down towards w while that gets closer, then
+ * tells whether the digits are provably the shortest and closest ones
+ * given the imprecision (unit) of the scaled numbers.
+ */
+static int round_weed(char *digits, int length, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k, uint64_t unit) {
+     uint64_t small = dist - unit;
+     uint64_t big = dist + unit;
+     while (rest < small && delta - rest >= ten_k
+            && (rest + ten_k < small || small - rest >= rest + ten_k - small)) {
+          digits[length - 1]--;
+          rest += ten_k;
+     }
+     if (rest < big && delta - rest >= ten_k
+         && (rest + ten_k < big || big - rest > rest + ten_k - big)) {
+          /* another candidate might be closer */
+          return 0;
+     }
+     return 2 * unit <= rest && rest <= delta - 4 * unit;
+}
+
+/*
+ * Generates the digits of w from the upper end of the unsafe interval
+ * ]M-, M+[, widened by one unit on both sides; the value is digits *
+ * 10^exponent. Returns -1 if the result cannot be proved right.
+ */
+static int digit_gen(char *digits, int *exponent, diyfp_t M_minus, diyfp_t w, diyfp_t M_plus) {
+     uint64_t unit = 1;
+     uint64_t too_high = M_plus.f + unit;
+     uint64_t delta = too_high - (M_minus.f - unit);
+     uint64_t dist = too_high - w.f;
+     diyfp_t one = diyfp(1ULL << -M_plus.e, M_plus.e);
+     uint32_t p1 = (uint32_t)(too_high >> -one.e);
+     uint64_t p2 = too_high & (one.f - 1);
+     uint32_t pow10;
+     int length = 0, n;
+
+     n = largest_pow10(p1, &pow10);
+     while (n > 0) {
+          uint64_t rest;
+          digits[length++] = (char)('0' + p1 / pow10);
+          p1 %= pow10;
+          n--;
+          rest = ((uint64_t)p1 << -one.e) + p2;
+          if (rest < delta) {
+               *exponent += n;
+               return round_weed(digits, length, dist, delta, rest, (uint64_t)pow10 << -one.e, unit) ? length : -1;
+          }
+          pow10 /= 10;
+     }
+
+     for (;;) {
+          p2 *= 10;
+          unit *= 10;
+          delta *= 10;
+          digits[length++] = (char)('0' + (p2 >> -one.e));
+          p2 &= one.f - 1;
+          n--;
+          if (p2 < delta) {
+               *exponent += n;
+               return round_weed(digits, length, dist * unit, delta, p2, one.f, unit) ? length : -1;
+          }
+     }
+}
+
+/*
+ * Grisu3: the digits, or -1 for the rare values (about 0.5%) where
+ * the precision of the cached powers is not enough to decide.
+ */
+static int grisu3(char *digits, int *exponent, double value) {
+     diyfp_t m_minus, m_plus, v = boundaries(value, &m_minus, &m_plus);
+     cached_power_t cached = cached_power(m_plus.e);
+     diyfp_t c = diyfp(cached.f, cached.e);
+     *exponent = -cached.k;
+     return digit_gen(digits, exponent, mul(m_minus, c), mul(v, c), mul(m_plus, c));
+}
+
+/*
+ * The shortest digits that read back exactly, and among them the
+ * closest to the value. When Grisu3 cannot decide, they are found
+ * among the correctly rounded ones of printf().
+ */
+static int shortest_digits(char *digits, int *exponent, double value) {
+     char buffer[32];
+     int length = grisu3(digits, exponent, value);
+     int p, e;
+     locale_t previous = (locale_t)0;
+     if (length > 0) {
+          while (length > 1 && digits[length - 1] == '0') {
+               length--;
+               (*exponent)++;
+          }
+          return length;
+     }
+     if (json_c_locale != (locale_t)0) {
+          /* for a one-character decimal point */
+          previous = uselocale(json_c_locale);
+     }
+     for (p = 17; p > 1; p--) {
+          snprintf(buffer, sizeof(buffer), "%.*e", p - 2, value);
+          if (strtod(buffer, NULL) != value) {
+               break;
+          }
+     }
+     /* "d.ddde+x" */
+     snprintf(buffer, sizeof(buffer), "%.*e", p - 1, value);
+     digits[0] = buffer[0];
+     if (p > 1) {
+          memcpy(digits + 1, buffer + 2, p - 1);
+     }
+     e = atoi(buffer + (p > 1 ? p + 2 : 2));
+     *exponent = e - (p - 1);
+     if (previous != (locale_t)0) {
+          uselocale(previous);
+     }
+     return p;
+}
+
+static int format_exponent(char *buffer, int exponent) {
+     char *p = buffer;
+     *p++ = 'e';
+     if (exponent < 0) {
+          *p++ = '-';
+          exponent = -exponent;
+     }
+     else {
+          *p++ = '+';
+     }
+     if (exponent < 10) {
+          /* at least two digits, as printf() does */
+          *p++ = '0';
+     }
+     return (p - buffer) + json_format_uint64(p, (uint64_t)exponent);
+}
+
+int json_format_double(char *buffer, double value) {
+     char digits[20];
+     char *p = buffer;
+     int length, exponent, point;
+     uint64_t bits;
+
+     if (value != value) {
+          strcpy(buffer, "nan");
+          return 3;
+     }
+     memcpy(&bits, &value, sizeof(bits));
+     if (bits >> 63) {
+          *p++ = '-';
+          value = -value;
+     }
+     if (value == 0) {
+          strcpy(p, "0");
+          return p + 1 - buffer;
+     }
+     if (value > 1.7976931348623157e308) {
+          strcpy(p, "inf");
+          return p + 3 - buffer;
+     }
+
+     length = shortest_digits(digits, &exponent, value);
+     point = length + exponent; /* the value is 0.digits * 10^point */
+
+     if (point > -4 && point <= 17) {
+          if (exponent >= 0) {
+               /* digits followed by zeros */
+               memcpy(p, digits, length);
+               memset(p + length, '0', exponent);
+               p += point;
+          }
+          else if (point > 0) {
+               memcpy(p, digits, point);
+               p[point] = '.';
+               memcpy(p + point + 1, digits + point, length - point);
+               p += length + 1;
+          }
+          else {
+               *p++ = '0';
+               *p++ = '.';
+               memset(p, '0', -point);
+               memcpy(p - point, digits, length);
+               p += length - point;
+          }
+     }
+     else {
+          *p++ = digits[0];
+          if (length > 1) {
+               *p++ = '.';
+               memcpy(p, digits + 1, length - 1);
+               p += length - 1;
+          }
+          p += format_exponent(p, point - 1);
+     }
+     *p = '\0';
+     return p - buffer;
+}
+
+int json_format_double_canonical(char *buffer, double value) {
+     char digits[20];
+     char *p = buffer;
+     int length, exponent, point;
+
+     if (value != value || value > 1.7976931348623157e308 || value < -1.7976931348623157e308) {
+          /* not representable, as in JSON.stringify() */
+          strcpy(buffer, "null");
+          return 4;
+     }
+     if (value == 0) {
+          /* including -0 */
+          strcpy(buffer, "0");
+          return 1;
+     }
+     if (value < 0) {
+          *p++ = '-';
+          value = -value;
+     }
+
+     length = shortest_digits(digits, &exponent, value);
+     point = length + exponent;
+
+     if (point >= length && point <= 21) {
+          memcpy(p, digits, length);
+          memset(p + length, '0', point - length);
+          p += point;
+     }
+     else if (point > 0 && point <= 21) {
+          memcpy(p, digits, point);
+          p[point] = '.';
+          memcpy(p + point + 1, digits + point, length - point);
+          p += length + 1;
+     }
+     else if (point > -6 && point <= 0) {
+          *p++ = '0';
+          *p++ = '.';
+          memset(p, '0', -point);
+          memcpy(p - point, digits, length);
+          p += length - point;
+     }
+     else {
+          *p++ = digits[0];
+          if (length > 1) {
+               *p++ = '.';
+               memcpy(p, digits + 1, length - 1);
+               p += length - 1;
+          }
+          *p++ = 'e';
+          if (point - 1 < 0) {
+               *p++ = '-';
+               p += json_format_uint64(p, (uint64_t)(1 - point));
+          }
+          else {
+               *p++ = '+';
+               p += json_format_uint64(p, (uint64_t)(point - 1));
+          }
+     }
+     *p = '\0';
+     return p - buffer;
+}
@@ -0,0 +1,379 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _YACJP_JSON_INTERNAL_H_
+#define _YACJP_JSON_INTERNAL_H_
+
+/**
+ * @file
+ * Internal definitions shared by the library implementation files;
+ * not installed.
+ */
+
+#include <locale.h>
+#include <stdint.h>
+
+#include <cad_stream.h>
+
+#include "json_value.h"
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Numbers                                                                */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+struct json_number_impl {
+     struct json_number fn;
+     cad_memory_t memory;
+
+     int is_double;
+     double double_value;
+
+     int sign;
+     uint64_t integral;
+     uint64_t decimal;
+     int decimal_exp;
+     int exponent;
+
+     /* the source text of a lazy number, or NULL; the parts above are
+      * only valid once converted */
+     const char *lexeme;
+     int lexeme_length;
+     int converted;
+};
+
+/* beyond that, decimal digits are insignificant anyway */
+#define JSON_MAX_DECIMAL_DIGITS 19
+#define JSON_MAX_EXPONENT 100000
+
+/*
+ * Appends the digit c to the value; returns 0 (and leaves the value
+ * unchanged) on overflow.
+ */
+static inline int json_accumulate_digit(uint64_t *value, int c) {
+     uint64_t result;
+     if (__builtin_mul_overflow(*value, 10, &result) || __builtin_add_overflow(result, (uint64_t)(c - '0'), &result)) {
+          return 0;
+     }
+     *value = result;
+     return 1;
+}
+
+/*
+ * Creates a lazy number from its (already validated) source text.
+ */
+json_number_t *json_new_lazy_number(cad_memory_t memory, const char *lexeme, int length);
+
+/*
+ * The "C" locale, for the conversions that must not depend on the
+ * locale of the program: JSON numbers always have a decimal point.
+ * It is (locale_t)0 if it could not be created.
+ */
+extern locale_t json_c_locale;
+
+/*
+ * Number formatters: they write the digits and a trailing '\0' into
+ * a buffer of at least JSON_FORMAT_SIZE characters, and return the
+ * number of characters written (not counting the '\0').
+ */
+
+#define JSON_FORMAT_SIZE 32
+
+int json_format_uint64(char *buffer, uint64_t value);
+int json_format_int64 (char *buffer, int64_t value);
+
+/*
+ * Writes the shortest representation of the double that reads back
+ * exactly, in the style of "%.17g".
+ */
+int json_format_double(char *buffer, double value);
+
+/*
+ * Writes the double as ECMAScript does, as required by the canonical
+ * JSON (RFC 8785): the shortest digits that read back exactly, the
+ * closest to the value if there are several, without exponent from
+ * 1e-6 to 1e21; NaN and infinities are written as null.
+ */
+int json_format_double_canonical(char *buffer, double value);
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Streams                                                                */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/*
+ * The size of the streams built by new_json_utf8_stream(), whatever the
+ * encoding.
+ */
+extern const size_t json_utf8_stream_size;
+
+/*
+ * Like new_json_utf8_stream(), but the stream is built in the given
+ * storage (of json_utf8_stream_size bytes) unless it is NULL. Such a
+ * stream must not be freed: the storage may be used again for another
+ * stream.
+ *
+ * If replay is not NULL, it is set to the number of next() calls after
+ * which the stream only forwards to the raw stream (which may then be
+ * read directly instead), or -1 if the stream converts from UTF-16 or
+ * UTF-32.
+ */
+cad_input_stream_t *json_init_utf8_stream(void *storage, cad_input_stream_t *raw, cad_memory_t memory, int *replay);
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Strings                                                                */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/*
+ * Returns 1 if the text is valid UTF-8 (RFC 3629), 0 otherwise.
+ * Vectorized with SSSE3 when the CPU has it (checked at load time).
+ */
+int json_utf8_valid(const char *text, size_t n);
+
+/*
+ * Adds UTF-8 text to a string built by json_new_string(). The text is
+ * validated as a whole, and decoded at once if it is valid; otherwise,
+ * it is added byte by byte as by add_utf8(), which replaces the invalid
+ * sequences by U+FFFD.
+ */
+void json_string_add_utf8_span(json_string_t *string, const char *text, size_t length);
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Container slots                                                        */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/*
+ * Arrays and objects store their values in slots. A slot holds either
+ * a value pointer, or an immediate number that is boxed into a
+ * json_number_t only when a pointer is actually requested.
+ */
+
+typedef enum {
+     json_slot_value=0,
+     json_slot_int,
+     json_slot_double,
+     json_slot_boxing, /* transient, while a reader boxes the number */
+} json_slot_kind_e;
+
+typedef struct json_slot {
+     json_slot_kind_e kind;
+     union {
+          json_value_t *value;
+          int64_t       int_value;
+          double        double_value;
+     } u;
+} json_slot_t;
+
+/*
+ * Returns the value held by the slot, boxing an immediate number (the
+ * slot then holds the boxed pointer, which is stable). Concurrent
+ * readers may box the same slot: the first one claims it with a
+ * compare-and-swap of the slot kind, the others wait for its number.
+ */
+json_value_t *json_slot_box(json_slot_t *slot, cad_memory_t memory);
+
+/*
+ * Returns the value held by the slot without boxing: an immediate
+ * number is exposed through the given transient storage, which is
+ * only valid as long as that storage is. Freeing a transient number
+ * does nothing.
+ */
+json_value_t *json_slot_peek(json_slot_t *slot, struct json_number_impl *transient);
+
+/*
+ * Adds a slot to an array built by json_new_array().
+ */
+void json_array_add_slot(json_array_t *array, json_slot_t slot);
+
+/*
+ * Sets a slot in an object built by json_new_object(); returns the
+ * previous value (boxed if needed), or NULL.
+ */
+json_value_t *json_object_set_slot(json_object_t *object, const char *key, size_t key_len, json_slot_t slot);
+
+/*
+ * Iterates over the items of an array from `from` (included) to `to`
+ * (excluded). Unlike get(), the iteration never changes the array, so
+ * several threads may iterate over distinct ranges at the same time.
+ */
+void json_array_iterate_range(json_array_t *array, unsigned int from, unsigned int to, json_array_iterator_fn iterator, void *data);
+
+/*
+ * Returns the number of entry positions of an object, deleted ones
+ * included.
+ */
+unsigned int json_object_span(json_object_t *object);
+
+/*
+ * Iterates over the fields of an object at the entry positions from
+ * `from` (included) to `to` (excluded), in insertion order; the index
+ * given to the iterator is the position. Like
+ * json_array_iterate_range(), the iteration never changes the object.
+ */
+void json_object_iterate_range(json_object_t *object, unsigned int from, unsigned int to, json_object_iterator_fn iterator, void *data);
+
+/*
+ * Computes the canonical order of the keys of an object (RFC 8785: by
+ * UTF-16 code units), unless it is still known from a previous call;
+ * returns the number of fields.
+ */
+unsigned int json_object_sort(json_object_t *object);
+
+/*
+ * Iterates over the fields of an object from `from` (included) to `to`
+ * (excluded) in the canonical order. Once the order is computed (see
+ * json_object_sort()), the iteration never changes the object.
+ */
+void json_object_iterate_sorted(json_object_t *object, unsigned int from, unsigned int to, json_object_iterator_fn iterator, void *data);
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Destruction                                                            */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/*
+ * Used by json_kill() to free a tree without recursion: frees the
+ * strings, numbers and constants held by an object (or an array) from
+ * the position *at, and stops at the next nested container, which is
+ * returned after *at is moved past it. Each freed value takes one from
+ * the *budget; the functions also stop (returning NULL) when it is
+ * spent. Returns NULL with some budget left at the end; the container
+ * itself, now holding only freed or returned values, may then be
+ * freed.
+ */
+json_value_t *json_object_kill_next(json_object_t *object, unsigned int *at, unsigned int *budget);
+json_value_t *json_array_kill_next(json_array_t *array, unsigned int *at, unsigned int *budget);
+
+/*
+ * The state of json_kill(), so that a tree can also be freed a few
+ * values at a time (see json_kill_async()).
+ */
+
+typedef struct json_kill_frame {
+     json_value_t *container;
+     unsigned int  at; /* the next position to free */
+} json_kill_frame_t;
+
+typedef struct json_kill_state {
+     json_kill_frame_t *stack; /* frames, unless deeper */
+     int capacity;
+     int depth; /* negative once the tree is freed */
+     json_kill_frame_t frames[64];
+} json_kill_state_t;
+
+void json_kill_start(json_kill_state_t *state, json_value_t *container);
+
+/*
+ * Frees at most `max` values of the tree (containers, strings, boxed
+ * numbers and constants); returns the number of values freed. The
+ * tree is completely freed when state->depth is negative.
+ */
+unsigned int json_kill_steps(json_kill_state_t *state, unsigned int max);
+
+/*
+ * Frees the value held by a slot unless it is a container, which is
+ * returned instead; a freed value takes one from the *budget.
+ */
+static inline json_value_t *json_kill_slot(json_slot_t slot, unsigned int *budget) {
+     json_value_t *value = slot.u.value;
+     if (slot.kind == json_slot_value && value != NULL) {
+          switch(value->type) {
+          case json_type_object:
+          case json_type_array:
+               return value;
+          default:
+               value->free(value);
+               (*budget)--;
+          }
+     }
+     return NULL;
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Output cache                                                           */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/*
+ * Objects and arrays may keep their serialized output (see
+ * json_cache_subtrees). Each container links to the cache of the
+ * container that holds it, so that a change invalidates the output of
+ * the whole path up to the root.
+ */
+
+typedef struct json_output_entry {
+     cad_memory_t memory;
+     int    valid;
+     short  options;
+     int    depth;  /* the indentation depth */
+     size_t length;
+     size_t capacity;
+     char   bytes[];
+} json_output_entry_t;
+
+typedef struct json_output_cache {
+     struct json_output_cache *parent;
+     json_output_entry_t *entry; /* NULL until some output is cached */
+} json_output_cache_t;
+
+json_output_cache_t *json_object_output_cache(json_object_t *object);
+json_output_cache_t *json_array_output_cache(json_array_t *array);
+
+/*
+ * Returns the output cache of a container, or NULL for other values.
+ */
+static inline json_output_cache_t *json_output_cache(json_value_t *value) {
+     if (value != NULL) {
+          switch(value->type) {
+          case json_type_object:
+               return json_object_output_cache((json_object_t*)value);
+          case json_type_array:
+               return json_array_output_cache((json_array_t*)value);
+          default:
+               break;
+          }
+     }
+     return NULL;
+}
+
+static inline void json_output_cache_invalidate(json_output_cache_t *cache) {
+     for (; cache != NULL; cache = cache->parent) {
+          if (cache->entry) {
+               cache->entry->valid = 0;
+          }
+     }
+}
+
+/*
+ * Links the value (if it is a container) to the cache of the container
+ * that now holds it; a NULL parent unlinks it.
+ */
+static inline void json_output_cache_link(json_output_cache_t *parent, json_value_t *value) {
+     json_output_cache_t *cache = json_output_cache(value);
+     if (cache) {
+          cache->parent = parent;
+     }
+}
+
+static inline void json_output_cache_link_slot(json_output_cache_t *parent, json_slot_t slot) {
+     if (slot.kind == json_slot_value) {
+          json_output_cache_link(parent, slot.u.value);
+     }
+}
+
+static inline void json_output_cache_free(json_output_cache_t *cache) {
+     if (cache->entry) {
+          cache->entry->memory.free(cache->entry);
+     }
+}
+
+#endif /* _YACJP_JSON_INTERNAL_H_ */
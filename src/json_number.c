@@ -21,41 +21,277 @@
  * This file contains the implementation of JSON numbers.
  */
 
-#include <math.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include "json_value.h"
+#include "json_internal.h"
 
-struct json_number_impl {
-     struct json_number fn;
-     cad_memory_t memory;
+static void accept(struct json_number_impl *this, json_visitor_t *visitor) {
+     visitor->visit_number(visitor, (json_number_t*)this);
+}
 
-     int sign;
-     unsigned long integral;
-     unsigned long decimal;
-     int decimal_exp;
-     int exponent;
+static const uint64_t pow10[] = {
+     1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+     100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+     1000000000000ULL, 10000000000000ULL, 100000000000000ULL, 1000000000000000ULL,
+     10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL,
+     10000000000000000000ULL,
 };
+#define MAX_POW10 19
 
-static void accept(struct json_number_impl *this, json_visitor_t *visitor) {
-     visitor->visit_number(visitor, (json_number_t*)this);
+/* exactly representable as doubles */
+static const double dpow10[] = {
+     1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+#define MAX_DPOW10 22
+#define MAX_EXACT_MANTISSA (1ULL << 53)
+
+#define EXACT      0
+#define FRACTIONAL 1
+#define OVERFLOW   2
+
+/*
+ * Computes `v * 10^n`; returns non-zero on overflow.
+ */
+static int mul_pow10(uint64_t v, int n, uint64_t *result) {
+     if (v == 0) {
+          *result = 0;
+          return 0;
+     }
+     if (n > MAX_POW10) {
+          return 1;
+     }
+     return __builtin_mul_overflow(v, pow10[n], result);
+}
+
+/*
+ * Computes the magnitude of a number held in parts, truncated towards
+ * zero, using integer arithmetic only.
+ *
+ * @return EXACT, FRACTIONAL (the magnitude was truncated) or OVERFLOW
+ */
+static int parts_magnitude(struct json_number_impl *this, uint64_t *magnitude) {
+     int fractional = 0, x = this->exponent, dx = this->decimal_exp;
+     uint64_t a, b;
+     if (x >= 0) {
+          if (mul_pow10(this->integral, x, &a)) {
+               return OVERFLOW;
+          }
+          if (x >= dx) {
+               if (mul_pow10(this->decimal, x - dx, &b)) {
+                    return OVERFLOW;
+               }
+          }
+          else if (dx - x > MAX_POW10) {
+               b = 0;
+               fractional = this->decimal != 0;
+          }
+          else {
+               b = this->decimal / pow10[dx - x];
+               fractional = this->decimal % pow10[dx - x] != 0;
+          }
+          if (__builtin_add_overflow(a, b, magnitude)) {
+               return OVERFLOW;
+          }
+     }
+     else if (-x > MAX_POW10) {
+          *magnitude = 0;
+          fractional = this->integral != 0 || this->decimal != 0;
+     }
+     else {
+          *magnitude = this->integral / pow10[-x];
+          fractional = this->integral % pow10[-x] != 0 || this->decimal != 0;
+     }
+     return fractional ? FRACTIONAL : EXACT;
+}
+
+/*
+ * Computes the parts of a lazy number from its text, once.
+ */
+static void convert(struct json_number_impl *this) {
+     const char *c = this->lexeme, *end = this->lexeme + this->lexeme_length;
+     int s = 1, dx = 0, dz = 0, x = 0, nx = 1, ix = 0;
+     uint64_t i = 0, d = 0;
+
+     if (this->converted) {
+          return;
+     }
+     if (c < end && *c == '-') {
+          s = -1;
+          c++;
+     }
+     for (; c < end && isdigit(*c); c++) {
+          if (ix > 0 || !json_accumulate_digit(&i, *c)) {
+               ix++;
+          }
+     }
+     if (c < end && *c == '.') {
+          for (c++; c < end && isdigit(*c); c++) {
+               if (ix == 0 && dx - dz < JSON_MAX_DECIMAL_DIGITS && json_accumulate_digit(&d, *c)) {
+                    dx++;
+                    dz += d == 0;
+               }
+          }
+     }
+     if (c < end && (*c == 'e' || *c == 'E')) {
+          c++;
+          if (c < end && (*c == '-' || *c == '+')) {
+               nx = *c == '-' ? -1 : 1;
+               c++;
+          }
+          for (; c < end && isdigit(*c); c++) {
+               if (x < JSON_MAX_EXPONENT) {
+                    x = x * 10 + *c - '0';
+               }
+          }
+     }
+
+     this->sign = s;
+     this->integral = i;
+     this->decimal = d;
+     this->decimal_exp = dx;
+     this->exponent = nx * x + ix;
+     this->converted = 1;
+}
+
+static int to_int64(struct json_number_impl *this, int64_t *value) {
+     uint64_t magnitude;
+     int status;
+     if (this->is_double) {
+          double d = this->double_value;
+          if (d != d) {
+               *value = 0;
+               return 0;
+          }
+          if (d >= 9223372036854775808.0) {
+               *value = INT64_MAX;
+               return 0;
+          }
+          if (d < -9223372036854775808.0) {
+               *value = INT64_MIN;
+               return 0;
+          }
+          *value = (int64_t)d;
+          return d == (double)*value;
+     }
+     convert(this);
+     status = parts_magnitude(this, &magnitude);
+     if (this->sign < 0) {
+          if (status == OVERFLOW || magnitude > (uint64_t)INT64_MAX + 1) {
+               *value = INT64_MIN;
+               return 0;
+          }
+          *value = (int64_t)(0 - magnitude);
+     }
+     else {
+          if (status == OVERFLOW || magnitude > (uint64_t)INT64_MAX) {
+               *value = INT64_MAX;
+               return 0;
+          }
+          *value = (int64_t)magnitude;
+     }
+     return status == EXACT;
+}
+
+static int to_uint64(struct json_number_impl *this, uint64_t *value) {
+     uint64_t magnitude;
+     int status;
+     if (this->is_double) {
+          double d = this->double_value;
+          if (d != d || d <= -1.0) {
+               *value = 0;
+               return 0;
+          }
+          if (d >= 18446744073709551616.0) {
+               *value = UINT64_MAX;
+               return 0;
+          }
+          *value = (uint64_t)d;
+          return d == (double)*value;
+     }
+     convert(this);
+     status = parts_magnitude(this, &magnitude);
+     if (status == OVERFLOW) {
+          *value = UINT64_MAX;
+          return 0;
+     }
+     if (this->sign < 0 && magnitude != 0) {
+          *value = 0;
+          return 0;
+     }
+     *value = magnitude;
+     return status == EXACT;
 }
 
 static int is_int(struct json_number_impl *this) {
-     return this->decimal_exp <= this->exponent;
+     int64_t value;
+     return to_int64(this, &value) && value >= LONG_MIN && value <= LONG_MAX;
 }
 
 static long to_int(struct json_number_impl *this) {
-     return this->sign * (long)this->integral * pow(10, this->exponent)
-          + this->sign * (long)this->decimal * pow(10, (this->exponent - this->decimal_exp));
+     int64_t value;
+     to_int64(this, &value);
+     return (long)value;
+}
+
+static int to_string(struct json_number_impl *this, char *buffer, size_t size);
+
+locale_t json_c_locale;
+
+static void __attribute__((constructor)) init_c_locale(void) {
+     json_c_locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t)0);
+}
+
+/*
+ * strtod() in the "C" locale, whatever the locale of the program.
+ */
+static double c_strtod(const char *string) {
+     double result;
+     locale_t previous;
+     if (json_c_locale == (locale_t)0) {
+          return strtod(string, NULL);
+     }
+     previous = uselocale(json_c_locale);
+     result = strtod(string, NULL);
+     uselocale(previous);
+     return result;
 }
 
 static double to_double(struct json_number_impl *this) {
-     return this->sign * (double)this->integral * pow(10, this->exponent)
-          + this->sign * (double)this->decimal / pow(10, (this->decimal_exp - this->exponent));
+     uint64_t mantissa;
+     int e;
+     if (this->is_double) {
+          return this->double_value;
+     }
+     convert(this);
+     e = this->exponent - this->decimal_exp;
+     if (!mul_pow10(this->integral, this->decimal_exp, &mantissa)
+         && !__builtin_add_overflow(mantissa, this->decimal, &mantissa)
+         && mantissa <= MAX_EXACT_MANTISSA && e >= -MAX_DPOW10 && e <= MAX_DPOW10) {
+          /* both operands are exact, hence the result is correctly rounded */
+          double result = e < 0 ? (double)mantissa / dpow10[-e] : (double)mantissa * dpow10[e];
+          return this->sign < 0 ? -result : result;
+     }
+     else if (this->lexeme) {
+          /* the text is more precise than the parts */
+          return c_strtod(this->lexeme);
+     }
+     else {
+          char buffer[128];
+          to_string(this, buffer, sizeof(buffer));
+          return c_strtod(buffer);
+     }
 }
 
-static void set(struct json_number_impl *this, int s, unsigned int i, unsigned int d, int dx, int x) {
+static void set(struct json_number_impl *this, int s, uint64_t i, uint64_t d, int dx, int x) {
+     this->is_double = 0;
+     this->lexeme = NULL;
+     this->lexeme_length = 0;
+     this->converted = 1;
      this->sign = s;
      this->integral = i;
      this->decimal = d;
@@ -63,31 +299,56 @@ static void set(struct json_number_impl *this, int s, unsigned int i, unsigned i
      this->exponent = x;
 }
 
-static int to_string(struct json_number_impl *this, char *buffer, size_t size) {
-     char *sign;
-     if (this->sign < 0) {
-          sign = "-";
+static void set_double(struct json_number_impl *this, double value) {
+     set(this, 0, 0, 0, 0, 0);
+     this->is_double = 1;
+     this->double_value = value;
+}
+
+/*
+ * Appends to a buffer of the given size, snprintf()-style: the length
+ * keeps counting past the end of the buffer.
+ */
+static void append(char *buffer, size_t size, size_t *length, const char *string, size_t n) {
+     if (*length < size) {
+          size_t room = size - *length;
+          memcpy(buffer + *length, string, n < room ? n : room);
      }
-     else {
-          sign = "";
+     *length += n;
+}
+
+static int to_string(struct json_number_impl *this, char *buffer, size_t size) {
+     char digits[JSON_FORMAT_SIZE];
+     size_t length = 0;
+     if (this->lexeme) {
+          append(buffer, size, &length, this->lexeme, this->lexeme_length);
      }
-     if (this->decimal_exp == 0) {
-          if (this->exponent == 0) {
-               return snprintf(buffer, size, "%s%01lu", sign, this->integral);
-          }
-          else {
-               return snprintf(buffer, size, "%s%01lue%+d", sign, this->integral, this->exponent);
-          }
+     else if (this->is_double) {
+          append(buffer, size, &length, digits, json_format_double(digits, this->double_value));
      }
      else {
-          int n = this->decimal_exp - snprintf("", 0, "%lu", this->decimal);
-          if (this->exponent == 0) {
-               return snprintf(buffer, size, "%s%lu.%0*lu", sign, this->integral, n, this->decimal);
+          if (this->sign < 0) {
+               append(buffer, size, &length, "-", 1);
           }
-          else {
-               return snprintf(buffer, size, "%s%lu.%0*lue%+d", sign, this->integral, n, this->decimal, this->exponent);
+          append(buffer, size, &length, digits, json_format_uint64(digits, this->integral));
+          if (this->decimal_exp != 0) {
+               int n = json_format_uint64(digits, this->decimal);
+               append(buffer, size, &length, ".", 1);
+               for (; n < this->decimal_exp; n++) {
+                    append(buffer, size, &length, "0", 1);
+               }
+               append(buffer, size, &length, digits, json_format_uint64(digits, this->decimal));
           }
+          if (this->exponent != 0) {
+               append(buffer, size, &length, "e", 1);
+               append(buffer, size, &length, this->exponent < 0 ? "-" : "+", 1);
+               append(buffer, size, &length, digits, json_format_uint64(digits, this->exponent < 0 ? -(int64_t)this->exponent : this->exponent));
+          }
+     }
+     if (size > 0) {
+          buffer[length < size ? length : size - 1] = '\0';
      }
+     return (int)length;
 }
 
 static void free_(struct json_number_impl *this) {
@@ -97,11 +358,15 @@ static void free_(struct json_number_impl *this) {
 static json_number_t fn = {
      (json_number_accept_fn   )accept   ,
      (json_number_free_fn     )free_    ,
+     (json_type_e             )json_type_number,
      (json_number_is_int_fn   )is_int   ,
      (json_number_to_int_fn   )to_int   ,
      (json_number_to_double_fn)to_double,
      (json_number_set_fn      )set      ,
      (json_number_to_string_fn)to_string,
+     (json_number_set_double_fn)set_double,
+     (json_number_to_int64_fn )to_int64 ,
+     (json_number_to_uint64_fn)to_uint64,
 };
 
 __PUBLIC__ json_number_t *json_new_number(cad_memory_t memory) {
@@ -112,3 +377,90 @@ __PUBLIC__ json_number_t *json_new_number(cad_memory_t memory) {
      set(result, 0, 0, 0, 0, 0);
      return &(result->fn);
 }
+
+json_number_t *json_new_lazy_number(cad_memory_t memory, const char *lexeme, int length) {
+     /* the text is allocated along with the number */
+     struct json_number_impl *result = (struct json_number_impl *)memory.malloc(sizeof(struct json_number_impl) + length + 1);
+     char *text;
+     if (!result) return NULL;
+     result->fn     = fn;
+     result->memory = memory;
+     set(result, 0, 0, 0, 0, 0);
+     text = (char*)(result + 1);
+     memcpy(text, lexeme, length);
+     text[length] = '\0';
+     result->lexeme = text;
+     result->lexeme_length = length;
+     result->converted = 0;
+     return &(result->fn);
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+static void transient_free(void *ptr) {
+     /* nothing: transient numbers live in their owner's storage */
+}
+
+static cad_memory_t transient_memory = {
+     .malloc = NULL,
+     .free   = transient_free,
+};
+
+static void set_slot(struct json_number_impl *this, json_slot_t *slot) {
+     if (slot->kind == json_slot_int) {
+          int64_t i = slot->u.int_value;
+          if (i < 0) {
+               set(this, -1, 0 - (uint64_t)i, 0, 0, 0);
+          }
+          else {
+               set(this, 1, (uint64_t)i, 0, 0, 0);
+          }
+     }
+     else {
+          set_double(this, slot->u.double_value);
+     }
+}
+
+/*
+ * A reader boxing a slot claims it by swapping its kind to boxing,
+ * then publishes the number; the others wait for it. The immediate
+ * number is overwritten meanwhile, so json_slot_peek() reads it
+ * seqlock-style: the kind must not have changed around the read.
+ */
+json_value_t *json_slot_box(json_slot_t *slot, cad_memory_t memory) {
+     json_slot_kind_e kind = __atomic_load_n(&(slot->kind), __ATOMIC_ACQUIRE);
+     while (kind != json_slot_value) {
+          if (kind != json_slot_boxing
+              && __atomic_compare_exchange_n(&(slot->kind), &kind, json_slot_boxing, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+               json_number_t *number = json_new_number(memory);
+               json_slot_t immediate;
+               immediate.kind = kind;
+               immediate.u.int_value = slot->u.int_value;
+               set_slot((struct json_number_impl*)number, &immediate);
+               /* after the claim, for the readers that see the pointer */
+               __atomic_store_n(&(slot->u.value), (json_value_t*)number, __ATOMIC_RELEASE);
+               __atomic_store_n(&(slot->kind), json_slot_value, __ATOMIC_RELEASE);
+               break;
+          }
+          kind = __atomic_load_n(&(slot->kind), __ATOMIC_ACQUIRE);
+     }
+     return slot->u.value;
+}
+
+json_value_t *json_slot_peek(json_slot_t *slot, struct json_number_impl *transient) {
+     json_slot_t immediate;
+     for (;;) {
+          immediate.kind = __atomic_load_n(&(slot->kind), __ATOMIC_ACQUIRE);
+          if (immediate.kind == json_slot_value) {
+               return slot->u.value;
+          }
+          immediate.u.int_value = __atomic_load_n(&(slot->u.int_value), __ATOMIC_ACQUIRE);
+          if (immediate.kind != json_slot_boxing && __atomic_load_n(&(slot->kind), __ATOMIC_RELAXED) == immediate.kind) {
+               break;
+          }
+     }
+     transient->fn = fn;
+     transient->memory = transient_memory;
+     set_slot(transient, &immediate);
+     return (json_value_t*)transient;
+}
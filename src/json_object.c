@@ -19,68 +19,555 @@
  * @file
  *
  * This file contains the implementation of JSON objects.
+ *
+ * The fields are stored in an insertion-ordered open-addressing hash
+ * table: a dense array of entries, in insertion order, and a sparse
+ * index array (linear probing) that points into the entries. Deleted
+ * entries are left as holes until the next resize compacts them.
  */
 
+#include <stdlib.h>
 #include <string.h>
-#include <cad_hash.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+#include "json_internal.h"
+
+#define INDEX_EMPTY -1
+#define INDEX_DUMMY -2
 
-#include "json_value.h"
+#define MIN_INDEX_SIZE 8
+#define USABLE(size) (((size) << 1) / 3)
+
+typedef struct json_object_entry {
+     unsigned int  hash;
+     unsigned int  key_len;
+     char         *key; /* NULL if the entry was deleted */
+     json_slot_t   slot;
+} json_object_entry_t;
 
 struct json_object_impl {
      struct json_object fn;
      cad_memory_t memory;
 
-     cad_hash_t *hash;
+     unsigned int count; /* live entries */
+     unsigned int used;  /* used entries, including deleted ones */
+     unsigned int mask;  /* index size - 1 */
+     int *index;
+     json_object_entry_t *entries;
+
+     json_output_cache_t cache;
+
+     /* the entry positions in canonical key order, if computed since
+      * the last change of the keys */
+     unsigned int *sorted;
+     int sorted_valid;
 };
 
+/*
+ * Keys are hashed with SipHash-1-3, keyed with a per-process random
+ * seed: the hash is word-at-a-time and length-delimited, and an
+ * attacker cannot precompute colliding keys to flood an object.
+ */
+
+static __uint64_t hash_seed[2];
+
+static void __attribute__((constructor)) init_hash_seed(void) {
+     if (getrandom(hash_seed, sizeof(hash_seed), GRND_NONBLOCK) != sizeof(hash_seed)) {
+          struct timespec now;
+          clock_gettime(CLOCK_REALTIME, &now);
+          hash_seed[0] = ((__uint64_t)now.tv_sec << 32) ^ (__uint64_t)now.tv_nsec ^ (__uint64_t)(size_t)&now;
+          hash_seed[1] = ((__uint64_t)getpid() << 32) ^ (__uint64_t)(size_t)&init_hash_seed ^ (__uint64_t)clock();
+     }
+}
+
+#define ROTL(x, b) (__uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do {                                                     \
+          v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);      \
+          v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                         \
+          v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                         \
+          v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);      \
+     } while(0)
+
+static unsigned int hash_key(const char *key, unsigned int key_len) {
+     __uint64_t v0 = hash_seed[0] ^ 0x736f6d6570736575ULL;
+     __uint64_t v1 = hash_seed[1] ^ 0x646f72616e646f6dULL;
+     __uint64_t v2 = hash_seed[0] ^ 0x6c7967656e657261ULL;
+     __uint64_t v3 = hash_seed[1] ^ 0x7465646279746573ULL;
+     __uint64_t b = (__uint64_t)key_len << 56;
+     const unsigned char *in = (const unsigned char*)key;
+     const unsigned char *end = in + (key_len & ~7U);
+     unsigned int result;
+
+     for (; in != end; in += 8) {
+          __uint64_t m;
+          memcpy(&m, in, 8);
+          v3 ^= m;
+          SIPROUND;
+          v0 ^= m;
+     }
+
+     switch (key_len & 7) {
+     case 7: b |= (__uint64_t)in[6] << 48; /* fall through */
+     case 6: b |= (__uint64_t)in[5] << 40; /* fall through */
+     case 5: b |= (__uint64_t)in[4] << 32; /* fall through */
+     case 4: b |= (__uint64_t)in[3] << 24; /* fall through */
+     case 3: b |= (__uint64_t)in[2] << 16; /* fall through */
+     case 2: b |= (__uint64_t)in[1] <<  8; /* fall through */
+     case 1: b |= (__uint64_t)in[0];
+     }
+
+     v3 ^= b;
+     SIPROUND;
+     v0 ^= b;
+     v2 ^= 0xff;
+     SIPROUND;
+     SIPROUND;
+     SIPROUND;
+
+     result = (unsigned int)(v0 ^ v1 ^ v2 ^ v3);
+     /* 0 is reserved for "not yet computed" in json_key_t */
+     return result ? result : 1;
+}
+
+/*
+ * Keys may be shared between threads: the racing threads all compute
+ * and store the same hash, hence the relaxed atomics.
+ */
+static unsigned int key_hash(json_key_t *key) {
+     unsigned int result = __atomic_load_n(&(key->hash), __ATOMIC_RELAXED);
+     if (result == 0) {
+          result = hash_key(key->string, key->length);
+          __atomic_store_n(&(key->hash), result, __ATOMIC_RELAXED);
+     }
+     return result;
+}
+
+/*
+ * Returns the index slot that holds the key, or the empty slot that
+ * ends the probe sequence if the key is not in the object.
+ */
+static unsigned int lookup(struct json_object_impl *this, const char *key, unsigned int key_len, unsigned int hash) {
+     unsigned int i = hash & this->mask;
+     int ix;
+     while ((ix = this->index[i]) != INDEX_EMPTY) {
+          if (ix >= 0) {
+               json_object_entry_t *entry = this->entries + ix;
+               if (entry->hash == hash && entry->key_len == key_len && !memcmp(entry->key, key, key_len)) {
+                    break;
+               }
+          }
+          i = (i + 1) & this->mask;
+     }
+     return i;
+}
+
+static void resize(struct json_object_impl *this) {
+     unsigned int size = MIN_INDEX_SIZE;
+     unsigned int i, j;
+     int *new_index;
+     json_object_entry_t *new_entries;
+
+     while (USABLE(size) <= this->count + (this->count >> 1)) {
+          size <<= 1;
+     }
+
+     new_index = (int*)this->memory.malloc(size * sizeof(int));
+     new_entries = (json_object_entry_t*)this->memory.malloc(USABLE(size) * sizeof(json_object_entry_t));
+     memset(new_index, 0xff, size * sizeof(int)); /* all INDEX_EMPTY */
+
+     for (i = j = 0; i < this->used; i++) {
+          json_object_entry_t *entry = this->entries + i;
+          if (entry->key) {
+               unsigned int k = entry->hash & (size - 1);
+               while (new_index[k] != INDEX_EMPTY) {
+                    k = (k + 1) & (size - 1);
+               }
+               new_index[k] = j;
+               new_entries[j++] = *entry;
+          }
+     }
+
+     if (this->index) {
+          this->memory.free(this->index);
+          this->memory.free(this->entries);
+     }
+     this->index   = new_index;
+     this->entries = new_entries;
+     this->mask    = size - 1;
+     this->used    = j;
+     this->sorted_valid = 0;
+}
+
 static void accept(struct json_object_impl *this, json_visitor_t *visitor) {
      visitor->visit_object(visitor, (json_object_t*)this);
 }
 
 static unsigned int count(struct json_object_impl *this) {
-     return this->hash->count(this->hash);
+     return this->count;
 }
 
-static void keys_iterator(struct json_object_impl *this, int index, const char *key, json_value_t *value, const char **keys) {
-     keys[index] = key;
+static void keys(struct json_object_impl *this, const char **keys) {
+     unsigned int i, n = 0;
+     for (i = 0; i < this->used; i++) {
+          json_object_entry_t *entry = this->entries + i;
+          if (entry->key) {
+               keys[n++] = entry->key;
+          }
+     }
 }
 
-static void keys(struct json_object_impl *this, const char **keys) {
-     this->hash->iterate(this->hash, (cad_hash_iterator_fn)keys_iterator, keys);
+static void keys_n(struct json_object_impl *this, const char **keys, size_t *lengths) {
+     unsigned int i, n = 0;
+     for (i = 0; i < this->used; i++) {
+          json_object_entry_t *entry = this->entries + i;
+          if (entry->key) {
+               keys[n] = entry->key;
+               lengths[n++] = entry->key_len;
+          }
+     }
+}
+
+static void iterate(struct json_object_impl *this, json_object_iterator_fn iterator, void *data) {
+     struct json_number_impl transient;
+     unsigned int i, n = 0;
+     for (i = 0; i < this->used; i++) {
+          json_object_entry_t *entry = this->entries + i;
+          if (entry->key) {
+               iterator((json_object_t*)this, n++, entry->key, entry->key_len, json_slot_peek(&(entry->slot), &transient), data);
+          }
+     }
+}
+
+static json_value_t *get_(struct json_object_impl *this, const char *key, unsigned int key_len, unsigned int hash) {
+     json_value_t *result = NULL;
+     if (this->count > 0) {
+          int ix = this->index[lookup(this, key, key_len, hash)];
+          if (ix >= 0) {
+               result = json_slot_box(&(this->entries[ix].slot), this->memory);
+          }
+     }
+     return result;
+}
+
+static json_value_t *set_(struct json_object_impl *this, const char *key, unsigned int key_len, unsigned int hash, json_slot_t slot) {
+     json_value_t *result = NULL;
+     unsigned int i;
+     int ix;
+
+     if (this->index == NULL) {
+          resize(this);
+     }
+     json_output_cache_invalidate(&(this->cache));
+     i = lookup(this, key, key_len, hash);
+     ix = this->index[i];
+     if (ix >= 0) {
+          result = json_slot_box(&(this->entries[ix].slot), this->memory);
+          json_output_cache_link(NULL, result);
+          this->entries[ix].slot = slot;
+     }
+     else {
+          json_object_entry_t *entry;
+          if (this->used == USABLE(this->mask + 1)) {
+               resize(this);
+               i = lookup(this, key, key_len, hash);
+          }
+          entry = this->entries + this->used;
+          entry->hash    = hash;
+          entry->key_len = key_len;
+          entry->key     = (char*)this->memory.malloc(key_len + 1);
+          entry->slot    = slot;
+          memcpy(entry->key, key, key_len);
+          entry->key[key_len] = '\0';
+          this->index[i] = this->used++;
+          this->count++;
+          this->sorted_valid = 0;
+     }
+     json_output_cache_link_slot(&(this->cache), slot);
+     return result;
+}
+
+static json_value_t *del_(struct json_object_impl *this, const char *key, unsigned int key_len, unsigned int hash) {
+     json_value_t *result = NULL;
+     if (this->count > 0) {
+          unsigned int i = lookup(this, key, key_len, hash);
+          int ix = this->index[i];
+          if (ix >= 0) {
+               json_object_entry_t *entry = this->entries + ix;
+               result = json_slot_box(&(entry->slot), this->memory);
+               json_output_cache_invalidate(&(this->cache));
+               json_output_cache_link(NULL, result);
+               this->memory.free(entry->key);
+               entry->key = NULL;
+               this->index[i] = INDEX_DUMMY;
+               this->count--;
+               this->sorted_valid = 0;
+          }
+     }
+     return result;
+}
+
+static json_slot_t value_slot(json_value_t *value) {
+     json_slot_t result = { json_slot_value, { .value = value } };
+     return result;
 }
 
 static json_value_t *get(struct json_object_impl *this, const char *key) {
-     return (json_value_t*)this->hash->get(this->hash, key);
+     unsigned int key_len = strlen(key);
+     return get_(this, key, key_len, hash_key(key, key_len));
 }
 
 static json_value_t *set(struct json_object_impl *this, const char *key, json_value_t *value) {
-     return (json_value_t*)this->hash->set(this->hash, key, value);
+     unsigned int key_len = strlen(key);
+     return set_(this, key, key_len, hash_key(key, key_len), value_slot(value));
 }
 
 static json_value_t *del(struct json_object_impl *this, const char *key) {
-     return (json_value_t*)this->hash->del(this->hash, key);
+     unsigned int key_len = strlen(key);
+     return del_(this, key, key_len, hash_key(key, key_len));
+}
+
+static json_value_t *get_n(struct json_object_impl *this, const char *key, size_t key_len) {
+     return get_(this, key, key_len, hash_key(key, key_len));
+}
+
+static json_value_t *set_n(struct json_object_impl *this, const char *key, size_t key_len, json_value_t *value) {
+     return set_(this, key, key_len, hash_key(key, key_len), value_slot(value));
+}
+
+static json_value_t *del_n(struct json_object_impl *this, const char *key, size_t key_len) {
+     return del_(this, key, key_len, hash_key(key, key_len));
+}
+
+static json_value_t *set_int(struct json_object_impl *this, const char *key, long value) {
+     unsigned int key_len = strlen(key);
+     json_slot_t slot = { json_slot_int, { .int_value = value } };
+     return set_(this, key, key_len, hash_key(key, key_len), slot);
+}
+
+static json_value_t *set_double(struct json_object_impl *this, const char *key, double value) {
+     unsigned int key_len = strlen(key);
+     json_slot_t slot = { json_slot_double, { .double_value = value } };
+     return set_(this, key, key_len, hash_key(key, key_len), slot);
+}
+
+static json_value_t *get_k(struct json_object_impl *this, json_key_t *key) {
+     return get_(this, key->string, key->length, key_hash(key));
+}
+
+static json_value_t *set_k(struct json_object_impl *this, json_key_t *key, json_value_t *value) {
+     return set_(this, key->string, key->length, key_hash(key), value_slot(value));
+}
+
+static json_value_t *del_k(struct json_object_impl *this, json_key_t *key) {
+     return del_(this, key->string, key->length, key_hash(key));
 }
 
 static void free_(struct json_object_impl *this) {
-     this->hash->free(this->hash);
+     unsigned int i;
+     if (this->index) {
+          for (i = 0; i < this->used; i++) {
+               if (this->entries[i].key) {
+                    this->memory.free(this->entries[i].key);
+               }
+          }
+          this->memory.free(this->index);
+          this->memory.free(this->entries);
+     }
+     json_output_cache_free(&(this->cache));
+     if (this->sorted) {
+          this->memory.free(this->sorted);
+     }
      this->memory.free(this);
 }
 
 static json_object_t fn = {
      (json_object_accept_fn)accept ,
      (json_object_free_fn  )free_  ,
+     (json_type_e          )json_type_object,
      (json_object_count_fn )count  ,
      (json_object_keys_fn  )keys   ,
      (json_object_get_fn   )get    ,
      (json_object_set_fn   )set    ,
      (json_object_del_fn   )del    ,
+     (json_object_get_k_fn )get_k  ,
+     (json_object_set_k_fn )set_k  ,
+     (json_object_del_k_fn )del_k  ,
+     (json_object_keys_n_fn)keys_n ,
+     (json_object_get_n_fn )get_n  ,
+     (json_object_set_n_fn )set_n  ,
+     (json_object_del_n_fn )del_n  ,
+     (json_object_iterate_fn)iterate,
+     (json_object_set_int_fn   )set_int   ,
+     (json_object_set_double_fn)set_double,
 };
 
 __PUBLIC__ json_object_t *json_new_object(cad_memory_t memory) {
      struct json_object_impl *result = (struct json_object_impl *)memory.malloc(sizeof(struct json_object_impl));
      if (!result) return NULL;
-     result->fn     = fn;
-     result->memory = memory;
-     result->hash   = cad_new_hash(memory, cad_hash_strings);
+     result->fn      = fn;
+     result->memory  = memory;
+     result->count   = 0;
+     result->used    = 0;
+     result->mask    = 0;
+     result->index   = NULL;
+     result->entries = NULL;
+     result->cache.parent = NULL;
+     result->cache.entry  = NULL;
+     result->sorted       = NULL;
+     result->sorted_valid = 0;
      return &(result->fn);
 }
+
+__PUBLIC__ json_key_t json_key(const char *string) {
+     json_key_t result = {
+          .string = string,
+          .length = strlen(string),
+          .hash   = 0,
+     };
+     key_hash(&result);
+     return result;
+}
+
+json_value_t *json_object_set_slot(json_object_t *object, const char *key, size_t key_len, json_slot_t slot) {
+     return set_((struct json_object_impl*)object, key, key_len, hash_key(key, key_len), slot);
+}
+
+json_output_cache_t *json_object_output_cache(json_object_t *object) {
+     return &(((struct json_object_impl*)object)->cache);
+}
+
+unsigned int json_object_span(json_object_t *object) {
+     return ((struct json_object_impl*)object)->used;
+}
+
+void json_object_iterate_range(json_object_t *object, unsigned int from, unsigned int to, json_object_iterator_fn iterator, void *data) {
+     struct json_object_impl *this = (struct json_object_impl*)object;
+     struct json_number_impl transient;
+     unsigned int i;
+     if (to > this->used) {
+          to = this->used;
+     }
+     for (i = from; i < to; i++) {
+          json_object_entry_t *entry = this->entries + i;
+          if (entry->key) {
+               iterator(object, i, entry->key, entry->key_len, json_slot_peek(&(entry->slot), &transient), data);
+          }
+     }
+}
+
+/*
+ * The canonical order (RFC 8785) compares the keys as UTF-16 code
+ * units. The UTF-8 byte order is the code points order, which only
+ * differs for the characters beyond U+FFFF: their surrogates sort
+ * before U+E000..U+FFFF.
+ */
+
+static unsigned int code_point(const unsigned char *key, unsigned int i, unsigned int length) {
+     unsigned int c = key[i], k, result;
+     if (c >= 0xF0) {
+          k = 3;
+          result = c & 0x07;
+     }
+     else if (c >= 0xE0) {
+          k = 2;
+          result = c & 0x0F;
+     }
+     else if (c >= 0xC0) {
+          k = 1;
+          result = c & 0x1F;
+     }
+     else {
+          return c;
+     }
+     for (i++; k > 0 && i < length; k--, i++) {
+          result = (result << 6) | (key[i] & 0x3F);
+     }
+     return result;
+}
+
+static unsigned int utf16_unit(unsigned int code_point) {
+     return code_point >= 0x10000 ? 0xD800 + ((code_point - 0x10000) >> 10) : code_point;
+}
+
+static int compare_entries(const void *a, const void *b) {
+     const json_object_entry_t *x = *(const json_object_entry_t**)a;
+     const json_object_entry_t *y = *(const json_object_entry_t**)b;
+     const unsigned char *kx = (const unsigned char*)x->key, *ky = (const unsigned char*)y->key;
+     unsigned int n = x->key_len < y->key_len ? x->key_len : y->key_len;
+     unsigned int i, start;
+     unsigned int cx, cy;
+     for (i = 0; i < n && kx[i] == ky[i]; i++) {
+          /* common prefix */
+     }
+     if (i == n) {
+          return x->key_len < y->key_len ? -1 : x->key_len > y->key_len;
+     }
+     if (kx[i] < 0x80 && ky[i] < 0x80) {
+          return kx[i] < ky[i] ? -1 : 1;
+     }
+     /* the characters that differ start at the same position */
+     for (start = i; start > 0 && (kx[start] & 0xC0) == 0x80; start--) {
+          /* continuation byte */
+     }
+     cx = code_point(kx, start, x->key_len);
+     cy = code_point(ky, start, y->key_len);
+     if (utf16_unit(cx) != utf16_unit(cy)) {
+          return utf16_unit(cx) < utf16_unit(cy) ? -1 : 1;
+     }
+     return cx < cy ? -1 : cx > cy;
+}
+
+unsigned int json_object_sort(json_object_t *object) {
+     struct json_object_impl *this = (struct json_object_impl*)object;
+     if (!this->sorted_valid && this->count > 0) {
+          json_object_entry_t **entries = (json_object_entry_t**)this->memory.malloc(this->count * sizeof(json_object_entry_t*));
+          unsigned int i, n = 0;
+          for (i = 0; i < this->used; i++) {
+               if (this->entries[i].key) {
+                    entries[n++] = this->entries + i;
+               }
+          }
+          qsort(entries, n, sizeof(json_object_entry_t*), compare_entries);
+          if (this->sorted) {
+               this->memory.free(this->sorted);
+          }
+          this->sorted = (unsigned int*)this->memory.malloc(n * sizeof(unsigned int));
+          for (i = 0; i < n; i++) {
+               this->sorted[i] = entries[i] - this->entries;
+          }
+          this->memory.free(entries);
+          this->sorted_valid = 1;
+     }
+     return this->count;
+}
+
+void json_object_iterate_sorted(json_object_t *object, unsigned int from, unsigned int to, json_object_iterator_fn iterator, void *data) {
+     struct json_object_impl *this = (struct json_object_impl*)object;
+     struct json_number_impl transient;
+     unsigned int i;
+     json_object_sort(object);
+     if (to > this->count) {
+          to = this->count;
+     }
+     for (i = from; i < to; i++) {
+          json_object_entry_t *entry = this->entries + this->sorted[i];
+          iterator(object, i, entry->key, entry->key_len, json_slot_peek(&(entry->slot), &transient), data);
+     }
+}
+
+json_value_t *json_object_kill_next(json_object_t *object, unsigned int *at, unsigned int *budget) {
+     struct json_object_impl *this = (struct json_object_impl*)object;
+     json_value_t *result;
+     unsigned int i;
+     for (i = *at; i < this->used && *budget > 0; i++) {
+          if (this->entries[i].key && (result = json_kill_slot(this->entries[i].slot, budget)) != NULL) {
+               *at = i + 1;
+               return result;
+          }
+     }
+     *at = i;
+     return NULL;
+}
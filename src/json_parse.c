@@ -21,10 +21,12 @@
  * This file contains the implementation of the JSON parser.
  */
 
+#include <limits.h>
 #include <stdarg.h>
 #include <string.h>
 
 #include "json.h"
+#include "json_internal.h"
 
 static void default_on_error(cad_input_stream_t *stream, int line, int column, void *data, const char *format, ...) {
      va_list args;
@@ -37,6 +39,15 @@ static void default_on_error(cad_input_stream_t *stream, int line, int column, v
 
 typedef struct json_parse_context json_parse_context_t;
 
+/*
+ * A container being parsed; for objects, the key of the value being
+ * parsed.
+ */
+typedef struct json_parse_level {
+     json_value_t  *container;
+     json_string_t *key;
+} json_parse_level_t;
+
 struct json_parse_context {
      // functions
      json_on_error_fn on_error;
@@ -47,6 +58,9 @@ struct json_parse_context {
      // the input stream
      cad_input_stream_t *raw_stream;
      cad_input_stream_t *stream;
+     void *stream_storage; // where stream is built
+     int replay;           // the bytes left before stream may be raw_stream, or -1
+     int current;          // the current item of stream
 
      // parser info
      int line;
@@ -56,6 +70,24 @@ struct json_parse_context {
      // json_string->utf8 for object keys
      char *utf8_buffer;
      int   utf8_capacity;
+     json_string_t *utf8_string; // the string in utf8_buffer, if still alive
+     size_t utf8_length;
+
+     // the unescaped string text not yet added
+     char span[256];
+     int  span_length;
+
+     // lazy numbers text
+     int   lazy_numbers;
+     char *number_buffer;
+     int   number_capacity;
+     int   number_length;
+
+     // the open containers, innermost last
+     json_parse_level_t *levels;
+     int depth;
+     int levels_capacity;
+     int max_depth;
 };
 
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
@@ -69,9 +101,8 @@ struct json_parse_context {
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 
 static json_value_t  *parse_value (json_parse_context_t *context);
-static json_object_t *parse_object(json_parse_context_t *context);
-static json_array_t  *parse_array (json_parse_context_t *context);
-static json_number_t *parse_number(json_parse_context_t *context);
+static int            parse_slot  (json_parse_context_t *context, json_slot_t *slot);
+static int            parse_number(json_parse_context_t *context, json_slot_t *slot);
 static json_string_t *parse_string(json_parse_context_t *context);
 static json_const_t  *parse_true  (json_parse_context_t *context);
 static json_const_t  *parse_false (json_parse_context_t *context);
@@ -82,10 +113,19 @@ static json_const_t  *parse_null  (json_parse_context_t *context);
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 
 #define error(context, message, ...) (context)->on_error((context)->raw_stream, (context)->line, (context)->column, (context)->error_data, message, __VA_ARGS__)
-#define item(context) ((context)->stream->item((context)->stream))
+static int read_item(cad_input_stream_t *stream) {
+     return stream->item(stream);
+}
+
+#define item(context) ((context)->current)
 
 static void next(json_parse_context_t *context) {
      context->stream->next(context->stream);
+     if (context->replay > 0 && --context->replay == 0) {
+          /* the UTF-8 header is replayed: read the raw stream from now on */
+          context->stream = context->raw_stream;
+     }
+     context->current = read_item(context->stream);
      if (item(context) == '\n') {
           context->line++;
           context->column = 0;
@@ -204,21 +244,28 @@ static int skip_word(json_parse_context_t *context, const char *word) {
      return result;
 }
 
-static char *utf8(json_parse_context_t *context, json_string_t *string) {
+static char *utf8(json_parse_context_t *context, json_string_t *string, size_t *length) {
      char *result = context->utf8_buffer;
      int capacity = context->utf8_capacity;
-     int n = string->utf8(string, result, capacity);
+     size_t n;
+     if (context->utf8_string == string) {
+          *length = context->utf8_length;
+          return result;
+     }
+     n = string->utf8(string, result, capacity);
      if (n >= capacity) {
           do {
                capacity <<= 1;
           } while (n >= capacity);
           result = context->memory.malloc(capacity);
-          strcpy(result, context->utf8_buffer);
           context->memory.free(context->utf8_buffer);
           context->utf8_buffer = result;
           context->utf8_capacity = capacity;
           string->utf8(string, result, capacity);
      }
+     context->utf8_string = string;
+     context->utf8_length = n;
+     *length = n;
      return result;
 }
 
@@ -226,45 +273,155 @@ static char *utf8(json_parse_context_t *context, json_string_t *string) {
 /* The parser public function                                             */
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 
-__PUBLIC__ json_value_t *json_parse(cad_input_stream_t *stream, json_on_error_fn on_error, void *error_data, cad_memory_t memory) {
-     json_parse_context_t _context = {
-          .on_error      = on_error ? on_error : &default_on_error,
-          .raw_stream    = stream,
-          .stream        = new_json_utf8_stream(stream, memory),
-          .memory        = memory,
-          .line          = 1,
-          .column        = 0,
-          .error_data    = error_data,
-          .utf8_buffer   = memory.malloc(128),
-          .utf8_capacity = 128,
-     };
-     json_parse_context_t *context = &_context;
+__PUBLIC__ short json_lazy_numbers = 0x01;
+
+/* the initial capacities of the context buffers */
+#define UTF8_CAPACITY   128
+#define NUMBER_CAPACITY 32
+#define LEVELS_CAPACITY 16
+
+static void init_context(json_parse_context_t *context, json_on_error_fn on_error, void *error_data, cad_memory_t memory, short options, int max_depth) {
+     context->on_error        = on_error ? on_error : &default_on_error;
+     context->memory          = memory;
+     context->raw_stream      = NULL;
+     context->stream          = NULL;
+     context->replay          = -1;
+     context->current         = -1;
+     context->stream_storage  = memory.malloc(json_utf8_stream_size);
+     context->error_data      = error_data;
+     context->utf8_buffer     = memory.malloc(UTF8_CAPACITY);
+     context->utf8_capacity   = UTF8_CAPACITY;
+     context->utf8_string     = NULL;
+     context->utf8_length     = 0;
+     context->lazy_numbers    = options & json_lazy_numbers;
+     context->number_buffer   = NULL;
+     context->number_capacity = 0;
+     context->number_length   = 0;
+     context->levels          = memory.malloc(LEVELS_CAPACITY * sizeof(json_parse_level_t));
+     context->depth           = 0;
+     context->levels_capacity = LEVELS_CAPACITY;
+     context->max_depth       = max_depth;
+     if (context->lazy_numbers) {
+          context->number_buffer = memory.malloc(NUMBER_CAPACITY);
+          context->number_capacity = NUMBER_CAPACITY;
+     }
+}
+
+static void free_context(json_parse_context_t *context) {
+     context->memory.free(context->utf8_buffer);
+     if (context->number_buffer) {
+          context->memory.free(context->number_buffer);
+     }
+     context->memory.free(context->levels);
+     context->memory.free(context->stream_storage);
+}
+
+/*
+ * Parses a whole stream; the context buffers are kept as they are,
+ * grown if needed.
+ */
+static json_value_t *parse(json_parse_context_t *context, cad_input_stream_t *stream) {
      json_value_t *result;
+     context->raw_stream  = stream;
+     context->stream      = json_init_utf8_stream(context->stream_storage, stream, context->memory, &(context->replay));
+     if (context->replay == 0) {
+          context->stream = stream;
+     }
+     context->current     = read_item(context->stream);
+     context->line        = 1;
+     context->column      = 0;
+     context->utf8_string = NULL;
+     context->span_length = 0;
+     context->depth       = 0;
      result = parse_value(context);
      skip_blanks(context);
      if (item(context) != -1) {
           error(context, "Trailing characters", 0);
      }
-     memory.free(_context.utf8_buffer);
-     memory.free(_context.stream);
      return result;
 }
 
+__PUBLIC__ json_value_t *json_parse_with_depth(cad_input_stream_t *stream, json_on_error_fn on_error, void *error_data, cad_memory_t memory, short options, int max_depth) {
+     json_parse_context_t context;
+     json_value_t *result;
+     init_context(&context, on_error, error_data, memory, options, max_depth);
+     result = parse(&context, stream);
+     free_context(&context);
+     return result;
+}
+
+__PUBLIC__ json_value_t *json_parse_with(cad_input_stream_t *stream, json_on_error_fn on_error, void *error_data, cad_memory_t memory, short options) {
+     return json_parse_with_depth(stream, on_error, error_data, memory, options, JSON_DEFAULT_MAX_DEPTH);
+}
+
+__PUBLIC__ json_value_t *json_parse(cad_input_stream_t *stream, json_on_error_fn on_error, void *error_data, cad_memory_t memory) {
+     return json_parse_with_depth(stream, on_error, error_data, memory, 0, JSON_DEFAULT_MAX_DEPTH);
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* The reusable parser                                                    */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+struct json_parser_impl {
+     struct json_parser fn;
+     json_parse_context_t context;
+};
+
+static void parser_free(struct json_parser_impl *this) {
+     free_context(&(this->context));
+     this->context.memory.free(this);
+}
+
+static json_value_t *parser_parse(struct json_parser_impl *this, cad_input_stream_t *stream) {
+     return parse(&(this->context), stream);
+}
+
+/*
+ * Reallocates a buffer to its initial capacity if it grew beyond.
+ */
+static void *shrink(cad_memory_t memory, void *buffer, int *capacity, int initial_capacity, size_t item_size) {
+     if (buffer != NULL && *capacity > initial_capacity) {
+          memory.free(buffer);
+          buffer = memory.malloc(initial_capacity * item_size);
+          *capacity = initial_capacity;
+     }
+     return buffer;
+}
+
+static void parser_reset(struct json_parser_impl *this) {
+     json_parse_context_t *context = &(this->context);
+     context->utf8_buffer = shrink(context->memory, context->utf8_buffer, &(context->utf8_capacity), UTF8_CAPACITY, 1);
+     context->utf8_string = NULL;
+     context->number_buffer = shrink(context->memory, context->number_buffer, &(context->number_capacity), NUMBER_CAPACITY, 1);
+     context->levels = shrink(context->memory, context->levels, &(context->levels_capacity), LEVELS_CAPACITY, sizeof(json_parse_level_t));
+}
+
+static json_parser_t parser_fn = {
+     (json_parser_free_fn )parser_free ,
+     (json_parser_parse_fn)parser_parse,
+     (json_parser_reset_fn)parser_reset,
+};
+
+__PUBLIC__ json_parser_t *json_new_parser(json_on_error_fn on_error, void *error_data, cad_memory_t memory, short options, int max_depth) {
+     struct json_parser_impl *result = (struct json_parser_impl *)memory.malloc(sizeof(struct json_parser_impl));
+     if (!result) return NULL;
+     result->fn = parser_fn;
+     init_context(&(result->context), on_error, error_data, memory, options, max_depth);
+     return &(result->fn);
+}
+
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 /* The parser implementation, simple LL(1)                                */
 /* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
 
-static json_value_t *parse_value(json_parse_context_t *context) {
+/*
+ * Parses a scalar value into a slot: numbers are kept inline when
+ * possible. Returns 0 if no value could be parsed.
+ */
+static int parse_slot(json_parse_context_t *context, json_slot_t *slot) {
      json_value_t *result = NULL;
 
-     skip_blanks(context);
      switch(item(context)) {
-     case '{':
-          result = (json_value_t*)parse_object(context);
-          break;
-     case '[':
-          result = (json_value_t*)parse_array(context);
-          break;
      case '"':
           result = (json_value_t*)parse_string(context);
           break;
@@ -288,8 +445,7 @@ static json_value_t *parse_value(json_parse_context_t *context) {
      case '8':
      case '9':
      case '-':
-          result = (json_value_t*)parse_number(context);
-          break;
+          return parse_number(context, slot);
      case -1:
           /* end of stream */
           break;
@@ -297,116 +453,176 @@ static json_value_t *parse_value(json_parse_context_t *context) {
           error(context, "Invalid character '%c' (%d)", item(context), item(context));
      }
 
-     return result;
+     slot->kind = json_slot_value;
+     slot->u.value = result;
+     return result != NULL;
 }
 
-static json_object_t *parse_object(json_parse_context_t *context) {
-     json_object_t *result = json_new_object(context->memory);
-     json_string_t *key;
-     json_value_t  *value;
-
-     int done = 0, err = 0;
-
-     next(context);
-     if (item(context) == '}') {
-          next(context);
-          done = 1;
+/*
+ * Opens a new object or array; returns 0 if the document is too deep.
+ */
+static int push(json_parse_context_t *context, int c) {
+     if (context->max_depth > 0 && context->depth >= context->max_depth) {
+          error(context, "Too deep: more than %d nested levels", context->max_depth);
+          return 0;
      }
-     while (!done && !err) {
-          skip_blanks(context);
-          if (item(context) != '"') {
-               err = 1;
-               error(context, "Expected string", 0);
-          }
-          else {
-               key = parse_string(context);
-               if (key) {
-                    if (result->get(result, utf8(context, key))) {
-                         err = 1;
-                         error(context, "Duplicate key: '%s'", utf8(context, key));
-                    }
-                    else {
-                         skip_blanks(context);
-                         if (item(context) != ':') {
-                              err = 1;
-                              error(context, "Expected ':'", 0);
-                         }
-                         next(context);
-                         value = parse_value(context);
-                         if (!value) {
-                              err = 1;
-                         }
-                         else {
-                              result->set(result, utf8(context, key), value);
-                              key->free(key);
-                              skip_blanks(context);
-                              switch(item(context)) {
-                              case '}':
-                                   next(context);
-                                   done = 1;
-                                   break;
-                              case ',':
-                                   next(context);
-                                   skip_blanks(context);
-                                   if (item(context) == '}') {
-                                        next(context);
-                                        done = 1;
-                                   }
-                                   break;
-                              default:
-                                   err = 1;
-                                   error(context, "Expected ',' or '}'", 0);
-                              }
-                         }
-                    }
-               }
-          }
+     if (context->depth == context->levels_capacity) {
+          int new_capacity = context->levels_capacity * 2;
+          json_parse_level_t *new_levels = context->memory.malloc(new_capacity * sizeof(json_parse_level_t));
+          memcpy(new_levels, context->levels, context->levels_capacity * sizeof(json_parse_level_t));
+          context->memory.free(context->levels);
+          context->levels = new_levels;
+          context->levels_capacity = new_capacity;
      }
+     context->levels[context->depth].container = c == '{' ? (json_value_t*)json_new_object(context->memory) : (json_value_t*)json_new_array(context->memory);
+     context->levels[context->depth].key = NULL;
+     context->depth++;
+     return 1;
+}
 
+static json_slot_t pop(json_parse_context_t *context) {
+     json_slot_t result = { json_slot_value, { .value = context->levels[--context->depth].container } };
      return result;
 }
 
-static json_array_t *parse_array(json_parse_context_t *context) {
-     json_array_t *result = json_new_array(context->memory);
-     json_value_t  *value;
-
-     int done = 0, err = 0;
+/*
+ * Parses an object key and the ':' that follows; returns 0 on error.
+ */
+static int parse_key(json_parse_context_t *context, json_parse_level_t *level) {
+     json_object_t *object = (json_object_t*)level->container;
+     char          *key_utf8;
+     size_t         key_len;
 
+     skip_blanks(context);
+     if (item(context) != '"') {
+          error(context, "Expected string", 0);
+          return 0;
+     }
+     level->key = parse_string(context);
+     if (level->key == NULL) {
+          return 0;
+     }
+     key_utf8 = utf8(context, level->key, &key_len);
+     if (object->get_n(object, key_utf8, key_len)) {
+          error(context, "Duplicate key: '%s'", key_utf8);
+          return 0;
+     }
+     skip_blanks(context);
+     if (item(context) != ':') {
+          error(context, "Expected ':'", 0);
+          return 0;
+     }
      next(context);
-     if (item(context) == ']') {
-          next(context);
-          done = 1;
+     return 1;
+}
+
+static void free_key(json_parse_context_t *context, json_parse_level_t *level) {
+     if (context->utf8_string == level->key) {
+          context->utf8_string = NULL;
      }
-     while (!done && !err) {
+     level->key->free(level->key);
+     level->key = NULL;
+}
+
+/*
+ * Adds a parsed value to the innermost container.
+ */
+static void attach(json_parse_context_t *context, json_parse_level_t *level, json_slot_t slot) {
+     if (level->container->type == json_type_object) {
+          size_t key_len;
+          /* converted again only if nested objects reused the buffer */
+          char *key_utf8 = utf8(context, level->key, &key_len);
+          json_object_set_slot((json_object_t*)level->container, key_utf8, key_len, slot);
+          free_key(context, level);
+     }
+     else {
+          json_array_add_slot((json_array_t*)level->container, slot);
+     }
+}
+
+/*
+ * Parses a value. The nested containers are kept on an explicit stack
+ * rather than parsed recursively, so that the depth of the document is
+ * only limited by the max_depth of the context.
+ *
+ * On error, the containers parsed so far are returned, as is.
+ */
+static json_value_t *parse_value(json_parse_context_t *context) {
+     json_parse_level_t *level;
+     json_slot_t slot;
+     int c, close, err = 0;
+
+     while (!err) {
           skip_blanks(context);
-          value = parse_value(context);
-          if (!value) {
+          c = item(context);
+          if (c == '{' || c == '[') {
+               close = c == '{' ? '}' : ']';
+               if (!push(context, c)) {
+                    err = 1;
+                    break;
+               }
+               next(context);
+               skip_blanks(context);
+               if (item(context) != close) {
+                    /* the first item */
+                    if (c == '{' && !parse_key(context, context->levels + context->depth - 1)) {
+                         err = 1;
+                    }
+                    continue;
+               }
+               next(context);
+               slot = pop(context);
+          }
+          else if (!parse_slot(context, &slot)) {
                err = 1;
+               break;
           }
-          else {
-               result->add(result, value);
+
+          /* add the value to its container, and close the containers
+           * that are complete */
+          while (context->depth > 0) {
+               level = context->levels + context->depth - 1;
+               attach(context, level, slot);
+               close = level->container->type == json_type_object ? '}' : ']';
                skip_blanks(context);
-               switch(item(context)) {
-               case ']':
-                    next(context);
-                    done = 1;
-                    break;
-               case ',':
+               if (item(context) == ',') {
                     next(context);
                     skip_blanks(context);
-                    if (item(context) == ']') {
-                         next(context);
-                         done = 1;
+                    if (item(context) != close) {
+                         /* the next item */
+                         if (close == '}' && !parse_key(context, level)) {
+                              err = 1;
+                         }
+                         break;
                     }
-                    break;
-               default:
+               }
+               else if (item(context) != close) {
+                    error(context, "Expected ',' or '%c'", close);
                     err = 1;
-                    error(context, "Expected ',' or ']'", 0);
+                    break;
                }
+               next(context);
+               slot = pop(context);
+          }
+          if (context->depth == 0) {
+               return json_slot_box(&slot, context->memory);
           }
      }
 
-     return result;
+     /* unwind: each container is added to its parent */
+     slot.kind = json_slot_value;
+     slot.u.value = NULL;
+     while (context->depth > 0) {
+          level = context->levels + context->depth - 1;
+          if (slot.u.value != NULL) {
+               attach(context, level, slot);
+          }
+          else if (level->key != NULL) {
+               free_key(context, level);
+          }
+          slot = pop(context);
+     }
+     return slot.u.value;
 }
 
 #define NUM_STATE_ERROR              -2
@@ -418,26 +634,69 @@ static json_array_t *parse_array(json_parse_context_t *context) {
 #define NUM_STATE_EXP_FIRST          21
 #define NUM_STATE_EXP_MORE           22
 
-static json_number_t *parse_number(json_parse_context_t *context) {
-     json_number_t * result = NULL;
-     int state, dx=0, x=0, n=1, nx=1;
-     unsigned int i=0, d=0;
+static const uint64_t pow10[] = {
+     1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+     100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+     1000000000000ULL, 10000000000000ULL, 100000000000000ULL, 1000000000000000ULL,
+};
+
+/*
+ * True if the number is a plain decimal with at most 15 significant
+ * digits and no trailing zero, that "%.15g" writes back exactly as it
+ * was read: such numbers can be kept inline as doubles (both the
+ * mantissa and the power of ten are exact doubles, hence the division
+ * is correctly rounded).
+ */
+static int is_short_decimal(uint64_t i, uint64_t d, int dx, int x) {
+     uint64_t m;
+     if (x != 0 || dx == 0 || dx > 15 || i >= pow10[15 - dx] || d % 10 == 0) {
+          return 0;
+     }
+     /* at most 15 significant digits, and at most 3 leading zeros
+      * (beyond which "%g" would switch to the exponent notation) */
+     m = i * pow10[dx] + d;
+     return m * 10000 >= pow10[dx];
+}
 
+/*
+ * Consumes the current character of a number, recording it if the
+ * number is lazy.
+ */
+static void take(json_parse_context_t *context) {
+     if (context->lazy_numbers) {
+          if (context->number_length == context->number_capacity) {
+               int capacity = context->number_capacity * 2;
+               char *buffer = context->memory.malloc(capacity);
+               memcpy(buffer, context->number_buffer, context->number_length);
+               context->memory.free(context->number_buffer);
+               context->number_buffer = buffer;
+               context->number_capacity = capacity;
+          }
+          context->number_buffer[context->number_length++] = (char)item(context);
+     }
+     next(context);
+}
+
+static int parse_number(json_parse_context_t *context, json_slot_t *slot) {
+     int state, dx=0, dz=0, x=0, n=1, nx=1, ix=0;
+     uint64_t i=0, d=0;
+
+     context->number_length = 0;
      if (item(context) == '-') {
           n = -1;
-          next(context);
+          take(context);
      }
      switch(item(context)) {
      case '0':
-          next(context);
+          take(context);
           switch(item(context)) {
           case '.':
              state = NUM_STATE_DECIMAL_FIRST;
-             next(context);
+             take(context);
              break;
           case 'e': case 'E':
              state = NUM_STATE_EXP_SIGN_OR_FIRST;
-             next(context);
+             take(context);
              break;
           default:
              state = NUM_STATE_DONE;
@@ -446,9 +705,9 @@ static json_number_t *parse_number(json_parse_context_t *context) {
      case '1': case '2': case '3':
      case '4': case '5': case '6':
      case '7': case '8': case '9':
-          i = (unsigned int)(item(context) - '0');
+          i = (uint64_t)(item(context) - '0');
           state = NUM_STATE_INTEGRAL;
-          next(context);
+          take(context);
           break;
      default:
           state = NUM_STATE_ERROR;
@@ -468,19 +727,25 @@ static json_number_t *parse_number(json_parse_context_t *context) {
                     switch(c) {
                     case '.':
                          state = NUM_STATE_DECIMAL_FIRST;
-                         next(context);
+                         take(context);
                          break;
                     case 'e': case 'E':
                          state = NUM_STATE_EXP_SIGN_OR_FIRST;
-                         next(context);
+                         take(context);
                          break;
                     case '0':
                     case '1': case '2': case '3':
                     case '4': case '5': case '6':
                     case '7': case '8': case '9':
-                         i = i * 10 + (unsigned int)(c - '0');
+                         if (context->lazy_numbers) {
+                              /* converted on demand */
+                         }
+                         else if (ix > 0 || !json_accumulate_digit(&i, c)) {
+                              /* too many digits: drop them, keep the magnitude */
+                              ix++;
+                         }
                          state = NUM_STATE_INTEGRAL;
-                         next(context);
+                         take(context);
                          break;
                     default:
                          state = NUM_STATE_DONE;
@@ -493,10 +758,13 @@ static json_number_t *parse_number(json_parse_context_t *context) {
                     case '1': case '2': case '3':
                     case '4': case '5': case '6':
                     case '7': case '8': case '9':
-                         d = (unsigned int)(c - '0');
-                         dx = 1;
+                         if (ix == 0) {
+                              d = (uint64_t)(c - '0');
+                              dx = 1;
+                              dz = c == '0';
+                         }
                          state = NUM_STATE_DECIMAL_MORE;
-                         next(context);
+                         take(context);
                          break;
                     default:
                          state = NUM_STATE_ERROR;
@@ -508,16 +776,19 @@ static json_number_t *parse_number(json_parse_context_t *context) {
                     switch(c) {
                     case 'e': case 'E':
                          state = NUM_STATE_EXP_SIGN_OR_FIRST;
-                         next(context);
+                         take(context);
                          break;
                     case '0':
                     case '1': case '2': case '3':
                     case '4': case '5': case '6':
                     case '7': case '8': case '9':
-                         d = d * 10 + (unsigned int)(c - '0');
-                         dx++;
+                         /* the leading zeros do not count as significant */
+                         if (!context->lazy_numbers && ix == 0 && dx - dz < JSON_MAX_DECIMAL_DIGITS && json_accumulate_digit(&d, c)) {
+                              dx++;
+                              dz += d == 0;
+                         }
                          state = NUM_STATE_DECIMAL_MORE;
-                         next(context);
+                         take(context);
                          break;
                     default:
                          state = NUM_STATE_DONE;
@@ -528,12 +799,12 @@ static json_number_t *parse_number(json_parse_context_t *context) {
                     switch(c) {
                     case '+':
                          state = NUM_STATE_EXP_FIRST;
-                         next(context);
+                         take(context);
                          break;
                     case '-':
                          nx = -1;
                          state = NUM_STATE_EXP_FIRST;
-                         next(context);
+                         take(context);
                          break;
                     case '0':
                     case '1': case '2': case '3':
@@ -541,7 +812,7 @@ static json_number_t *parse_number(json_parse_context_t *context) {
                     case '7': case '8': case '9':
                          x = c - '0';
                          state = NUM_STATE_EXP_MORE;
-                         next(context);
+                         take(context);
                          break;
                     default:
                          state = NUM_STATE_ERROR;
@@ -557,7 +828,7 @@ static json_number_t *parse_number(json_parse_context_t *context) {
                     case '7': case '8': case '9':
                          x = c - '0';
                          state = NUM_STATE_EXP_MORE;
-                         next(context);
+                         take(context);
                          break;
                     default:
                          state = NUM_STATE_ERROR;
@@ -571,9 +842,11 @@ static json_number_t *parse_number(json_parse_context_t *context) {
                     case '1': case '2': case '3':
                     case '4': case '5': case '6':
                     case '7': case '8': case '9':
-                         x = x * 10 + c - '0';
+                         if (!context->lazy_numbers && x < JSON_MAX_EXPONENT) {
+                              x = x * 10 + c - '0';
+                         }
                          state = NUM_STATE_EXP_MORE;
-                         next(context);
+                         take(context);
                          break;
                     default:
                          state = NUM_STATE_DONE;
@@ -583,12 +856,35 @@ static json_number_t *parse_number(json_parse_context_t *context) {
           }
      }
 
-     if (state == NUM_STATE_DONE) {
-          result = json_new_number(context->memory);
-          result->set(result, n, i, d, dx, nx*x);
+     if (state != NUM_STATE_DONE) {
+          return 0;
      }
 
-     return result;
+     if (context->lazy_numbers) {
+          slot->kind = json_slot_value;
+          slot->u.value = (json_value_t*)json_new_lazy_number(context->memory, context->number_buffer, context->number_length);
+          return 1;
+     }
+
+     x = nx * x + ix;
+     if (dx == 0 && x == 0 && i <= INT64_MAX && !(n < 0 && i == 0)) {
+          /* plain integers are kept inline; "-0" and numbers with a
+           * fraction or an exponent are boxed to keep their exact
+           * representation, unless they are short plain decimals */
+          slot->kind = json_slot_int;
+          slot->u.int_value = n * (int64_t)i;
+     }
+     else if (is_short_decimal(i, d, dx, x)) {
+          slot->kind = json_slot_double;
+          slot->u.double_value = n * ((double)(i * pow10[dx] + d) / (double)pow10[dx]);
+     }
+     else {
+          json_number_t *result = json_new_number(context->memory);
+          result->set(result, n, i, d, dx, x);
+          slot->kind = json_slot_value;
+          slot->u.value = (json_value_t*)result;
+     }
+     return 1;
 }
 
 #define STR_STATE_ERROR    -2
@@ -600,6 +896,17 @@ static json_number_t *parse_number(json_parse_context_t *context) {
 #define STR_STATE_UNICODE2 12
 #define STR_STATE_UNICODE3 13
 
+/*
+ * Adds the unescaped text read so far to the string, as a whole (see
+ * json_string_add_utf8_span()).
+ */
+static void flush_span(json_parse_context_t *context, json_string_t *string) {
+     if (context->span_length > 0) {
+          json_string_add_utf8_span(string, context->span, context->span_length);
+          context->span_length = 0;
+     }
+}
+
 static json_string_t *parse_string(json_parse_context_t *context) {
      int state, unicode;
      json_string_t *result = json_new_string(context->memory);
@@ -618,35 +925,46 @@ static json_string_t *parse_string(json_parse_context_t *context) {
                case STR_STATE_CHAR:
                     switch(c) {
                     case '\\':
+                         flush_span(context, result);
                          state = STR_STATE_ESCAPE;
                          break;
                     case '"':
+                         flush_span(context, result);
                          state = STR_STATE_DONE;
                          break;
                     default:
-                         result->add_utf8(result, c);
+                         if (context->span_length == sizeof(context->span)) {
+                              flush_span(context, result);
+                         }
+                         context->span[context->span_length++] = (char)c;
                     }
                     break;
 
                case STR_STATE_ESCAPE:
                     switch(c) {
-                    case '"': case '\\':
+                    case '"': case '\\': case '/':
                          result->add(result, c);
+                         state = STR_STATE_CHAR;
                          break;
                     case 'b':
                          result->add(result, '\b');
+                         state = STR_STATE_CHAR;
                          break;
                     case 'f':
                          result->add(result, '\f');
+                         state = STR_STATE_CHAR;
                          break;
                     case 'n':
                          result->add(result, '\n');
+                         state = STR_STATE_CHAR;
                          break;
                     case 'r':
                          result->add(result, '\r');
+                         state = STR_STATE_CHAR;
                          break;
                     case 't':
                          result->add(result, '\t');
+                         state = STR_STATE_CHAR;
                          break;
                     case 'u':
                          state = STR_STATE_UNICODE0;
@@ -693,6 +1011,7 @@ static json_string_t *parse_string(json_parse_context_t *context) {
      }
 
      if (state == STR_STATE_ERROR) {
+          context->span_length = 0;
           result->free(result);
           result = NULL;
      }
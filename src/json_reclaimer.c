@@ -0,0 +1,313 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @ingroup json_utils
+ * @file
+ *
+ * This file contains the implementation of the background reclaimer
+ * used by json_kill_async().
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "json.h"
+#include "json_internal.h"
+
+#define DEFAULT_QUEUE_SIZE 1024
+
+/* the rate limit is applied by slices of that many nanoseconds */
+#define SLICE_NS 1000000L
+
+static struct {
+     pthread_mutex_t lock;
+     pthread_cond_t  work;  /* signaled when a tree is queued */
+     pthread_cond_t  idle;  /* signaled when a tree is freed */
+     pthread_cond_t  wake;  /* signaled when the rate limit is lifted */
+     pthread_t thread;
+     int started;
+     int stopping;          /* the thread must exit, see stop() */
+     int forkable;          /* the fork handlers are installed */
+
+     json_value_t **queue; /* ring buffer */
+     unsigned int capacity;
+     unsigned int head;
+     unsigned int count;
+     int busy;             /* freeing a tree that left the queue */
+
+     unsigned long rate;   /* values per second, 0 if unlimited */
+     int draining;         /* the rate limit is lifted while > 0 */
+} reclaimer = {
+     .lock     = PTHREAD_MUTEX_INITIALIZER,
+     .work     = PTHREAD_COND_INITIALIZER,
+     .idle     = PTHREAD_COND_INITIALIZER,
+     .started  = 0,
+     .stopping = 0,
+     .forkable = 0,
+     .queue    = NULL,
+     .capacity = 0,
+     .head     = 0,
+     .count    = 0,
+     .busy     = 0,
+     .rate     = 0,
+     .draining = 0,
+};
+
+/*
+ * Sets the queue capacity; the lock must be held, and the capacity must
+ * be at least the number of queued trees.
+ */
+static void resize_queue(unsigned int capacity) {
+     json_value_t **queue = stdlib_memory.malloc(capacity * sizeof(json_value_t*));
+     unsigned int i;
+     for (i = 0; i < reclaimer.count; i++) {
+          queue[i] = reclaimer.queue[(reclaimer.head + i) % reclaimer.capacity];
+     }
+     if (reclaimer.queue) {
+          stdlib_memory.free(reclaimer.queue);
+     }
+     reclaimer.queue = queue;
+     reclaimer.capacity = capacity;
+     reclaimer.head = 0;
+}
+
+static void next_slice(struct timespec *slice) {
+     slice->tv_nsec += SLICE_NS;
+     if (slice->tv_nsec >= 1000000000L) {
+          slice->tv_nsec -= 1000000000L;
+          slice->tv_sec++;
+     }
+}
+
+/*
+ * If freeing took longer than planned, the next slice starts now:
+ * the reclaimer does not catch up with bursts.
+ */
+static void resync(struct timespec *slice) {
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     if (now.tv_sec > slice->tv_sec || (now.tv_sec == slice->tv_sec && now.tv_nsec > slice->tv_nsec)) {
+          *slice = now;
+     }
+}
+
+/*
+ * Frees a tree, at most rate/1000 values per millisecond unless the
+ * reclaimer is drained. The lock must be held.
+ */
+static void reclaim(json_value_t *tree) {
+     json_kill_state_t state;
+     struct timespec slice;
+     unsigned long rate, slices;
+
+     clock_gettime(CLOCK_MONOTONIC, &slice);
+     json_kill_start(&state, tree);
+     while (state.depth >= 0) {
+          rate = reclaimer.draining ? 0 : reclaimer.rate;
+          pthread_mutex_unlock(&reclaimer.lock);
+          if (rate == 0) {
+               json_kill_steps(&state, UINT_MAX);
+          }
+          else {
+               json_kill_steps(&state, rate < 1000 ? 1 : (rate / 1000 > UINT_MAX ? UINT_MAX : rate / 1000));
+          }
+          pthread_mutex_lock(&reclaimer.lock);
+          if (rate != 0 && state.depth >= 0) {
+               /* below 1000 per second, one value every few slices */
+               for (slices = rate < 1000 ? 1000 / rate : 1; slices > 0; slices--) {
+                    next_slice(&slice);
+               }
+               resync(&slice);
+               while (!reclaimer.draining && pthread_cond_timedwait(&reclaimer.wake, &reclaimer.lock, &slice) != ETIMEDOUT) {
+                    /* wait again */
+               }
+          }
+     }
+}
+
+/*
+ * Takes the next queued tree; the lock must be held, and the queue must
+ * not be empty.
+ */
+static json_value_t *pop(void) {
+     json_value_t *result = reclaimer.queue[reclaimer.head];
+     reclaimer.head = (reclaimer.head + 1) % reclaimer.capacity;
+     reclaimer.count--;
+     return result;
+}
+
+static void *run(void *unused) {
+     json_value_t *tree;
+     pthread_mutex_lock(&reclaimer.lock);
+     for (;;) {
+          while (reclaimer.count == 0 && !reclaimer.stopping) {
+               pthread_cond_wait(&reclaimer.work, &reclaimer.lock);
+          }
+          if (reclaimer.stopping) {
+               break;
+          }
+          tree = pop();
+          reclaimer.busy = 1;
+          reclaim(tree);
+          reclaimer.busy = 0;
+          pthread_cond_broadcast(&reclaimer.idle);
+     }
+     /* json_reclaimer_drain() frees the rest */
+     reclaimer.started = 0;
+     pthread_cond_broadcast(&reclaimer.idle);
+     pthread_mutex_unlock(&reclaimer.lock);
+     return NULL;
+}
+
+/*
+ * Only the forking thread survives in the child: the reclaimer thread
+ * is started again on demand, and frees the trees still queued (the
+ * tree it was freeing, if any, is lost).
+ */
+
+static void before_fork(void) {
+     pthread_mutex_lock(&reclaimer.lock);
+}
+
+static void after_fork_in_parent(void) {
+     pthread_mutex_unlock(&reclaimer.lock);
+}
+
+static void after_fork_in_child(void) {
+     pthread_cond_init(&reclaimer.work, NULL);
+     pthread_cond_init(&reclaimer.idle, NULL);
+     reclaimer.started = 0;
+     reclaimer.busy = 0;
+     reclaimer.draining = 0;
+     pthread_mutex_unlock(&reclaimer.lock);
+}
+
+/*
+ * Starts the reclaimer thread if needed; the lock must be held.
+ * Returns 0 if the thread could not be started.
+ */
+static int start(void) {
+     pthread_condattr_t attr;
+     if (!reclaimer.started && !reclaimer.stopping) {
+          if (reclaimer.queue == NULL) {
+               resize_queue(DEFAULT_QUEUE_SIZE);
+          }
+          if (!reclaimer.forkable) {
+               pthread_atfork(before_fork, after_fork_in_parent, after_fork_in_child);
+               reclaimer.forkable = 1;
+          }
+          /* the rate limit slices are measured on the monotonic clock */
+          pthread_condattr_init(&attr);
+          pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+          pthread_cond_init(&reclaimer.wake, &attr);
+          pthread_condattr_destroy(&attr);
+          if (pthread_create(&reclaimer.thread, NULL, run, NULL)) {
+               pthread_cond_destroy(&reclaimer.wake);
+               return 0;
+          }
+          reclaimer.started = 1;
+     }
+     return reclaimer.started;
+}
+
+/*
+ * Stops the thread when the library is unloaded (or at exit): the
+ * current tree is finished without rate limit, the trees still queued
+ * are left to the process teardown.
+ */
+static void __attribute__((destructor)) stop(void) {
+     int started;
+     pthread_mutex_lock(&reclaimer.lock);
+     started = reclaimer.started;
+     reclaimer.stopping = 1;
+     reclaimer.draining++;
+     pthread_cond_broadcast(&reclaimer.work);
+     if (started) {
+          pthread_cond_broadcast(&reclaimer.wake);
+     }
+     pthread_mutex_unlock(&reclaimer.lock);
+     if (started) {
+          pthread_join(reclaimer.thread, NULL);
+     }
+}
+
+__PUBLIC__ void json_reclaimer_configure(unsigned int queue_size, unsigned long rate) {
+     pthread_mutex_lock(&reclaimer.lock);
+     if (queue_size == 0) {
+          queue_size = DEFAULT_QUEUE_SIZE;
+     }
+     if (queue_size < reclaimer.count) {
+          queue_size = reclaimer.count;
+     }
+     if (queue_size != reclaimer.capacity) {
+          resize_queue(queue_size);
+     }
+     reclaimer.rate = rate;
+     pthread_mutex_unlock(&reclaimer.lock);
+}
+
+__PUBLIC__ void json_kill_async(json_value_t *value) {
+     int queued = 0;
+     if (value == NULL) {
+          return;
+     }
+     if (value->type != json_type_object && value->type != json_type_array) {
+          /* nothing to gain */
+          value->free(value);
+          return;
+     }
+     pthread_mutex_lock(&reclaimer.lock);
+     if (start() && reclaimer.count < reclaimer.capacity) {
+          reclaimer.queue[(reclaimer.head + reclaimer.count) % reclaimer.capacity] = value;
+          reclaimer.count++;
+          pthread_cond_signal(&reclaimer.work);
+          queued = 1;
+     }
+     pthread_mutex_unlock(&reclaimer.lock);
+     if (!queued) {
+          /* the reclaimer is late: free the tree now, rather than
+           * waiting or letting the queue grow */
+          value->accept(value, json_kill());
+     }
+}
+
+__PUBLIC__ void json_reclaimer_drain(void) {
+     json_value_t *tree;
+     pthread_mutex_lock(&reclaimer.lock);
+     reclaimer.draining++;
+     if (reclaimer.started) {
+          pthread_cond_broadcast(&reclaimer.wake);
+     }
+     while (reclaimer.count > 0 || reclaimer.busy) {
+          if (!reclaimer.busy && !start()) {
+               /* no thread (stopped, or it cannot be started in a
+                * forked child): the caller frees the trees */
+               tree = pop();
+               pthread_mutex_unlock(&reclaimer.lock);
+               tree->accept(tree, json_kill());
+               pthread_mutex_lock(&reclaimer.lock);
+          }
+          else {
+               pthread_cond_wait(&reclaimer.idle, &reclaimer.lock);
+          }
+     }
+     reclaimer.draining--;
+     pthread_mutex_unlock(&reclaimer.lock);
+}
@@ -24,6 +24,7 @@
 #include <stdarg.h>
 
 #include "json_stream.h"
+#include "json_internal.h"
 
 typedef struct json_utf8_header {
      unsigned char byte_item[4];
@@ -110,8 +111,8 @@ static cad_input_stream_t utf8_fn = {
      (cad_input_stream_item_fn)utf8_item,
 };
 
-static cad_input_stream_t *new_utf8_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory) {
-     json_utf8_input_stream_t *result = (json_utf8_input_stream_t*)memory.malloc(sizeof(json_utf8_input_stream_t));
+static cad_input_stream_t *new_utf8_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory, void *storage) {
+     json_utf8_input_stream_t *result = (json_utf8_input_stream_t*)(storage ? storage : memory.malloc(sizeof(json_utf8_input_stream_t)));
      result->fn     = utf8_fn;
      result->memory = memory;
      result->nested = raw;
@@ -229,8 +230,8 @@ static cad_input_stream_t utf16_fn = {
      (cad_input_stream_item_fn)utf16_item,
 };
 
-static json_utf16_input_stream_t *new_utf16_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory) {
-     json_utf16_input_stream_t *result = (json_utf16_input_stream_t*)memory.malloc(sizeof(json_utf16_input_stream_t));
+static json_utf16_input_stream_t *new_utf16_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory, void *storage) {
+     json_utf16_input_stream_t *result = (json_utf16_input_stream_t*)(storage ? storage : memory.malloc(sizeof(json_utf16_input_stream_t)));
      result->fn     = utf16_fn;
      result->memory = memory;
      result->nested = raw;
@@ -238,8 +239,8 @@ static json_utf16_input_stream_t *new_utf16_stream(json_utf8_header_t header, ca
      return result;
 }
 
-static cad_input_stream_t *new_utf16be_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory) {
-     json_utf16_input_stream_t *result = new_utf16_stream(header, raw, memory);
+static cad_input_stream_t *new_utf16be_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory, void *storage) {
+     json_utf16_input_stream_t *result = new_utf16_stream(header, raw, memory, storage);
      result->read_short = utf16be_read_short;
      result->header.byte_item[0] = result->header.byte_item[1];
      result->header.byte_item[1] = result->header.byte_item[3];
@@ -247,8 +248,8 @@ static cad_input_stream_t *new_utf16be_stream(json_utf8_header_t header, cad_inp
      return &(result->fn);
 }
 
-static cad_input_stream_t *new_utf16le_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory) {
-     json_utf16_input_stream_t *result = new_utf16_stream(header, raw, memory);
+static cad_input_stream_t *new_utf16le_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory, void *storage) {
+     json_utf16_input_stream_t *result = new_utf16_stream(header, raw, memory, storage);
      result->read_short = utf16le_read_short;
      result->header.byte_item[1] = result->header.byte_item[2];
      result->max_index = 1;
@@ -394,8 +395,8 @@ static cad_input_stream_t utf32_fn = {
      (cad_input_stream_item_fn)utf32_item,
 };
 
-static json_utf32_input_stream_t *new_utf32_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory) {
-     json_utf32_input_stream_t *result = (json_utf32_input_stream_t*)memory.malloc(sizeof(json_utf32_input_stream_t));
+static json_utf32_input_stream_t *new_utf32_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory, void *storage) {
+     json_utf32_input_stream_t *result = (json_utf32_input_stream_t*)(storage ? storage : memory.malloc(sizeof(json_utf32_input_stream_t)));
      result->fn     = utf32_fn;
      result->memory = memory;
      result->nested = raw;
@@ -403,16 +404,16 @@ static json_utf32_input_stream_t *new_utf32_stream(json_utf8_header_t header, ca
      return result;
 }
 
-static cad_input_stream_t *new_utf32be_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory) {
-     json_utf32_input_stream_t *result = new_utf32_stream(header, raw, memory);
+static cad_input_stream_t *new_utf32be_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory, void *storage) {
+     json_utf32_input_stream_t *result = new_utf32_stream(header, raw, memory, storage);
      result->read_int = utf32be_read_int;
      result->header.byte_item[0] = result->header.byte_item[3];
      result->max_index = 0;
      return &(result->fn);
 }
 
-static cad_input_stream_t *new_utf32le_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory) {
-     json_utf32_input_stream_t *result = new_utf32_stream(header, raw, memory);
+static cad_input_stream_t *new_utf32le_stream(json_utf8_header_t header, cad_input_stream_t *raw, cad_memory_t memory, void *storage) {
+     json_utf32_input_stream_t *result = new_utf32_stream(header, raw, memory, storage);
      result->read_int = utf32le_read_int;
      result->max_index = 0;
      return &(result->fn);
@@ -441,27 +442,47 @@ static json_utf8_header_t read_header(cad_input_stream_t *stream) {
      return result;
 }
 
-__PUBLIC__ cad_input_stream_t *new_json_utf8_stream(cad_input_stream_t *raw, cad_memory_t memory) {
+/* any of the streams above */
+typedef union json_input_stream {
+     json_utf8_input_stream_t  utf8;
+     json_utf16_input_stream_t utf16;
+     json_utf32_input_stream_t utf32;
+} json_input_stream_t;
+
+const size_t json_utf8_stream_size = sizeof(json_input_stream_t);
+
+cad_input_stream_t *json_init_utf8_stream(void *storage, cad_input_stream_t *raw, cad_memory_t memory, int *replay) {
      cad_input_stream_t *result;
      json_utf8_header_t header = read_header(raw);
+     int utf8 = 0;
      if (header.byte_item[0] == 0) {
           if (header.byte_item[1] == 0) {
-               result = new_utf32be_stream(header, raw, memory);
+               result = new_utf32be_stream(header, raw, memory, storage);
           }
           else {
-               result = new_utf16be_stream(header, raw, memory);
+               result = new_utf16be_stream(header, raw, memory, storage);
           }
      }
      else if (header.byte_item[1] == 0) {
           if (header.byte_item[2] == 0) {
-               result = new_utf32le_stream(header, raw, memory);
+               result = new_utf32le_stream(header, raw, memory, storage);
           }
           else {
-               result = new_utf16le_stream(header, raw, memory);
+               result = new_utf16le_stream(header, raw, memory, storage);
           }
      }
      else {
-          result = new_utf8_stream(header, raw, memory);
+          result = new_utf8_stream(header, raw, memory, storage);
+          utf8 = 1;
+     }
+     if (replay != NULL) {
+          /* once the header bytes are read again (or at once if there
+           * are none), the UTF-8 stream only forwards to the raw one */
+          *replay = utf8 ? header.eof_index : -1;
      }
      return result;
 }
+
+__PUBLIC__ cad_input_stream_t *new_json_utf8_stream(cad_input_stream_t *raw, cad_memory_t memory) {
+     return json_init_utf8_stream(NULL, raw, memory, NULL);
+}
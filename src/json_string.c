@@ -26,8 +26,16 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* the SSSE3 validator is built whatever the flags, see json_utf8_valid() */
+#define UTF8_SSSE3
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "json_value.h"
+#include "json_internal.h"
 
 typedef struct low_surrogate {
      int        index;
@@ -69,8 +77,7 @@ static void grow_low_surrogates(struct json_string_impl *this) {
      this->low_surrogates = new_low_surrogates;
 }
 
-static void grow_string(struct json_string_impl *this) {
-     int new_capacity = this->string_capacity << 1;
+static void grow_string_to(struct json_string_impl *this, int new_capacity) {
      __uint16_t *new_string = (__uint16_t *)this->memory.malloc(new_capacity * sizeof(__uint16_t));
      memcpy(new_string, this->string, this->string_capacity * sizeof(__uint16_t));
      this->memory.free(this->string);
@@ -78,18 +85,32 @@ static void grow_string(struct json_string_impl *this) {
      this->string = new_string;
 }
 
-static int get_low_surrogate_position(struct json_string_impl *this, int index) {
-     int low = 0, high = this->low_surrogates_count, medium;
+static void grow_string(struct json_string_impl *this) {
+     grow_string_to(this, this->string_capacity << 1);
+}
 
-     if (index == this->low_surrogates[low].index) {
-          return low;
-     }
-     if (index == this->low_surrogates[high].index) {
-          return high;
+/*
+ * Makes room for n more characters.
+ */
+static void reserve(struct json_string_impl *this, int n) {
+     int new_capacity = this->string_capacity;
+     if (this->string_count + n > new_capacity) {
+          do {
+               new_capacity <<= 1;
+          } while (this->string_count + n > new_capacity);
+          grow_string_to(this, new_capacity);
      }
+}
+
+/*
+ * Returns the position of the index in the low surrogates table, or
+ * (-p - 1) if it is not there, p being where it should be inserted.
+ */
+static int get_low_surrogate_position(struct json_string_impl *this, int index) {
+     int low = 0, high = this->low_surrogates_count - 1, medium;
 
-     do {
-          medium = (high+1)>>1;
+     while (low <= high) {
+          medium = (low + high) >> 1;
           if (index == this->low_surrogates[medium].index) {
                return medium;
           }
@@ -99,9 +120,9 @@ static int get_low_surrogate_position(struct json_string_impl *this, int index)
           else {
                high = medium - 1;
           }
-     } while (high > low);
+     }
 
-     return -medium - 1;
+     return -low - 1;
 }
 
 static __uint16_t get_low_surrogate(struct json_string_impl *this, int index) {
@@ -118,7 +139,7 @@ static void set_low_surrogate(struct json_string_impl *this, int index, __uint16
                grow_low_surrogates(this);
           }
           pos = -pos - 1;
-          memmove(this->low_surrogates + pos + 1, this->low_surrogates + pos, this->low_surrogates_count - pos);
+          memmove(this->low_surrogates + pos + 1, this->low_surrogates + pos, (this->low_surrogates_count - pos) * sizeof(low_surrogate_t));
           this->low_surrogates_count++;
      }
 
@@ -156,7 +177,7 @@ static void add_unicode(struct json_string_impl *this, int unicode) {
      }
      if (unicode >= 65536) {
           set_low_surrogate(this, this->string_count, (__uint16_t)(unicode & 0x000003FF));
-          this->string[this->string_count] = (__uint16_t)((unicode / 1024 - 64) & 0x0000FFFF);
+          this->string[this->string_count] = (__uint16_t)(0x0000D800 | ((unicode / 1024 - 64) & 0x000003FF));
      }
      else {
           this->string[this->string_count] = (__uint16_t)unicode;
@@ -165,9 +186,9 @@ static void add_unicode(struct json_string_impl *this, int unicode) {
 }
 
 static int add(struct json_string_impl *this, char c) {
-     int result;
+     int result = -1;
      int k;
-     unicode_char_t v = (unicode_char_t)c;
+     unicode_char_t v = (unsigned char)c;
 
      if (this->accu_count == 0) {
           if (v < 128) {
@@ -267,14 +288,13 @@ static int count(struct json_string_impl *this) {
      return this->string_count;
 }
 
-#define add_to_buffer(v) do {if (result < size) buffer[result] = (char)((v)&0x7f); result++;} while(0)
+#define add_to_buffer(v) do {if (result < size) buffer[result] = (char)(v); result++;} while(0)
 
 static size_t utf8(struct json_string_impl *this, char *buffer, size_t size) {
      size_t result = 0;
      int i;
-     //low_surrogate_t ls;
      for (i = 0; i < this->string_count; i++) {
-          int v = this->string[i];
+          unicode_char_t v = this->string[i];
           if (v < 128) {
                add_to_buffer(v);
           }
@@ -283,14 +303,15 @@ static size_t utf8(struct json_string_impl *this, char *buffer, size_t size) {
                     add_to_buffer(v / 64 + 192);
                }
                else {
-                    if (v < 65536) {
-                         add_to_buffer(v / 0x00001000 + 224);
-                    }
-                    else {
+                    if ((v & 0x0000F800) == 0x0000D800) {
+                         v = get(this, i);
                          add_to_buffer(v / 0x00040000 + 240);
                          v %= 0x00040000;
                          add_to_buffer(v / 0x00001000 + 128);
                     }
+                    else {
+                         add_to_buffer(v / 0x00001000 + 224);
+                    }
                     v %= 0x00001000;
                     add_to_buffer(v / 64 + 128);
                }
@@ -309,6 +330,7 @@ static void free_(struct json_string_impl *this) {
 static json_string_t fn = {
      (json_string_accept_fn    )accept     ,
      (json_string_free_fn      )free_      ,
+     (json_type_e              )json_type_string,
      (json_string_count_fn     )count      ,
      (json_string_utf8_fn      )utf8       ,
      (json_string_get_fn       )get        ,
@@ -337,3 +359,239 @@ __PUBLIC__ json_string_t *json_new_string(cad_memory_t memory) {
 
      return &(result->fn);
 }
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* UTF-8 validation                                                       */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/*
+ * Returns the length of the valid UTF-8 sequence at bytes[i] (as per
+ * RFC 3629: no overlong forms, no surrogates, nothing beyond U+10FFFF),
+ * or 0 if there is none.
+ */
+static int valid_sequence(const unsigned char *bytes, size_t i, size_t n) {
+     unsigned char c = bytes[i], min = 0x80, max = 0xBF;
+     int k;
+     if (c < 0x80) {
+          return 1;
+     }
+     else if (c >= 0xC2 && c <= 0xDF) {
+          k = 2;
+     }
+     else if (c >= 0xE0 && c <= 0xEF) {
+          k = 3;
+          if (c == 0xE0) min = 0xA0; /* overlong */
+          if (c == 0xED) max = 0x9F; /* surrogates */
+     }
+     else if (c >= 0xF0 && c <= 0xF4) {
+          k = 4;
+          if (c == 0xF0) min = 0x90; /* overlong */
+          if (c == 0xF4) max = 0x8F; /* beyond U+10FFFF */
+     }
+     else {
+          return 0;
+     }
+     if (i + k > n || bytes[i + 1] < min || bytes[i + 1] > max) {
+          return 0;
+     }
+     if ((k > 2 && (bytes[i + 2] & 0xC0) != 0x80) || (k > 3 && (bytes[i + 3] & 0xC0) != 0x80)) {
+          return 0;
+     }
+     return k;
+}
+
+#ifdef UTF8_SSSE3
+
+#define SSSE3 __attribute__((target("ssse3")))
+
+/*
+ * The lookup algorithm of Keiser and Lemire ("Validating UTF-8 In Less
+ * Than One Instruction Per Byte", 2021): each pair of bytes is
+ * classified by three table lookups on the high and low nibbles of the
+ * first byte and the high nibble of the second one, whose AND gives the
+ * errors; the third and fourth bytes of sequences are checked apart.
+ */
+
+#define TOO_SHORT      (1 << 0) /* 11______ 0_______ or 11______ 11______ */
+#define TOO_LONG       (1 << 1) /* 0_______ 10______ */
+#define OVERLONG_3     (1 << 2) /* 11100000 100_____ */
+#define TOO_LARGE      (1 << 3) /* 11110100 1001____ ... */
+#define SURROGATE      (1 << 4) /* 11101101 101_____ */
+#define OVERLONG_2     (1 << 5) /* 1100000_ 10______ */
+#define TOO_LARGE_1000 (1 << 6) /* 11110101 1000____ ... */
+#define OVERLONG_4     (1 << 6) /* 11110000 1000____ */
+#define TWO_CONTS      (1 << 7) /* 10______ 10______ */
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+static SSSE3 __m128i classify(__m128i input, __m128i previous) {
+     const __m128i nibble = _mm_set1_epi8(0x0F);
+     const __m128i byte_1_high_table = _mm_setr_epi8(
+          TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+          TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+          TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+          TOO_SHORT | OVERLONG_2,
+          TOO_SHORT,
+          TOO_SHORT | OVERLONG_3 | SURROGATE,
+          TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+     const __m128i byte_1_low_table = _mm_setr_epi8(
+          CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+          CARRY | OVERLONG_2,
+          CARRY,
+          CARRY,
+          CARRY | TOO_LARGE,
+          CARRY | TOO_LARGE | TOO_LARGE_1000,
+          CARRY | TOO_LARGE | TOO_LARGE_1000,
+          CARRY | TOO_LARGE | TOO_LARGE_1000,
+          CARRY | TOO_LARGE | TOO_LARGE_1000,
+          CARRY | TOO_LARGE | TOO_LARGE_1000,
+          CARRY | TOO_LARGE | TOO_LARGE_1000,
+          CARRY | TOO_LARGE | TOO_LARGE_1000,
+          CARRY | TOO_LARGE | TOO_LARGE_1000,
+          CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+          CARRY | TOO_LARGE | TOO_LARGE_1000,
+          CARRY | TOO_LARGE | TOO_LARGE_1000);
+     const __m128i byte_2_high_table = _mm_setr_epi8(
+          TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+          TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+          TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+          TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+          TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+          TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+          TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+     __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+     __m128i prev2 = _mm_alignr_epi8(input, previous, 14);
+     __m128i prev3 = _mm_alignr_epi8(input, previous, 13);
+     __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+     __m128i byte_1_low  = _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble));
+     __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+     __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+     /* the third and fourth bytes of sequences must be continuations
+      * (which the lookups see as TWO_CONTS errors) */
+     __m128i third  = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+     __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+     __m128i must_be_continuation = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+     return _mm_xor_si128(must_be_continuation, special);
+}
+
+/*
+ * Non-zero where the block ends in the middle of a sequence.
+ */
+static SSSE3 __m128i incomplete(__m128i input) {
+     const __m128i max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                       (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+     return _mm_subs_epu8(input, max);
+}
+
+static SSSE3 int utf8_valid_ssse3(const char *text, size_t n) {
+     const unsigned char *bytes = (const unsigned char*)text;
+     __m128i previous = _mm_setzero_si128(), input, error = _mm_setzero_si128(), pending = _mm_setzero_si128();
+     unsigned char tail[16];
+     size_t i;
+
+     for (i = 0; i < n; i += 16) {
+          if (i + 16 <= n) {
+               input = _mm_loadu_si128((const __m128i*)(bytes + i));
+          }
+          else {
+               /* padded with ASCII, which ends any pending sequence */
+               memset(tail, 0, sizeof(tail));
+               memcpy(tail, bytes + i, n - i);
+               input = _mm_loadu_si128((const __m128i*)tail);
+          }
+          if (_mm_movemask_epi8(input) == 0) {
+               /* ASCII only: just check that the previous block did
+                * not end in the middle of a sequence */
+               error = _mm_or_si128(error, pending);
+               pending = _mm_setzero_si128();
+          }
+          else {
+               error = _mm_or_si128(error, classify(input, previous));
+               pending = incomplete(input);
+          }
+          previous = input;
+     }
+     error = _mm_or_si128(error, pending);
+     return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+#endif
+
+static int utf8_valid_scalar(const char *text, size_t n) {
+     const unsigned char *bytes = (const unsigned char*)text;
+     size_t i = 0;
+     int k;
+     while (i < n) {
+#ifdef __SSE2__
+          /* skip ASCII blocks */
+          while (i + 16 <= n && _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(bytes + i))) == 0) {
+               i += 16;
+          }
+          if (i == n) {
+               break;
+          }
+#endif
+          k = valid_sequence(bytes, i, n);
+          if (k == 0) {
+               return 0;
+          }
+          i += k;
+     }
+     return 1;
+}
+
+static int (*utf8_valid)(const char *text, size_t n) = utf8_valid_scalar;
+
+#ifdef UTF8_SSSE3
+static void __attribute__((constructor)) init_utf8_valid(void) {
+     __builtin_cpu_init();
+     if (__builtin_cpu_supports("ssse3")) {
+          utf8_valid = utf8_valid_ssse3;
+     }
+}
+#endif
+
+int json_utf8_valid(const char *text, size_t n) {
+     return utf8_valid(text, n);
+}
+
+void json_string_add_utf8_span(json_string_t *string, const char *text, size_t length) {
+     struct json_string_impl *this = (struct json_string_impl*)string;
+     const unsigned char *bytes = (const unsigned char*)text;
+     unicode_char_t v;
+     size_t i;
+     int k;
+
+     if (this->accu_count != 0 || !json_utf8_valid(text, length)) {
+          /* the per-byte decoder replaces the invalid sequences */
+          for (i = 0; i < length; i++) {
+               add(this, text[i]);
+          }
+          return;
+     }
+
+     reserve(this, (int)length);
+     i = 0;
+     while (i < length) {
+          while (i < length && bytes[i] < 0x80) {
+               this->string[this->string_count++] = bytes[i++];
+          }
+          if (i < length) {
+               k = valid_sequence(bytes, i, length);
+               switch(k) {
+               case 2:
+                    v = ((bytes[i] & 0x1F) << 6) | (bytes[i + 1] & 0x3F);
+                    break;
+               case 3:
+                    v = ((bytes[i] & 0x0F) << 12) | ((bytes[i + 1] & 0x3F) << 6) | (bytes[i + 2] & 0x3F);
+                    break;
+               default:
+                    v = ((bytes[i] & 0x07) << 18) | ((bytes[i + 1] & 0x3F) << 12) | ((bytes[i + 2] & 0x3F) << 6) | (bytes[i + 3] & 0x3F);
+               }
+               /* like add_utf8(), which does not accept the non-characters */
+               add_unicode(this, valid_unicode(v) ? v : 65533);
+               i += k;
+          }
+     }
+}
@@ -21,36 +21,88 @@
  * This file contains the implementation of utilities.
  */
 
-#include <alloca.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <string.h>
 
 #include "json.h"
+#include "json_internal.h"
 
 static void dont_free_visitor(json_visitor_t *this) {
      /* nothing */
 }
 
-static void kill_object(json_visitor_t *this, json_object_t *visited) {
-     int i;
-     int n = visited->count(visited);
-     const char **keys = (const char **)alloca(n * sizeof(const char*));
-     visited->keys(visited, keys);
-     for (i = 0; i < n; i++) {
-          json_value_t *v = visited->get(visited, keys[i]);
-          visited->del(visited, keys[i]);
-          v->accept(v, this);
+/*
+ * The containers are freed without recursion, children first (which is
+ * also the order the allocator prefers): the stack holds the containers
+ * being freed, and the position of the next value to free in each.
+ */
+
+static json_value_t *kill_next(json_kill_frame_t *frame, unsigned int *budget) {
+     if (frame->container->type == json_type_object) {
+          return json_object_kill_next((json_object_t*)frame->container, &(frame->at), budget);
      }
-     visited->free(visited);
+     return json_array_kill_next((json_array_t*)frame->container, &(frame->at), budget);
 }
 
-static void kill_array(json_visitor_t *this, json_array_t  *visited) {
-     int n = visited->count(visited);
-     int i;
-     for (i = n; i --> 0; ) {
-          json_value_t *v = visited->get(visited, i);
-          v->accept(v, this);
+void json_kill_start(json_kill_state_t *state, json_value_t *container) {
+     state->stack = state->frames;
+     state->capacity = sizeof(state->frames) / sizeof(json_kill_frame_t);
+     state->depth = 0;
+     state->stack[0].container = container;
+     state->stack[0].at = 0;
+}
+
+unsigned int json_kill_steps(json_kill_state_t *state, unsigned int max) {
+     json_value_t *child, *container;
+     unsigned int budget = max;
+
+     while (state->depth >= 0 && budget > 0) {
+          child = kill_next(state->stack + state->depth, &budget);
+          if (child == NULL) {
+               if (budget == 0) {
+                    /* the container is not done yet */
+                    break;
+               }
+               container = state->stack[state->depth--].container;
+               container->free(container);
+               budget--;
+          }
+          else {
+               if (++state->depth == state->capacity) {
+                    json_kill_frame_t *new_stack = stdlib_memory.malloc(2 * state->capacity * sizeof(json_kill_frame_t));
+                    memcpy(new_stack, state->stack, state->capacity * sizeof(json_kill_frame_t));
+                    if (state->stack != state->frames) {
+                         stdlib_memory.free(state->stack);
+                    }
+                    state->stack = new_stack;
+                    state->capacity *= 2;
+               }
+               state->stack[state->depth].container = child;
+               state->stack[state->depth].at = 0;
+          }
+     }
+     if (state->depth < 0 && state->stack != state->frames) {
+          stdlib_memory.free(state->stack);
+          state->stack = state->frames;
+     }
+     return max - budget;
+}
+
+static void kill_container(json_value_t *container) {
+     json_kill_state_t state;
+     json_kill_start(&state, container);
+     while (state.depth >= 0) {
+          json_kill_steps(&state, UINT_MAX);
      }
-     visited->free(visited);
+}
+
+static void kill_object(json_visitor_t *this, json_object_t *visited) {
+     kill_container((json_value_t*)visited);
+}
+
+static void kill_array(json_visitor_t *this, json_array_t  *visited) {
+     kill_container((json_value_t*)visited);
 }
 
 static void kill_string(json_visitor_t *this, json_string_t *visited) {
@@ -87,72 +139,46 @@ __PUBLIC__ json_stop_t json_stop() {
      return result;
 }
 
-typedef struct lookup_visitor {
-     json_visitor_t fn;
-     json_value_t *result;
-     va_list arg;
-} lookup_visitor_t;
+__PUBLIC__ const char json_key_marker[] = "";
 
-static void lookup_object(lookup_visitor_t *this, json_object_t *visited) {
-     char *key = va_arg(this->arg, char*);
-     if (key == JSON_STOP.key) {
-          this->result = (json_value_t*)visited;
-     }
-     else {
-          json_value_t *value = visited->get(visited, key);
-          if (value == NULL) {
-             this->result = NULL;
-          }
-          else {
-             value->accept(value, (json_visitor_t*)this);
+__PUBLIC__ json_value_t *json_vlookup(json_value_t *value, va_list args) {
+     json_value_t *result = value;
+     va_list arg;
+     int done = 0;
+     va_copy(arg, args);
+     while (result != NULL && !done) {
+          switch(json_type(result)) {
+          case json_type_object: {
+               json_object_t *object = (json_object_t*)result;
+               char *key = va_arg(arg, char*);
+               if (key == JSON_STOP.key) {
+                    done = 1;
+               }
+               else if (key == json_key_marker) {
+                    result = object->get_k(object, va_arg(arg, json_key_t*));
+               }
+               else {
+                    result = object->get(object, key);
+               }
+               break;
           }
-     }
-}
-
-static void lookup_array(lookup_visitor_t *this, json_array_t  *visited) {
-     int index = va_arg(this->arg, int);
-     if (index == JSON_STOP.index) {
-          this->result = (json_value_t*)visited;
-     }
-     else {
-          json_value_t *value = visited->get(visited, index);
-          if (value == NULL) {
-             this->result = NULL;
+          case json_type_array: {
+               json_array_t *array = (json_array_t*)result;
+               int index = va_arg(arg, int);
+               if (index == JSON_STOP.index) {
+                    done = 1;
+               }
+               else {
+                    result = array->get(array, index);
+               }
+               break;
           }
-          else {
-             value->accept(value, (json_visitor_t*)this);
+          default:
+               done = 1;
           }
      }
-}
-
-static void lookup_string(lookup_visitor_t *this, json_string_t *visited) {
-     this->result = (json_value_t*)visited;
-}
-
-static void lookup_number(lookup_visitor_t *this, json_number_t *visited) {
-     this->result = (json_value_t*)visited;
-}
-
-static void lookup_const(lookup_visitor_t *this, json_const_t  *visited) {
-     this->result = (json_value_t*)visited;
-}
-
-static json_visitor_t lookup_fn = {
-     (json_visit_free_fn  )&dont_free_visitor,
-     (json_visit_object_fn)&lookup_object    ,
-     (json_visit_array_fn )&lookup_array     ,
-     (json_visit_string_fn)&lookup_string    ,
-     (json_visit_number_fn)&lookup_number    ,
-     (json_visit_const_fn )&lookup_const     ,
-};
-
-__PUBLIC__ json_value_t *json_vlookup(json_value_t *value, va_list args) {
-     lookup_visitor_t visitor;
-     visitor.fn = lookup_fn;
-     va_copy(visitor.arg, args);
-     value->accept(value, &(visitor.fn));
-     va_end(visitor.arg);
-     return visitor.result;
+     va_end(arg);
+     return result;
 }
 
 __PUBLIC__ json_value_t *json_lookup(json_value_t *value, ...) {
@@ -21,176 +21,893 @@
  * This file contains the implementation of the JSON pretty printer.
  */
 
-#include <alloca.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#include "json_value.h"
+#include "json.h"
+#include "json_internal.h"
 #include "json_stream.h"
 
 __PUBLIC__ short json_compact        = 0x00;
 __PUBLIC__ short json_extend_unicode = 0x01;
 __PUBLIC__ short json_extend_spaces  = 0x02;
+__PUBLIC__ short json_cache_subtrees = 0x04;
+__PUBLIC__ short json_canonical      = 0x08;
 
-typedef struct json_writer {
-     json_visitor_t fn;
+/* the size of the output blocks given to the stream */
+#define OUTPUT_SIZE 8192
+
+/* parallel writing: the smallest container worth splitting, and the
+ * number of ranges per thread (to balance uneven items) */
+#define PARALLEL_MIN      4096
+#define CHUNKS_PER_THREAD 4
+
+/* the smallest container output worth caching */
+#define CACHE_MIN 64
+
+/* file descriptor output: the number of fragments gathered by one
+ * writev(2), and the size from which text is referenced rather than
+ * copied */
+#define IOV_BATCH     64
+#define ZERO_COPY_MIN 512
+
+/* where the output goes */
+typedef enum {
+     output_stream=0,
+     output_fd,
+     output_measure,
+     output_buffer,
+} output_e;
+
+/* the container levels flags */
+#define LEVEL_OBJECT    0x01
+#define LEVEL_HAS_ITEMS 0x02
+#define LEVEL_AFTER_KEY 0x04
+
+struct json_writer_impl {
+     json_writer_t fn;
      cad_memory_t memory;
 
+     output_e sink;
      cad_output_stream_t *stream;
      short options;
-     int depth;
      char *buffer;
      int   capacity;
-} json_writer_t;
 
-static void del(json_writer_t *this) {
-     this->memory.free(this->buffer);
-     this->memory.free(this);
+     // pending output, flushed to the stream in blocks; when measuring,
+     // only counted; with a buffer sink, the result itself (grown if
+     // needed, and owned by the caller)
+     char *output;
+     int   output_length;
+     int   output_capacity;
+
+     // file descriptor output: the fragments to gather,
+     // either referenced text or parts of the output buffer; the
+     // errno of the first failed write, after which the output is
+     // dropped
+     int           fd;
+     int           failed;
+     struct iovec *iov;
+     int           iov_count;
+     int           output_gathered;
+
+     // the total length of the flushed output, when measuring
+     size_t measured;
+
+     // the open containers, and whether the top-level value is complete
+     int            depth;
+     unsigned char *levels;
+     int            levels_capacity;
+     int            complete;
+};
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Output buffer                                                          */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/*
+ * Adds the not yet gathered part of the output buffer to the fragments
+ * (emit_ref() keeps room for it).
+ */
+static void gather_output(struct json_writer_impl *this) {
+     if (this->output_length > this->output_gathered) {
+          this->iov[this->iov_count].iov_base = this->output + this->output_gathered;
+          this->iov[this->iov_count].iov_len = this->output_length - this->output_gathered;
+          this->iov_count++;
+          this->output_gathered = this->output_length;
+     }
 }
 
-static void newline_and_indent(json_writer_t *this) {
-     if (this->options & json_extend_spaces) {
-          this->stream->put(this->stream, "\n%*s", this->depth * 4, "");
+static int write_fragments(struct json_writer_impl *this) {
+     struct iovec *iov = this->iov;
+     int count = this->iov_count;
+     while (count > 0) {
+          ssize_t n = writev(this->fd, iov, count);
+          if (n < 0) {
+               if (errno != EINTR) {
+                    this->failed = errno;
+                    break;
+               }
+               continue;
+          }
+          while (count > 0 && (size_t)n >= iov->iov_len) {
+               n -= iov->iov_len;
+               iov++;
+               count--;
+          }
+          if (count > 0) {
+               /* partial write */
+               iov->iov_base = (char*)iov->iov_base + n;
+               iov->iov_len -= n;
+          }
      }
+     this->iov_count = 0;
+     return this->failed ? -1 : 0;
 }
 
-static void write_object(json_writer_t *this, json_object_t *visited) {
-     int i, key_space = 1;
-     int n = visited->count(visited);
-     const char **keys = (const char **)alloca(n * sizeof(const char*));
-     visited->keys(visited, keys);
-     if (this->options & json_extend_spaces) {
-          for (i = 0; i < n; i++) {
-               int ks = strlen(keys[i]);
-               if (ks > key_space) key_space = ks;
+static int flush(struct json_writer_impl *this) {
+     int result = 0;
+     switch(this->sink) {
+     case output_stream:
+          if (this->output_length > 0) {
+               /* libcad streams have no raw write: one formatted put per block */
+               this->stream->put(this->stream, "%.*s", this->output_length, this->output);
+          }
+          break;
+     case output_fd:
+          if (this->failed) {
+               /* no more writes: the output is lost anyway */
+               this->iov_count = 0;
+               result = -1;
+          }
+          else {
+               gather_output(this);
+               result = write_fragments(this);
           }
+          this->output_gathered = 0;
+          break;
+     case output_measure:
+          this->measured += this->output_length;
+          break;
+     case output_buffer:
+          return 0;
      }
-     this->stream->put(this->stream, "{");
-     this->depth++;
-     for (i = 0; i < n; i++) {
-          json_value_t *v = visited->get(visited, keys[i]);
-          if (i > 0) {
-               this->stream->put(this->stream, ",");
+     this->output_length = 0;
+     return result;
+}
+
+/*
+ * Makes room for at least n more characters in the output buffer.
+ * When caching subtrees, the whole value is kept until it is complete
+ * (the containers copy their output from there).
+ */
+static void reserve(struct json_writer_impl *this, int n) {
+     if (this->output_length + n > this->output_capacity) {
+          if (!(this->options & json_cache_subtrees)) {
+               flush(this);
           }
-          newline_and_indent(this);
-          this->stream->put(this->stream, "\"%s\":", keys[i]);
-          if (this->options & json_extend_spaces) {
-               this->stream->put(this->stream, "%*s", (int)(key_space - strlen(keys[i]) + 1), "");
+          if (this->output_length + n > this->output_capacity) {
+               int new_capacity = this->output_capacity;
+               char *new_output;
+               do {
+                    new_capacity <<= 1;
+               } while (new_capacity < this->output_length + n);
+               new_output = this->memory.malloc(new_capacity);
+               memcpy(new_output, this->output, this->output_length);
+               this->memory.free(this->output);
+               this->output = new_output;
+               this->output_capacity = new_capacity;
           }
-          v->accept(v, (json_visitor_t*)this);
      }
-     this->depth--;
-     newline_and_indent(this);
-     this->stream->put(this->stream, "}");
 }
 
-static void write_array(json_writer_t *this, json_array_t  *visited) {
-     int n = visited->count(visited);
-     int i;
-     this->stream->put(this->stream, "[");
-     this->depth++;
-     newline_and_indent(this);
-     for (i = 0; i < n; i++) {
-          json_value_t *v = visited->get(visited, i);
-          if (i > 0) {
-               this->stream->put(this->stream, ",");
+static void emit(struct json_writer_impl *this, const char *string, int n) {
+     reserve(this, n);
+     memcpy(this->output + this->output_length, string, n);
+     this->output_length += n;
+}
+
+/*
+ * Emits text that stays valid until the next flush(): when writing to
+ * a file descriptor, large runs are referenced instead of copied; when
+ * measuring, they are only counted.
+ */
+static void emit_ref(struct json_writer_impl *this, const char *string, int n) {
+     if (this->options & json_cache_subtrees) {
+          emit(this, string, n);
+          return;
+     }
+     if (this->sink == output_measure) {
+          this->measured += n;
+          return;
+     }
+     if (this->sink == output_stream && n > this->output_capacity) {
+          flush(this);
+          this->stream->put(this->stream, "%.*s", n, string);
+          return;
+     }
+     if (this->sink != output_fd || n < ZERO_COPY_MIN) {
+          emit(this, string, n);
+          return;
+     }
+     /* room for the output before the text, the text, and the output
+      * after it that flush() gathers */
+     if (this->iov_count + 3 > IOV_BATCH) {
+          flush(this);
+     }
+     gather_output(this);
+     this->iov[this->iov_count].iov_base = (void*)string;
+     this->iov[this->iov_count].iov_len = n;
+     this->iov_count++;
+}
+
+static void emit_char(struct json_writer_impl *this, char c) {
+     reserve(this, 1);
+     this->output[this->output_length++] = c;
+}
+
+static void emit_spaces(struct json_writer_impl *this, int n) {
+     reserve(this, n);
+     memset(this->output + this->output_length, ' ', n);
+     this->output_length += n;
+}
+
+#define EMIT_LITERAL(this, literal) emit((this), (literal), sizeof(literal) - 1)
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* The writer                                                             */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+ * The escape sequence of each ASCII character: 0 if none is needed,
+ * 'u' for a "\\u00XX" sequence, otherwise the character that follows
+ * the backslash.
+ */
+static const char escapes[128] = {
+     'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+     'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+     0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static void write_unicode_escape(struct json_writer_impl *this, int unicode) {
+     char sequence[6] = {
+          '\\', 'u',
+          hex_digits[(unicode >> 12) & 0xf], hex_digits[(unicode >> 8) & 0xf],
+          hex_digits[(unicode >> 4) & 0xf], hex_digits[unicode & 0xf],
+     };
+     if (unicode >= 0x10000) {
+          /* surrogate pair */
+          unicode -= 0x10000;
+          write_unicode_escape(this, 0xD800 + (unicode >> 10));
+          write_unicode_escape(this, 0xDC00 + (unicode & 0x3FF));
+     }
+     else {
+          emit(this, sequence, 6);
+     }
+}
+
+static void write_character(struct json_writer_impl *this, int unicode) {
+     if (unicode >= 0 && unicode < 128 && escapes[unicode]) {
+          if (escapes[unicode] == 'u') {
+               write_unicode_escape(this, unicode);
+          }
+          else {
+               char sequence[2] = { '\\', escapes[unicode] };
+               emit(this, sequence, 2);
           }
-          newline_and_indent(this);
-          v->accept(v, (json_visitor_t*)this);
      }
-     this->depth--;
-     newline_and_indent(this);
-     this->stream->put(this->stream, "]");
+     else if (unicode >= 32 && unicode < 127) {
+          emit_char(this, (char)unicode);
+     }
+     else if (this->options & json_extend_unicode) {
+          write_unicode_escape(this, unicode);
+     }
+     else {
+          emit_char(this, (char)unicode);
+     }
 }
 
-static void write_character(json_writer_t *this, int unicode) {
-     switch(unicode) {
-     case '"': case '\\':
-          this->stream->put(this->stream, "\\%c", (char)unicode);
-          break;
-     case '\b':
-          this->stream->put(this->stream, "\\b");
-          break;
-     case '\f':
-          this->stream->put(this->stream, "\\f");
-          break;
-     case '\n':
-          this->stream->put(this->stream, "\\n");
-          break;
-     case '\r':
-          this->stream->put(this->stream, "\\r");
-          break;
-     case '\t':
-          this->stream->put(this->stream, "\\t");
-          break;
-     default:
-          if (unicode >= 32 && unicode < 127) {
-               this->stream->put(this->stream, "%c", (char)unicode);
+/*
+ * Returns the index of the first byte from `i` that must be escaped:
+ * '"', '\\', a control character, or DEL and any non-ASCII byte if
+ * `ascii` is set (as write_character() does); `n` if there is none.
+ */
+static int scan(const unsigned char *string, int i, int n, int ascii) {
+#ifdef __SSE2__
+     const __m128i quote     = _mm_set1_epi8('"');
+     const __m128i backslash = _mm_set1_epi8('\\');
+     const __m128i control   = _mm_set1_epi8(0x1f);
+     for (; i + 16 <= n; i += 16) {
+          __m128i chunk = _mm_loadu_si128((const __m128i*)(string + i));
+          __m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+          int mask;
+          if (ascii) {
+               /* signed: both the control characters and the non-ASCII bytes */
+               special = _mm_or_si128(special, _mm_cmplt_epi8(chunk, _mm_set1_epi8(0x20)));
+               special = _mm_or_si128(special, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(0x7f)));
+          }
+          else {
+               special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
           }
-          else if (this->options & json_extend_unicode) {
-               this->stream->put(this->stream, "\\u%04x", unicode);
+          mask = _mm_movemask_epi8(special);
+          if (mask) {
+               return i + __builtin_ctz(mask);
+          }
+     }
+#else
+     /* word-at-a-time: flags the bytes that are zero, or less than 0x20 */
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+#define ZERO_BYTE(x)     (((x) - ONES) & ~(x) & HIGHS)
+#define LESS_THAN(x, k)  (((x) - ONES * (k)) & ~(x) & HIGHS)
+     for (; i + 8 <= n; i += 8) {
+          uint64_t word, special;
+          memcpy(&word, string + i, sizeof(word));
+          special = ZERO_BYTE(word ^ (ONES * '"')) | ZERO_BYTE(word ^ (ONES * '\\')) | LESS_THAN(word, 0x20);
+          if (ascii) {
+               special |= (word & HIGHS) | ZERO_BYTE(word ^ (ONES * 0x7f));
+          }
+          if (special) {
+               break;
+          }
+     }
+#undef ONES
+#undef HIGHS
+#undef ZERO_BYTE
+#undef LESS_THAN
+#endif
+     for (; i < n; i++) {
+          unsigned char c = string[i];
+          if (c < 127 ? escapes[c] != 0 : ascii) {
+               break;
+          }
+     }
+     return i;
+}
+
+/*
+ * Decodes the utf-8 sequence at `string[*i]` and moves past it; an
+ * invalid sequence gives U+FFFD.
+ */
+static int decode_utf8(const unsigned char *string, int *i, int n) {
+     int c = string[*i], k, result;
+     if (c >= 0xF0 && c < 0xF8) {
+          k = 3;
+          result = c & 0x07;
+     }
+     else if (c >= 0xE0) {
+          k = 2;
+          result = c & 0x0F;
+     }
+     else if (c >= 0xC0) {
+          k = 1;
+          result = c & 0x1F;
+     }
+     else {
+          k = 0;
+          result = 0xFFFD;
+     }
+     (*i)++;
+     for (; k > 0; k--, (*i)++) {
+          if (*i >= n || (string[*i] & 0xC0) != 0x80) {
+               return 0xFFFD;
+          }
+          result = (result << 6) | (string[*i] & 0x3F);
+     }
+     return result;
+}
+
+/*
+ * Writes utf-8 text, copying the runs that need no escaping as is (or
+ * handing them to writev(2) directly, when large enough).
+ */
+static void write_utf8(struct json_writer_impl *this, const char *text, int n) {
+     const unsigned char *string = (const unsigned char*)text;
+     int ascii = this->options & json_extend_unicode;
+     int start = 0, i = 0;
+     while ((i = scan(string, i, n, ascii)) < n) {
+          emit_ref(this, text + start, i - start);
+          if (string[i] < 128) {
+               write_character(this, string[i]);
+               i++;
           }
           else {
-               this->stream->put(this->stream, "%c", (char)unicode);
+               write_unicode_escape(this, decode_utf8(string, &i, n));
           }
+          start = i;
+     }
+     emit_ref(this, text + start, n - start);
+     if (this->iov_count > 0) {
+          /* the referenced text may not outlive the caller */
+          flush(this);
      }
 }
 
-static void write_string(json_writer_t *this, json_string_t *visited) {
-     this->stream->put(this->stream, "\"");
-     if (this->options & json_extend_unicode) {
+static void newline_and_indent(struct json_writer_impl *this) {
+     if (this->options & json_extend_spaces) {
+          emit_char(this, '\n');
+          emit_spaces(this, this->depth * 4);
+     }
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Structure                                                              */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/*
+ * Checks that a value is expected, and writes the separator before it.
+ */
+static int begin_value(struct json_writer_impl *this) {
+     unsigned char *level;
+     if (this->depth == 0) {
+          return this->complete ? -1 : 0;
+     }
+     level = this->levels + this->depth - 1;
+     if (*level & LEVEL_OBJECT) {
+          if (!(*level & LEVEL_AFTER_KEY)) {
+               return -1;
+          }
+          *level &= ~LEVEL_AFTER_KEY;
+     }
+     else {
+          if (*level & LEVEL_HAS_ITEMS) {
+               emit_char(this, ',');
+          }
+          newline_and_indent(this);
+          *level |= LEVEL_HAS_ITEMS;
+     }
+     return 0;
+}
+
+/*
+ * Flushes the output once the top-level value is complete.
+ */
+static int end_value(struct json_writer_impl *this) {
+     if (this->depth == 0) {
+          this->complete = 1;
+          return flush(this);
+     }
+     return 0;
+}
+
+static int begin_container(struct json_writer_impl *this, unsigned char level) {
+     if (begin_value(this)) {
+          return -1;
+     }
+     if (this->depth == this->levels_capacity) {
+          int new_capacity = this->levels_capacity * 2;
+          unsigned char *new_levels = this->memory.malloc(new_capacity);
+          memcpy(new_levels, this->levels, this->levels_capacity);
+          this->memory.free(this->levels);
+          this->levels = new_levels;
+          this->levels_capacity = new_capacity;
+     }
+     this->levels[this->depth++] = level;
+     emit_char(this, level & LEVEL_OBJECT ? '{' : '[');
+     return 0;
+}
+
+/*
+ * Closes the current container, without ending the value (see
+ * end_container()).
+ */
+static int close_container(struct json_writer_impl *this, unsigned char level) {
+     unsigned char current;
+     if (this->depth == 0) {
+          return -1;
+     }
+     current = this->levels[this->depth - 1];
+     if ((current & LEVEL_OBJECT) != level || (current & LEVEL_AFTER_KEY)) {
+          return -1;
+     }
+     this->depth--;
+     if (current & LEVEL_HAS_ITEMS) {
+          newline_and_indent(this);
+     }
+     emit_char(this, level & LEVEL_OBJECT ? '}' : ']');
+     return 0;
+}
+
+static int end_container(struct json_writer_impl *this, unsigned char level) {
+     if (close_container(this, level)) {
+          return -1;
+     }
+     return end_value(this);
+}
+
+/*
+ * Writes a key, padded to `key_space` when pretty-printing.
+ */
+static int write_key(struct json_writer_impl *this, const char *key, size_t length, size_t key_space) {
+     unsigned char *level;
+     if (this->depth == 0) {
+          return -1;
+     }
+     level = this->levels + this->depth - 1;
+     if (!(*level & LEVEL_OBJECT) || (*level & LEVEL_AFTER_KEY)) {
+          return -1;
+     }
+     if (*level & LEVEL_HAS_ITEMS) {
+          emit_char(this, ',');
+     }
+     newline_and_indent(this);
+     *level |= LEVEL_HAS_ITEMS | LEVEL_AFTER_KEY;
+     emit_char(this, '"');
+     write_utf8(this, key, (int)length);
+     EMIT_LITERAL(this, "\":");
+     if (this->options & json_extend_spaces) {
+          emit_spaces(this, (int)(key_space - length + 1));
+     }
+     return 0;
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* The streaming writer                                                   */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+static void free_(struct json_writer_impl *this) {
+     flush(this);
+     this->memory.free(this->levels);
+     if (this->iov) {
+          this->memory.free(this->iov);
+     }
+     if (this->sink != output_buffer) {
+          this->memory.free(this->output);
+     }
+     this->memory.free(this->buffer);
+     this->memory.free(this);
+}
+
+static int begin_object(struct json_writer_impl *this) {
+     return begin_container(this, LEVEL_OBJECT);
+}
+
+static int end_object(struct json_writer_impl *this) {
+     return end_container(this, LEVEL_OBJECT);
+}
+
+static int begin_array(struct json_writer_impl *this) {
+     return begin_container(this, 0);
+}
+
+static int end_array(struct json_writer_impl *this) {
+     return end_container(this, 0);
+}
+
+static int key(struct json_writer_impl *this, const char *key, size_t length) {
+     return write_key(this, key, length, length);
+}
+
+static int string(struct json_writer_impl *this, const char *string, size_t length) {
+     if (begin_value(this)) {
+          return -1;
+     }
+     emit_char(this, '"');
+     write_utf8(this, string, (int)length);
+     emit_char(this, '"');
+     return end_value(this);
+}
+
+static int int64(struct json_writer_impl *this, int64_t value) {
+     if (begin_value(this)) {
+          return -1;
+     }
+     reserve(this, JSON_FORMAT_SIZE);
+     if (this->options & json_canonical) {
+          /* all the numbers are doubles */
+          this->output_length += json_format_double_canonical(this->output + this->output_length, (double)value);
+     }
+     else {
+          this->output_length += json_format_int64(this->output + this->output_length, value);
+     }
+     return end_value(this);
+}
+
+static int double_(struct json_writer_impl *this, double value) {
+     if (begin_value(this)) {
+          return -1;
+     }
+     reserve(this, JSON_FORMAT_SIZE);
+     if ((this->options & json_canonical) || !isfinite(value)) {
+          /* NaN and infinities have no JSON form: the canonical
+           * formatter writes them as null */
+          this->output_length += json_format_double_canonical(this->output + this->output_length, value);
+     }
+     else {
+          this->output_length += json_format_double(this->output + this->output_length, value);
+     }
+     return end_value(this);
+}
+
+static int bool_(struct json_writer_impl *this, int value) {
+     if (begin_value(this)) {
+          return -1;
+     }
+     if (value) {
+          EMIT_LITERAL(this, "true");
+     }
+     else {
+          EMIT_LITERAL(this, "false");
+     }
+     return end_value(this);
+}
+
+static int null(struct json_writer_impl *this) {
+     if (begin_value(this)) {
+          return -1;
+     }
+     EMIT_LITERAL(this, "null");
+     return end_value(this);
+}
+
+static int error(struct json_writer_impl *this) {
+     return this->failed;
+}
+
+static json_writer_t writer_fn = {
+     (json_writer_free_fn  )free_       ,
+     (json_writer_begin_fn )begin_object,
+     (json_writer_end_fn   )end_object  ,
+     (json_writer_begin_fn )begin_array ,
+     (json_writer_end_fn   )end_array   ,
+     (json_writer_key_fn   )key         ,
+     (json_writer_string_fn)string      ,
+     (json_writer_int64_fn )int64       ,
+     (json_writer_double_fn)double_     ,
+     (json_writer_bool_fn  )bool_       ,
+     (json_writer_null_fn  )null        ,
+     (json_writer_error_fn )error       ,
+};
+
+static struct json_writer_impl *new_writer(output_e sink, cad_output_stream_t *stream, int fd, cad_memory_t memory, short options) {
+     struct json_writer_impl *result = (struct json_writer_impl*)memory.malloc(sizeof(struct json_writer_impl));
+     if (!result) return NULL;
+     result->fn              = writer_fn;
+     result->memory          = memory;
+     result->sink            = sink;
+     result->stream          = stream;
+     result->options         = options & json_canonical ? options & ~(json_extend_spaces | json_extend_unicode) : options;
+     result->buffer          = (char*)memory.malloc(1024);
+     result->capacity        = 1024;
+     result->output          = sink == output_buffer ? NULL : (char*)memory.malloc(OUTPUT_SIZE);
+     result->output_length   = 0;
+     result->output_capacity = OUTPUT_SIZE;
+     result->fd              = fd;
+     result->failed          = 0;
+     result->iov             = sink == output_fd ? (struct iovec*)memory.malloc(IOV_BATCH * sizeof(struct iovec)) : NULL;
+     result->iov_count       = 0;
+     result->output_gathered = 0;
+     result->measured        = 0;
+     result->depth           = 0;
+     result->levels          = (unsigned char*)memory.malloc(16);
+     result->levels_capacity = 16;
+     result->complete        = 0;
+     return result;
+}
+
+__PUBLIC__ json_writer_t *json_new_writer(cad_output_stream_t *stream, cad_memory_t memory, short options) {
+     return (json_writer_t*)new_writer(output_stream, stream, -1, memory, options);
+}
+
+__PUBLIC__ json_writer_t *json_new_fd_writer(int fd, cad_memory_t memory, short options) {
+     return (json_writer_t*)new_writer(output_fd, NULL, fd, memory, options);
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* The visitor, on top of the streaming writer                            */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+typedef struct json_write_visitor {
+     json_visitor_t fn;
+     struct json_writer_impl *writer;
+     int threads;
+} json_write_visitor_t;
+
+/*
+ * Returns the writer, ready for a new top-level value if needed.
+ */
+static struct json_writer_impl *writer(json_write_visitor_t *this) {
+     if (this->writer->depth == 0) {
+          this->writer->complete = 0;
+     }
+     return this->writer;
+}
+
+static void del(json_write_visitor_t *this) {
+     cad_memory_t memory = this->writer->memory;
+     free_(this->writer);
+     memory.free(this);
+}
+
+static void key_space_field(json_object_t *object, unsigned int index, const char *key, size_t key_len, json_value_t *value, int *key_space) {
+     if ((int)key_len > *key_space) *key_space = key_len;
+}
+
+typedef struct write_object_data {
+     json_write_visitor_t *visitor;
+     int key_space;
+} write_object_data_t;
+
+static void write_field(json_object_t *object, unsigned int index, const char *key, size_t key_len, json_value_t *value, write_object_data_t *data) {
+     write_key(data->visitor->writer, key, key_len, data->key_space);
+     value->accept(value, (json_visitor_t*)data->visitor);
+}
+
+/*
+ * Writes the cached output of the container, if it is still valid for
+ * the same options and indentation; returns non-zero if so.
+ */
+static int write_cached(struct json_writer_impl *w, json_output_cache_t *cache) {
+     json_output_entry_t *entry = cache->entry;
+     if (!(w->options & json_cache_subtrees) || entry == NULL || !entry->valid
+         || entry->options != w->options || entry->depth != w->depth) {
+          return 0;
+     }
+     begin_value(w);
+     emit(w, entry->bytes, (int)entry->length);
+     end_value(w);
+     return 1;
+}
+
+/*
+ * Keeps the output of the container written from `start` (up to the
+ * end of the output buffer), then ends the value.
+ */
+static void end_cached(struct json_writer_impl *w, json_output_cache_t *cache, unsigned char level, int start) {
+     close_container(w, level);
+     if (w->options & json_cache_subtrees) {
+          json_output_entry_t *entry = cache->entry;
+          size_t length = w->output_length - start;
+          if (length >= CACHE_MIN) {
+               if (entry == NULL || entry->capacity < length) {
+                    if (entry) {
+                         entry->memory.free(entry);
+                    }
+                    entry = (json_output_entry_t*)w->memory.malloc(sizeof(json_output_entry_t) + length);
+                    entry->memory   = w->memory;
+                    entry->capacity = length;
+                    cache->entry = entry;
+               }
+               memcpy(entry->bytes, w->output + start, length);
+               entry->length  = length;
+               entry->options = w->options;
+               entry->depth   = w->depth;
+               entry->valid   = 1;
+          }
+     }
+     end_value(w);
+}
+
+static void write_parallel(json_write_visitor_t *this, json_value_t *visited, unsigned char level, unsigned int span, int key_space);
+
+static void write_object(json_write_visitor_t *this, json_object_t *visited) {
+     write_object_data_t data = { this, 1 };
+     struct json_writer_impl *w = writer(this);
+     json_output_cache_t *cache = json_object_output_cache(visited);
+     int start;
+     if (write_cached(w, cache)) {
+          return;
+     }
+     if (w->options & json_extend_spaces) {
+          visited->iterate(visited, (json_object_iterator_fn)key_space_field, &data.key_space);
+     }
+     if (this->threads > 1 && visited->count(visited) >= PARALLEL_MIN) {
+          unsigned int span = w->options & json_canonical ? json_object_sort(visited) : json_object_span(visited);
+          write_parallel(this, (json_value_t*)visited, LEVEL_OBJECT, span, data.key_space);
+          return;
+     }
+     begin_container(w, LEVEL_OBJECT);
+     start = w->output_length - 1; /* the '{' */
+     if (w->options & json_canonical) {
+          json_object_iterate_sorted(visited, 0, visited->count(visited), (json_object_iterator_fn)write_field, &data);
+     }
+     else {
+          visited->iterate(visited, (json_object_iterator_fn)write_field, &data);
+     }
+     end_cached(w, cache, LEVEL_OBJECT, start);
+}
+
+static void write_item(json_array_t *array, unsigned int index, json_value_t *value, json_write_visitor_t *this) {
+     value->accept(value, (json_visitor_t*)this);
+}
+
+static void write_array(json_write_visitor_t *this, json_array_t  *visited) {
+     struct json_writer_impl *w = writer(this);
+     json_output_cache_t *cache = json_array_output_cache(visited);
+     int start;
+     if (write_cached(w, cache)) {
+          return;
+     }
+     if (this->threads > 1 && visited->count(visited) >= PARALLEL_MIN) {
+          write_parallel(this, (json_value_t*)visited, 0, visited->count(visited), 0);
+          return;
+     }
+     begin_container(w, 0);
+     start = w->output_length - 1; /* the '[' */
+     visited->iterate(visited, (json_array_iterator_fn)write_item, this);
+     end_cached(w, cache, 0, start);
+}
+
+static void write_string(json_write_visitor_t *this, json_string_t *visited) {
+     struct json_writer_impl *w = writer(this);
+     begin_value(w);
+     emit_char(w, '"');
+     if (w->options & json_extend_unicode) {
           int i, n = visited->count(visited);
           for (i = 0; i < n; i++) {
-               write_character(this, visited->get(visited, i));
+               write_character(w, visited->get(visited, i));
           }
      }
      else {
-          char *buffer;
-          int new_capacity = this->capacity;
-          int n = visited->utf8(visited, this->buffer, new_capacity);
+          int new_capacity = w->capacity;
+          int n = visited->utf8(visited, w->buffer, new_capacity);
           if (new_capacity <= n) {
                do {
                     new_capacity <<= 1;
                } while (new_capacity <= n);
 
-               this->memory.free(this->buffer);
-               this->buffer = this->memory.malloc(new_capacity);
-               visited->utf8(visited, this->buffer, new_capacity);
-          }
-          buffer = this->buffer;
-          while (*buffer) {
-               write_character(this, *buffer);
-               buffer++;
+               w->memory.free(w->buffer);
+               w->buffer = w->memory.malloc(new_capacity);
+               w->capacity = new_capacity;
+               visited->utf8(visited, w->buffer, new_capacity);
           }
+          write_utf8(w, w->buffer, n);
      }
-     this->stream->put(this->stream, "\"");
+     emit_char(w, '"');
+     end_value(w);
 }
 
-static void write_number(json_writer_t *this, json_number_t *visited) {
-     int new_capacity = this->capacity;
-     int n = visited->to_string(visited, this->buffer, new_capacity);
-     if (new_capacity <= n) {
-          do {
-               new_capacity <<= 1;
-          } while (new_capacity <= n);
-
-          this->memory.free(this->buffer);
-          this->buffer = this->memory.malloc(new_capacity);
-          this->capacity = new_capacity;
-          visited->to_string(visited, this->buffer, new_capacity);
+static void write_number(json_write_visitor_t *this, json_number_t *visited) {
+     struct json_writer_impl *w = writer(this);
+     char *digits;
+     int room, n;
+     if (w->options & json_canonical) {
+          double_(w, visited->to_double(visited));
+          return;
+     }
+     begin_value(w);
+     reserve(w, JSON_FORMAT_SIZE);
+     /* the digits are written straight into the output buffer */
+     room = w->output_capacity - w->output_length;
+     n = visited->to_string(visited, w->output + w->output_length, room);
+     if (n >= room) {
+          reserve(w, n + 1);
+          visited->to_string(visited, w->output + w->output_length, n + 1);
+     }
+     digits = w->output + w->output_length;
+     if (digits[digits[0] == '-'] == 'n' || digits[digits[0] == '-'] == 'i') {
+          /* "nan" or "inf" are not JSON: null, as in JSON.stringify() */
+          memcpy(digits, "null", 4);
+          n = 4;
      }
-     this->stream->put(this->stream, "%s", this->buffer);
+     w->output_length += n;
+     end_value(w);
 }
 
-static void write_const(json_writer_t *this, json_const_t  *visited) {
+static void write_const(json_write_visitor_t *this, json_const_t  *visited) {
+     struct json_writer_impl *w = writer(this);
      switch(visited->value(visited)) {
      case json_false:
-          this->stream->put(this->stream, "false");
+          bool_(w, 0);
           break;
      case json_true:
-          this->stream->put(this->stream, "true");
+          bool_(w, 1);
           break;
      case json_null:
-          this->stream->put(this->stream, "null");
+          null(w);
           break;
      }
 }
@@ -204,14 +921,190 @@ static json_visitor_t fn = {
      (json_visit_const_fn )write_const ,
 };
 
+static json_visitor_t *new_visitor(struct json_writer_impl *writer, cad_memory_t memory) {
+     json_write_visitor_t *result = (json_write_visitor_t*)memory.malloc(sizeof(json_write_visitor_t));
+     result->fn      = fn;
+     result->writer  = writer;
+     result->threads = 1;
+     return &(result->fn);
+}
+
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+/* Parallel writing                                                       */
+/* ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ */
+
+/*
+ * A large container is split into ranges of items, each one written by
+ * a worker into its own buffer as if it were at the start of the
+ * container; the buffers are then concatenated in order, separated by
+ * commas.
+ */
+
+typedef struct write_chunk {
+     unsigned int from, to;
+     char *output;
+     int   length;
+} write_chunk_t;
+
+typedef struct write_job {
+     struct json_writer_impl *writer;
+     json_value_t *container;
+     unsigned char level;
+     int key_space;
+     write_chunk_t *chunks;
+     int chunk_count;
+     int next_chunk;
+} write_job_t;
+
+static void write_chunk(write_job_t *job, write_chunk_t *chunk) {
+     struct json_writer_impl *parent = job->writer;
+     struct json_writer_impl *w = new_writer(output_buffer, NULL, -1, parent->memory, parent->options);
+     json_write_visitor_t visitor = { fn, w, 1 };
+
+     w->output = (char*)w->memory.malloc(OUTPUT_SIZE);
+     w->memory.free(w->levels);
+     w->levels = (unsigned char*)w->memory.malloc(parent->levels_capacity);
+     w->levels_capacity = parent->levels_capacity;
+     memcpy(w->levels, parent->levels, parent->depth);
+     w->depth = parent->depth;
+     w->levels[w->depth - 1] &= ~(LEVEL_HAS_ITEMS | LEVEL_AFTER_KEY);
+
+     if (job->level & LEVEL_OBJECT) {
+          write_object_data_t data = { &visitor, job->key_space };
+          if (parent->options & json_canonical) {
+               /* sorted beforehand */
+               json_object_iterate_sorted((json_object_t*)job->container, chunk->from, chunk->to, (json_object_iterator_fn)write_field, &data);
+          }
+          else {
+               json_object_iterate_range((json_object_t*)job->container, chunk->from, chunk->to, (json_object_iterator_fn)write_field, &data);
+          }
+     }
+     else {
+          json_array_iterate_range((json_array_t*)job->container, chunk->from, chunk->to, (json_array_iterator_fn)write_item, &visitor);
+     }
+
+     chunk->output = w->output;
+     chunk->length = w->output_length;
+     free_(w);
+}
+
+static void *write_chunks(write_job_t *job) {
+     int i;
+     while ((i = __atomic_fetch_add(&(job->next_chunk), 1, __ATOMIC_RELAXED)) < job->chunk_count) {
+          write_chunk(job, job->chunks + i);
+     }
+     return NULL;
+}
+
+static void write_parallel(json_write_visitor_t *this, json_value_t *visited, unsigned char level, unsigned int span, int key_space) {
+     struct json_writer_impl *w = this->writer;
+     cad_memory_t memory = w->memory;
+     pthread_t *threads;
+     write_job_t job;
+     int i, started, has_items = 0;
+
+     if (begin_container(w, level)) {
+          return;
+     }
+
+     job.writer      = w;
+     job.container   = visited;
+     job.level       = level;
+     job.key_space   = key_space;
+     job.chunk_count = this->threads * CHUNKS_PER_THREAD;
+     job.chunks      = (write_chunk_t*)memory.malloc(job.chunk_count * sizeof(write_chunk_t));
+     job.next_chunk  = 0;
+     for (i = 0; i < job.chunk_count; i++) {
+          job.chunks[i].from = (unsigned int)((size_t)span * i / job.chunk_count);
+          job.chunks[i].to   = (unsigned int)((size_t)span * (i + 1) / job.chunk_count);
+     }
+
+     /* the calling thread is a worker too; if some threads cannot be
+      * started, the others just take more chunks */
+     threads = (pthread_t*)memory.malloc((this->threads - 1) * sizeof(pthread_t));
+     for (started = 0; started < this->threads - 1; started++) {
+          if (pthread_create(threads + started, NULL, (void*(*)(void*))write_chunks, &job)) {
+               break;
+          }
+     }
+     write_chunks(&job);
+     for (i = 0; i < started; i++) {
+          pthread_join(threads[i], NULL);
+     }
+     memory.free(threads);
+
+     for (i = 0; i < job.chunk_count; i++) {
+          if (job.chunks[i].length > 0) {
+               if (has_items) {
+                    emit_char(w, ',');
+               }
+               emit_ref(w, job.chunks[i].output, job.chunks[i].length);
+               has_items = 1;
+          }
+     }
+     if (w->iov_count > 0) {
+          /* the chunks are freed below */
+          flush(w);
+     }
+     for (i = 0; i < job.chunk_count; i++) {
+          memory.free(job.chunks[i].output);
+     }
+     memory.free(job.chunks);
+
+     if (has_items) {
+          w->levels[w->depth - 1] |= LEVEL_HAS_ITEMS;
+     }
+     end_container(w, level);
+}
+
 __PUBLIC__ json_visitor_t *json_write_to(cad_output_stream_t *stream, cad_memory_t memory, short options) {
-     json_writer_t *result = (json_writer_t*)memory.malloc(sizeof(json_writer_t));
-     result->fn       = fn;
-     result->memory   = memory;
-     result->stream   = stream;
-     result->options  = options;
-     result->depth    = 0;
-     result->buffer   = (char*)memory.malloc(1024);
-     result->capacity = 1024;
+     return new_visitor(new_writer(output_stream, stream, -1, memory, options), memory);
+}
+
+__PUBLIC__ json_visitor_t *json_write_to_fd(int fd, cad_memory_t memory, short options) {
+     return new_visitor(new_writer(output_fd, NULL, fd, memory, options), memory);
+}
+
+__PUBLIC__ int json_write_error(json_visitor_t *visitor) {
+     return error(((json_write_visitor_t*)visitor)->writer);
+}
+
+__PUBLIC__ json_visitor_t *json_write_to_parallel(cad_output_stream_t *stream, cad_memory_t memory, short options, int threads) {
+     json_write_visitor_t *result = (json_write_visitor_t*)new_visitor(new_writer(output_stream, stream, -1, memory, options), memory);
+     result->threads = threads;
      return &(result->fn);
 }
+
+__PUBLIC__ void json_touch(json_value_t *value) {
+     json_output_cache_invalidate(json_output_cache(value));
+}
+
+__PUBLIC__ size_t json_measure(json_value_t *value, short options) {
+     struct json_writer_impl *w = new_writer(output_measure, NULL, -1, stdlib_memory, options);
+     json_visitor_t *visitor = new_visitor(w, stdlib_memory);
+     size_t result;
+     value->accept(value, visitor);
+     result = w->measured;
+     visitor->free(visitor);
+     return result;
+}
+
+__PUBLIC__ char *json_serialize(json_value_t *value, short options, cad_memory_t memory, size_t *length) {
+     size_t n = json_measure(value, options);
+     /* numbers are formatted in place, hence the slack */
+     char *result = (char*)memory.malloc(n + JSON_FORMAT_SIZE);
+     struct json_writer_impl *w;
+     json_visitor_t *visitor;
+     if (!result) return NULL;
+     w = new_writer(output_buffer, NULL, -1, memory, options);
+     w->output = result;
+     w->output_capacity = (int)n + JSON_FORMAT_SIZE;
+     visitor = new_visitor(w, memory);
+     value->accept(value, visitor);
+     visitor->free(visitor);
+     result[n] = '\0';
+     if (length) {
+          *length = n;
+     }
+     return result;
+}
@@ -0,0 +1,250 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "json.h"
+
+static void sum_item(json_array_t *array, unsigned int index, json_value_t *value, double *sum) {
+     json_number_t *number = json_as_number(value);
+     if (number) {
+          *sum += number->to_double(number);
+     }
+}
+
+static void on_error(cad_input_stream_t *s, int line, int column, void *data, const char *format, ...) {
+     assert(0);
+}
+
+static char *write(json_value_t *value) {
+     char *out_source;
+     cad_output_stream_t *out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     value->accept(value, json_write_to(out, stdlib_memory, json_compact));
+     return out_source;
+}
+
+static void test_packed(void) {
+     static char *source = "[12.5,-3.25,7,0.001,-0]";
+     cad_input_stream_t *stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     json_array_t *array = (json_array_t*)json_parse(stream, on_error, NULL, stdlib_memory);
+     json_number_t *number;
+     const double *doubles;
+     int i;
+
+     doubles = json_array_as_doubles(array);
+     assert(doubles == NULL); // "-0" is boxed
+     array->del(array, 4);
+     doubles = json_array_as_doubles(array);
+     assert(doubles != NULL);
+     assert(doubles[0] == 12.5 && doubles[1] == -3.25 && doubles[2] == 7 && doubles[3] == 0.001);
+     assert(0 == strcmp("[12.5,-3.25,7,0.001]", write((json_value_t*)array)));
+     array->accept(array, json_kill());
+
+     array = json_new_array(stdlib_memory);
+     for (i = 0; i < 1000; i++) {
+          array->add_int(array, i);
+     }
+     array->add_double(array, 0.5);
+     doubles = json_array_as_doubles(array);
+     assert(doubles != NULL);
+     assert(doubles[999] == 999 && doubles[1000] == 0.5);
+     array->add_int(array, 1L << 60); // not exact as a double: falls back
+     assert(array->count(array) == 1002);
+     assert(json_array_as_doubles(array) == NULL);
+     assert(((json_number_t*)array->get(array, 1001))->to_int((json_number_t*)array->get(array, 1001)) == 1L << 60);
+     array->del(array, 1001);
+     assert(json_array_as_doubles(array) != NULL); // repacked
+     array->accept(array, json_kill());
+
+     array = json_new_array(stdlib_memory);
+     doubles = json_array_as_doubles(array);
+     assert(doubles != NULL); // empty, but packed
+     array->add_int(array, 12);
+     array->add_int(array, 34);
+     number = (json_number_t*)array->get(array, 1);
+     assert(number->is_int(number) && number->to_int(number) == 34);
+     assert(array->get(array, 1) == (json_value_t*)number);
+     doubles = json_array_as_doubles(array); // the boxes survive the conversion
+     assert(doubles != NULL && doubles[0] == 12 && doubles[1] == 34);
+     assert(array->get(array, 1) == (json_value_t*)number);
+     array->add_int(array, 56); // the boxes move into the slots
+     assert(array->get(array, 1) == (json_value_t*)number);
+     assert(0 == strcmp("[12,34,56]", write((json_value_t*)array)));
+     array->accept(array, json_kill());
+
+     array = json_new_array(stdlib_memory);
+     array->add_double(array, 0.1 + 0.2);
+     array->add_int(array, 3);
+     assert(0 == strcmp("[0.30000000000000004,3]", write((json_value_t*)array)));
+     array->accept(array, json_kill());
+}
+
+#define DECIMALS 10000
+
+/* decimals of at most 15 digits are parsed as plain doubles, and written back as they were */
+static void test_short_decimals(void) {
+     static char source[DECIMALS * 24];
+     unsigned long long seed = 42;
+     char *p = source;
+     cad_input_stream_t *stream;
+     json_array_t *array;
+     char *written;
+     int i, j;
+
+     *p++ = '[';
+     for (i = 0; i < DECIMALS; i++) {
+          int integer, length, fraction;
+          seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+          if (i > 0) *p++ = ',';
+          if (seed & 1) *p++ = '-';
+          integer = (int)((seed >> 32) % 100000 >> (seed >> 60));
+          for (length = 0, j = integer; j > 0; j /= 10) length++;
+          p += sprintf(p, "%d.", integer);
+          fraction = 1 + (int)((seed >> 8) % (15 - length));
+          for (j = 0; j < fraction; j++) {
+               seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+               p[j] = (char)('0' + (seed >> 59) % 10);
+          }
+          if (integer == 0 && p[0] == '0') p[0] = '1'; // tiny ones are boxed
+          if (p[fraction - 1] == '0') p[fraction - 1] = '7';
+          p += fraction;
+     }
+     strcpy(p, "]");
+
+     stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     array = (json_array_t*)json_parse(stream, on_error, NULL, stdlib_memory);
+     assert(json_array_as_doubles(array) != NULL);
+     written = write((json_value_t*)array);
+     assert(0 == strcmp(source, written));
+     free(written);
+     array->accept(array, json_kill());
+     stream->free(stream);
+
+     stream = new_cad_input_stream_from_string("[0.612987032481006,0.27202655823836]", stdlib_memory);
+     array = (json_array_t*)json_parse(stream, on_error, NULL, stdlib_memory);
+     written = write((json_value_t*)array);
+     assert(0 == strcmp("[0.612987032481006,0.27202655823836]", written));
+     free(written);
+     array->accept(array, json_kill());
+     stream->free(stream);
+}
+
+#define READERS 4
+#define ITEMS   1000
+
+typedef struct reader {
+     pthread_t thread;
+     json_array_t *array;
+     int start;
+     double sum;
+     json_value_t *values[ITEMS];
+} reader_t;
+
+static void *read_items(reader_t *reader) {
+     int i;
+     for (i = 0; i < ITEMS; i++) {
+          int index = (reader->start + i) % ITEMS;
+          reader->values[index] = reader->array->get(reader->array, index);
+          if (i % 100 == 0) {
+               reader->array->iterate(reader->array, (json_array_iterator_fn)sum_item, &(reader->sum));
+          }
+     }
+     return NULL;
+}
+
+/* concurrent get() and iterate() on a packed array box each value once, and leave the array packed */
+static void test_concurrent_get(void) {
+     static reader_t readers[READERS];
+     json_array_t *array = json_new_array(stdlib_memory);
+     const double *doubles;
+     int i, r;
+     for (i = 0; i < ITEMS; i++) {
+          array->add_int(array, i);
+     }
+     doubles = json_array_as_doubles(array);
+     assert(doubles != NULL);
+     for (r = 0; r < READERS; r++) {
+          readers[r].array = array;
+          readers[r].start = r * ITEMS / READERS;
+          readers[r].sum = 0;
+          assert(0 == pthread_create(&readers[r].thread, NULL, (void*(*)(void*))read_items, &readers[r]));
+     }
+     for (r = 0; r < READERS; r++) {
+          pthread_join(readers[r].thread, NULL);
+          assert(readers[r].sum == 10.0 * ITEMS * (ITEMS - 1) / 2);
+     }
+     for (i = 0; i < ITEMS; i++) {
+          json_number_t *number = (json_number_t*)readers[0].values[i];
+          assert(number->to_double(number) == i);
+          for (r = 1; r < READERS; r++) {
+               assert(readers[r].values[i] == (json_value_t*)number);
+          }
+     }
+     assert(json_array_as_doubles(array) == doubles); // still packed
+     array->accept(array, json_kill());
+}
+
+int main() {
+     json_array_t *array = json_new_array(stdlib_memory);
+     json_value_t *t = (json_value_t*)json_const(json_true);
+     json_number_t *number;
+     cad_output_stream_t *out;
+     char *out_source;
+     double sum = 0;
+
+     array->add_int(array, 42);
+     array->add_double(array, 0.5);
+     array->add(array, t);
+     array->add_int(array, -7);
+     assert(array->count(array) == 4);
+
+     array->iterate(array, (json_array_iterator_fn)sum_item, &sum);
+     assert(sum == 35.5);
+
+     number = (json_number_t*)array->get(array, 0);
+     assert(json_type((json_value_t*)number) == json_type_number);
+     assert(number->is_int(number));
+     assert(number->to_int(number) == 42);
+     assert(array->get(array, 0) == (json_value_t*)number); // boxed once, then stable
+
+     number = (json_number_t*)array->get(array, 1);
+     assert(!number->is_int(number));
+     assert(number->to_double(number) == 0.5);
+
+     array->ins(array, 0, t);
+     array->del(array, 3);
+     assert(array->count(array) == 4);
+     assert(array->get(array, 0) == t);
+     assert(array->get(array, 1) != NULL);
+     assert(((json_number_t*)array->get(array, 1))->to_int((json_number_t*)array->get(array, 1)) == 42);
+     assert(((json_number_t*)array->get(array, 3))->to_int((json_number_t*)array->get(array, 3)) == -7);
+
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     array->accept(array, json_write_to(out, stdlib_memory, json_compact));
+     assert(0 == strcmp("[true,42,0.5,-7]", out_source));
+
+     array->accept(array, json_kill());
+
+     test_packed();
+     test_short_decimals();
+     test_concurrent_get();
+
+     return 0;
+}
@@ -0,0 +1,109 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Checks that doubles are written in the shortest form that reads back
+ * exactly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "json.h"
+
+#define COUNT 1000000
+
+static json_number_t *number;
+
+static const char *format(double value) {
+     static char buffer[64];
+     number->set_double(number, value);
+     number->to_string(number, buffer, sizeof(buffer));
+     return buffer;
+}
+
+/* the length of the shortest "%.*g" representation that reads back exactly */
+static int shortest(double value) {
+     char buffer[64];
+     int precision;
+     for (precision = 1; precision < 17; precision++) {
+          snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+          if (strtod(buffer, NULL) == value) break;
+     }
+     return precision;
+}
+
+/* the number of significant digits, without the zeros of large integers */
+static int digits(const char *string) {
+     int result = 0, count = 0, leading = 1;
+     for (; *string && *string != 'e'; string++) {
+          if (*string >= '1' && *string <= '9') leading = 0;
+          if (*string >= '0' && *string <= '9' && !leading) count++;
+          if (*string >= '1' && *string <= '9') result = count;
+     }
+     return result;
+}
+
+int main() {
+     unsigned long long seed = 42;
+     int i;
+     number = json_new_number(stdlib_memory);
+
+     assert(0 == strcmp("0", format(0.0)));
+     assert(0 == strcmp("-0", format(-0.0)));
+     assert(0 == strcmp("0.5", format(0.5)));
+     assert(0 == strcmp("0.1", format(0.1)));
+     assert(0 == strcmp("0.30000000000000004", format(0.1 + 0.2)));
+     assert(0 == strcmp("-1234.5678", format(-1234.5678)));
+     assert(0 == strcmp("0.0001", format(1e-4)));
+     assert(0 == strcmp("1e-05", format(1e-5)));
+     assert(0 == strcmp("10000000000000000", format(1e16)));
+     assert(0 == strcmp("1e+17", format(1e17)));
+     assert(0 == strcmp("1.7976931348623157e+308", format(1.7976931348623157e308)));
+     assert(0 == strcmp("5e-324", format(5e-324)));
+     assert(0 == strcmp("2.2250738585072014e-308", format(2.2250738585072014e-308)));
+     assert(0 == strcmp("0.27202655823836", format(0.27202655823836)));
+     assert(0 == strcmp("0.612987032481006", format(0.612987032481006)));
+
+     for (i = 0; i < COUNT; i++) {
+          unsigned long long bits;
+          double value;
+          const char *string;
+          seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+          bits = seed ^ (seed >> 29);
+          memcpy(&value, &bits, sizeof(value));
+          if (value != value || value - value != 0) continue; // nan or inf
+          string = format(value);
+          assert(strtod(string, NULL) == value);
+          assert(digits(string) == shortest(value));
+     }
+
+     // decimals of at most 15 digits are written back as they were
+     for (i = 0; i < COUNT; i++) {
+          char decimal[32];
+          double value;
+          seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+          snprintf(decimal, sizeof(decimal), "%.*fe%d", (int)(seed >> 60) % 15,
+                   1 + 9 * ((double)(seed >> 11) / (1ULL << 53)), (int)(seed % 601) - 300);
+          value = strtod(decimal, NULL);
+          assert(digits(format(value)) == shortest(value));
+     }
+
+     number->free(number);
+     return 0;
+}
@@ -0,0 +1,152 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Checks that object keys are hashed with a per-process seed: the
+ * same key hashes alike within a process but not across processes,
+ * so keys that share a bucket in one process are spread in another.
+ * The other process is this test run again with an argument.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "json.h"
+
+#define KEYS    20000
+#define BUCKETS 1024
+#define CHAIN   16
+
+static unsigned int hashes[KEYS];
+
+static void key_name(int i, char *buffer) {
+     snprintf(buffer, 16, "key%d", i);
+}
+
+static void compute_hashes(unsigned int *result) {
+     char buffer[16];
+     int i;
+     for (i = 0; i < KEYS; i++) {
+          key_name(i, buffer);
+          result[i] = json_key(buffer).hash;
+     }
+}
+
+static void read_hashes(unsigned int *result) {
+     char command[4096];
+     ssize_t n = readlink("/proc/self/exe", command, sizeof(command) - 16);
+     FILE *child;
+     int i;
+     assert(n > 0);
+     strcpy(command + n, " --hashes");
+     child = popen(command, "r");
+     assert(child != NULL);
+     for (i = 0; i < KEYS; i++) {
+          assert(1 == fscanf(child, "%u", &result[i]));
+     }
+     assert(0 == pclose(child));
+}
+
+/* the same key, the same hash; the length delimits the key */
+static void test_stable(void) {
+     json_object_t *object = json_new_object(stdlib_memory);
+     json_key_t a = json_key("user_id");
+     json_key_t b = json_key("user_id");
+     json_key_t prefix = { "user_id", 4, 0 };
+     json_key_t nul = { "user\0id", 7, 0 };
+
+     assert(a.hash != 0 && a.hash == b.hash);
+     assert(object->get_k(object, &prefix) == NULL);
+     assert(prefix.hash == json_key("user").hash);
+     assert(object->get_k(object, &nul) == NULL);
+     assert(nul.hash != prefix.hash && nul.hash != a.hash);
+     object->free(object);
+}
+
+/* keys chained in one bucket here are not chained in another process */
+static void test_seeded(void) {
+     static unsigned int other[KEYS];
+     json_object_t *object = json_new_object(stdlib_memory);
+     json_value_t *t = (json_value_t*)json_const(json_true);
+     int chain[CHAIN], counts[BUCKETS];
+     char buffer[16];
+     int i, n, same, max, bucket;
+
+     compute_hashes(hashes);
+     read_hashes(other);
+
+     same = 0;
+     for (i = 0; i < KEYS; i++) {
+          same += hashes[i] == other[i];
+     }
+     assert(same < 10);
+
+     /* the first CHAIN keys of the fullest bucket collide in a
+      * BUCKETS-sized table... */
+     memset(counts, 0, sizeof(counts));
+     bucket = 0;
+     for (i = 0; i < KEYS; i++) {
+          n = ++counts[hashes[i] & (BUCKETS - 1)];
+          if (n > counts[bucket]) bucket = hashes[i] & (BUCKETS - 1);
+     }
+     for (i = n = 0; i < KEYS && n < CHAIN; i++) {
+          if ((hashes[i] & (BUCKETS - 1)) == bucket) {
+               chain[n++] = i;
+          }
+     }
+     assert(n == CHAIN);
+
+     /* ...but are spread in the other process */
+     memset(counts, 0, sizeof(counts));
+     max = 0;
+     for (i = 0; i < CHAIN; i++) {
+          n = ++counts[other[chain[i]] & (BUCKETS - 1)];
+          if (n > max) max = n;
+     }
+     assert(max < CHAIN / 2);
+
+     /* and still found when chained */
+     for (i = 0; i < CHAIN; i++) {
+          key_name(chain[i], buffer);
+          object->set(object, buffer, t);
+     }
+     for (i = 0; i < CHAIN; i++) {
+          key_name(chain[i], buffer);
+          assert(object->get(object, buffer) == t);
+          assert(object->del(object, buffer) == t);
+     }
+     assert(object->count(object) == 0);
+     object->free(object);
+}
+
+int main(int argc, char **argv) {
+     int i;
+
+     if (argc > 1 && !strcmp(argv[1], "--hashes")) {
+          compute_hashes(hashes);
+          for (i = 0; i < KEYS; i++) {
+               printf("%u\n", hashes[i]);
+          }
+          return 0;
+     }
+
+     test_stable();
+     test_seeded();
+
+     return 0;
+}
@@ -86,6 +86,33 @@ int main() {
           assert(count == 4);
           assert(0 == strcmp("test", profile_value));
 
+          // type tags
+          assert(json_type(value) == json_type_object);
+          assert(json_as_object(value) == object);
+          assert(json_as_array(value) == NULL);
+          assert(json_type((json_value_t*)width) == json_type_number);
+          assert(json_as_number((json_value_t*)width) == width);
+          assert(json_as_string((json_value_t*)width) == NULL);
+          assert(json_as_string((json_value_t*)profile) == profile);
+          assert(json_type((json_value_t*)json_const(json_null)) == json_type_const);
+          assert(json_as_const(NULL) == NULL);
+
+          // pre-hashed keys
+          {
+               static json_key_t main_key = JSON_KEY("main");
+               json_key_t width_key = json_key("width");
+
+               mainobj = (json_object_t*)json_lookup(value, JSON_K(&main_key), JSON_STOP);
+               assert(mainobj == (json_object_t*)object->get(object, "main"));
+               assert(main_key.hash != 0);
+
+               width = (json_number_t*)json_lookup(value, JSON_K(&main_key), JSON_K(&width_key));
+               assert(width == (json_number_t*)mainobj->get(mainobj, "width"));
+
+               height = (json_number_t*)json_lookup(value, JSON_K(&main_key), "height");
+               assert(height == (json_number_t*)mainobj->get(mainobj, "height"));
+          }
+
           // variadic version
           mainobj = (json_object_t*)json_vlookup_wrapper(value, "main", JSON_STOP);
           assert(mainobj == (json_object_t*)object->get(object, "main"));
@@ -0,0 +1,161 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <locale.h>
+#include <string.h>
+
+#include "test.h"
+#include "json.h"
+
+static void on_error(cad_input_stream_t *s, int line, int column, void *data, const char *format, ...) {
+     assert(0);
+}
+
+static char *source = "[18446744073709551615, -9223372036854775808, 9223372036854775807, 12345678901234567, "
+     "1.5e3, 2.50, 1e20, -3, 0.05e1, 1234567890123456789012345, 0.0000000000000000000000000015]";
+
+static json_number_t *number(json_array_t *array, int index) {
+     return (json_number_t*)array->get(array, index);
+}
+
+static char *lazy_source = "{\"pi\":3.14159265358979323846264338327950288,\"id\":123456789012345678901234567890,"
+     "\"n\":-42,\"x\":1.50E+3,\"list\":[0.1,-0]}";
+
+static void test_lazy(void) {
+     cad_input_stream_t *stream = new_cad_input_stream_from_string(lazy_source, stdlib_memory);
+     json_object_t *root = (json_object_t*)json_parse_with(stream, on_error, NULL, stdlib_memory, json_lazy_numbers);
+     cad_output_stream_t *out;
+     char *out_source;
+     json_number_t *n;
+     int64_t i;
+
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     root->accept(root, json_write_to(out, stdlib_memory, json_compact));
+     assert(0 == strcmp(lazy_source, out_source)); // exact round-trip, whatever the precision
+
+     n = (json_number_t*)root->get(root, "pi");
+     assert(n->to_double(n) == 3.141592653589793);
+     assert(!n->is_int(n));
+
+     n = (json_number_t*)root->get(root, "n");
+     assert(n->to_int64(n, &i) && i == -42);
+     assert(n->to_double(n) == -42.0);
+
+     n = (json_number_t*)root->get(root, "x");
+     assert(n->to_int64(n, &i) && i == 1500);
+
+     n = (json_number_t*)root->get(root, "id");
+     assert(!n->to_int64(n, &i) && i == INT64_MAX);
+     assert(n->to_double(n) == 1.2345678901234568e29);
+     n->set(n, 1, 7, 0, 0, 0); // no longer lazy
+     assert(n->to_int64(n, &i) && i == 7);
+
+     root->accept(root, json_kill());
+}
+
+/* numbers read the same under a locale with a decimal comma (when one is installed) */
+static void test_locale(void) {
+     static const char *locales[] = { "de_DE.UTF-8", "fr_FR.UTF-8", "de_DE", "fr_FR", NULL };
+     cad_input_stream_t *stream;
+     json_array_t *array;
+     json_number_t *n;
+     int i;
+
+     for (i = 0; locales[i] != NULL && setlocale(LC_NUMERIC, locales[i]) == NULL; i++);
+     if (locales[i] == NULL) {
+          printf("no locale with a decimal comma, skipped\n");
+          return;
+     }
+     stream = new_cad_input_stream_from_string("[3.14159265358979323846, 1234567890123456789012345.5]", stdlib_memory);
+     array = (json_array_t*)json_parse_with(stream, on_error, NULL, stdlib_memory, json_lazy_numbers);
+     n = number(array, 0);
+     assert(n->to_double(n) == 3.141592653589793);
+     n = number(array, 1);
+     n->set(n, 1, 1234567890123456789ULL, 5, 1, 0); // not lazy: read from its text
+     assert(n->to_double(n) == 1234567890123456789.5);
+     array->accept(array, json_kill());
+     setlocale(LC_NUMERIC, "C");
+}
+
+int main() {
+     cad_input_stream_t *stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     json_array_t *array = (json_array_t*)json_parse(stream, on_error, NULL, stdlib_memory);
+     json_number_t *n;
+     int64_t i;
+     uint64_t u;
+     char buffer[64];
+
+     n = number(array, 0);
+     assert(n->to_uint64(n, &u) && u == UINT64_MAX);
+     assert(!n->to_int64(n, &i) && i == INT64_MAX);
+     assert(!n->is_int(n));
+
+     n = number(array, 1);
+     assert(n->to_int64(n, &i) && i == INT64_MIN);
+     assert(!n->to_uint64(n, &u) && u == 0);
+
+     n = number(array, 2);
+     assert(n->to_int64(n, &i) && i == INT64_MAX);
+     assert(n->is_int(n) && n->to_int(n) == INT64_MAX);
+
+     n = number(array, 3);
+     assert(n->to_int64(n, &i) && i == 12345678901234567LL); // not exactly representable as a double
+
+     n = number(array, 4);
+     assert(n->to_int64(n, &i) && i == 1500);
+     assert(n->to_double(n) == 1500.0);
+
+     n = number(array, 5);
+     assert(!n->to_int64(n, &i) && i == 2);
+     assert(n->to_double(n) == 2.5);
+     n->to_string(n, buffer, sizeof(buffer));
+     assert(0 == strcmp("2.50", buffer));
+
+     n = number(array, 6);
+     assert(!n->to_int64(n, &i) && i == INT64_MAX);
+     assert(n->to_double(n) == 1e20);
+
+     n = number(array, 7);
+     assert(!n->to_uint64(n, &u) && u == 0);
+     assert(n->to_int64(n, &i) && i == -3);
+
+     n = number(array, 8);
+     assert(!n->to_int64(n, &i) && i == 0);
+     assert(n->to_double(n) == 0.5);
+     n->to_string(n, buffer, sizeof(buffer));
+     assert(0 == strcmp("0.05e+1", buffer));
+
+     n = number(array, 9);
+     assert(!n->to_uint64(n, &u) && u == UINT64_MAX);
+     assert(n->to_double(n) == 1.234567890123456789e24);
+
+     n = number(array, 10);
+     assert(n->to_double(n) == 1.5e-27); // the leading zeros are not significant digits
+
+     n = json_new_number(stdlib_memory);
+     n->set_double(n, -1e30);
+     assert(!n->to_int64(n, &i) && i == INT64_MIN);
+     n->set_double(n, 4096.0);
+     assert(n->to_uint64(n, &u) && u == 4096);
+     n->free(n);
+
+     array->accept(array, json_kill());
+
+     test_lazy();
+     test_locale();
+
+     return 0;
+}
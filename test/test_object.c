@@ -14,11 +14,101 @@
   along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "test.h"
 #include "json.h"
 
+typedef struct iterate_data {
+     const char **keys;
+     unsigned int count;
+} iterate_data_t;
+
+static void iterate_field(json_object_t *object, unsigned int index, const char *key, size_t key_len, json_value_t *value, iterate_data_t *data) {
+     assert(index == data->count);
+     assert(key_len == strlen(key));
+     assert(object->get(object, key) == value);
+     data->keys[data->count++] = key;
+}
+
+/* a static key shared by threads that all look it up at once */
+static json_key_t shared_key = JSON_KEY("shared");
+
+/* returns the number of failed lookups (assert() is not thread-safe) */
+static void *get_shared(json_object_t *object) {
+     size_t i, failed = 0;
+     for (i = 0; i < 1000; i++) {
+          failed += object->get_k(object, &shared_key) != (json_value_t*)json_const(json_true);
+     }
+     return (void*)failed;
+}
+
+static void test_shared_key(void) {
+     json_object_t *object = json_new_object(stdlib_memory);
+     pthread_t threads[4];
+     int i;
+     object->set(object, "shared", (json_value_t*)json_const(json_true));
+     for (i = 0; i < 4; i++) {
+          assert(0 == pthread_create(&threads[i], NULL, (void*(*)(void*))get_shared, object));
+     }
+     for (i = 0; i < 4; i++) {
+          void *failed;
+          pthread_join(threads[i], &failed);
+          assert(failed == NULL);
+     }
+     assert(shared_key.hash != 0);
+     object->accept(object, json_kill());
+}
+
+#define FIELDS 200
+
+static void sum_field(json_object_t *object, unsigned int index, const char *key, size_t key_len, json_value_t *value, long *sum) {
+     json_number_t *number = json_as_number(value);
+     *sum += number->to_int(number);
+}
+
+/* returns the number of wrong values seen while the others box them */
+static void *box_fields(json_object_t *object) {
+     size_t failed = 0;
+     int round, i;
+     for (round = 0; round < 10; round++) {
+          long sum = 0;
+          object->iterate(object, (json_object_iterator_fn)sum_field, &sum);
+          failed += sum != FIELDS * (FIELDS - 1) / 2;
+          for (i = round; i < FIELDS; i += 10) {
+               char key[8];
+               json_number_t *number;
+               snprintf(key, sizeof(key), "%d", i);
+               number = json_as_number(object->get(object, key));
+               failed += number->to_int(number) != i || object->get(object, key) != (json_value_t*)number;
+          }
+     }
+     return (void*)failed;
+}
+
+/* immediate numbers boxed by some threads while others read them */
+static void test_concurrent_box(void) {
+     json_object_t *object = json_new_object(stdlib_memory);
+     pthread_t threads[4];
+     char key[8];
+     int i;
+     for (i = 0; i < FIELDS; i++) {
+          snprintf(key, sizeof(key), "%d", i);
+          object->set_int(object, key, i);
+     }
+     for (i = 0; i < 4; i++) {
+          assert(0 == pthread_create(&threads[i], NULL, (void*(*)(void*))box_fields, object));
+     }
+     for (i = 0; i < 4; i++) {
+          void *failed;
+          pthread_join(threads[i], &failed);
+          assert(failed == NULL);
+     }
+     object->accept(object, json_kill());
+}
+
 int main() {
      set_hash_salt(no_salt);
 
@@ -71,7 +161,90 @@ int main() {
      assert(!strcmp("bar", keys[0]));
      assert(keys[1] == NULL);
 
+     {
+          static json_key_t bar_key = JSON_KEY("bar");
+          json_key_t baz_key = json_key("baz");
+
+          assert(value->get_k(value, &bar_key) == f);
+          assert(value->set_k(value, &baz_key, t) == NULL);
+          assert(value->get(value, "baz") == t);
+          assert(value->count(value) == 2);
+          assert(value->del_k(value, &baz_key) == t);
+          assert(value->get_k(value, &baz_key) == NULL);
+          assert(value->count(value) == 1);
+     }
+
+     {
+          const char *buffer = "bazooka"; /* network-like slice, not NUL-terminated at the key end */
+          const char *k[2];
+          size_t l[2];
+
+          assert(value->get_n(value, "barrel", 3) == f);
+          assert(value->set_n(value, buffer, 3, t) == NULL);
+          assert(value->get(value, "baz") == t);
+          assert(value->get_n(value, buffer, 4) == NULL);
+          value->keys_n(value, k, l);
+          assert(!strcmp("bar", k[0]) && l[0] == 3);
+          assert(!strcmp("baz", k[1]) && l[1] == 3);
+          assert(value->del_n(value, buffer, 3) == t);
+          assert(value->count(value) == 1);
+     }
+
+     {
+          json_number_t *number;
+
+          assert(value->set_int(value, "int", 12) == NULL);
+          assert(value->set_double(value, "double", 2.5) == NULL);
+          number = (json_number_t*)value->get(value, "int");
+          assert(json_as_number((json_value_t*)number) == number);
+          assert(number->to_int(number) == 12);
+          assert(value->get(value, "int") == (json_value_t*)number);
+          number = (json_number_t*)value->del(value, "double");
+          assert(number->to_double(number) == 2.5);
+          number->free(number);
+          assert(value->count(value) == 2);
+     }
+
      value->accept(value, json_kill());
 
+     {
+          json_object_t *object = json_new_object(stdlib_memory);
+          const char *many[100];
+          char key[16];
+          int i;
+
+          for (i = 0; i < 100; i++) {
+               snprintf(key, 16, "key%d", i);
+               object->set(object, key, i % 2 ? t : f);
+          }
+          assert(object->count(object) == 100);
+          for (i = 0; i < 100; i += 3) {
+               snprintf(key, 16, "key%d", i);
+               assert(object->del(object, key) == (i % 2 ? t : f));
+               assert(object->get(object, key) == NULL);
+          }
+          assert(object->count(object) == 66);
+          object->set(object, "key0", n);
+          assert(object->count(object) == 67);
+
+          {
+               iterate_data_t data = { many, 0 };
+               object->iterate(object, (json_object_iterator_fn)iterate_field, &data);
+               assert(data.count == 67);
+          }
+
+          object->keys(object, many);
+          assert(!strcmp("key1", many[0]));
+          assert(!strcmp("key2", many[1]));
+          assert(!strcmp("key4", many[2]));
+          assert(!strcmp("key98", many[65]));
+          assert(!strcmp("key0", many[66]));
+
+          object->accept(object, json_kill());
+     }
+
+     test_shared_key();
+     test_concurrent_box();
+
      return 0;
 }
@@ -0,0 +1,107 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "json.h"
+
+static int failed;
+
+static void on_error(cad_input_stream_t *s, int line, int column, void *data, const char *format, ...) {
+     failed = 1;
+}
+
+static void on_no_error(cad_input_stream_t *s, int line, int column, void *data, const char *format, ...) {
+     assert(0);
+}
+
+static char *nested(int depth) {
+     char *result = malloc(2 * depth + 1);
+     memset(result, '[', depth);
+     memset(result + depth, ']', depth);
+     result[2 * depth] = '\0';
+     return result;
+}
+
+static int depth_of(json_value_t *value) {
+     int result = 0;
+     while (value != NULL && json_type(value) == json_type_array) {
+          json_array_t *array = (json_array_t*)value;
+          result++;
+          value = array->count(array) ? array->get(array, 0) : NULL;
+     }
+     return result;
+}
+
+int main() {
+     cad_input_stream_t *stream;
+     json_value_t *value;
+     char *source;
+
+     /* far too deep: an error, not a stack overflow */
+     failed = 0;
+     source = nested(100000);
+     stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     value = json_parse(stream, on_error, NULL, stdlib_memory);
+     assert(failed);
+     assert(depth_of(value) == JSON_DEFAULT_MAX_DEPTH); // what was parsed until then
+     value->accept(value, json_kill());
+     stream->free(stream);
+     free(source);
+
+     /* at the limit */
+     source = nested(10);
+     stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     value = json_parse_with_depth(stream, on_no_error, NULL, stdlib_memory, 0, 10);
+     assert(depth_of(value) == 10);
+     value->accept(value, json_kill());
+     stream->free(stream);
+
+     failed = 0;
+     stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     value = json_parse_with_depth(stream, on_error, NULL, stdlib_memory, 0, 9);
+     assert(failed);
+     value->accept(value, json_kill());
+     stream->free(stream);
+     free(source);
+
+     /* no limit; json_kill() does not recurse either */
+     source = nested(200000);
+     stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     value = json_parse_with_depth(stream, on_no_error, NULL, stdlib_memory, 0, 0);
+     assert(depth_of(value) == 200000);
+     value->accept(value, json_kill());
+     stream->free(stream);
+     free(source);
+
+     /* objects count as well */
+     stream = new_cad_input_stream_from_string("{\"a\":[{\"b\":[1,2,]},{}],\"c\":[]}", stdlib_memory);
+     value = json_parse_with_depth(stream, on_no_error, NULL, stdlib_memory, 0, 4);
+     assert(value != NULL);
+     value->accept(value, json_kill());
+     stream->free(stream);
+
+     failed = 0;
+     stream = new_cad_input_stream_from_string("{\"a\":[{\"b\":[1,2,]},{}],\"c\":[]}", stdlib_memory);
+     value = json_parse_with_depth(stream, on_error, NULL, stdlib_memory, 0, 3);
+     assert(failed);
+     value->accept(value, json_kill());
+     stream->free(stream);
+
+     return 0;
+}
@@ -0,0 +1,113 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <string.h>
+
+#include "test.h"
+#include "json.h"
+
+static int errors = 0;
+
+static void on_error(cad_input_stream_t *s, int line, int column, void *data, const char *format, ...) {
+     assert(data == &errors);
+     errors++;
+}
+
+static char *sources[] = {
+     "{\"a\":[1,2.5,{\"b\":null}],\"c\":\"text\"}",
+     "[]",
+     "  \"just a string\"  ",
+     "{\"a\":1,\"a\":2}", // duplicate key
+     "{\"long key to grow the key buffer beyond its initial size, which is one hundred and twenty-eight bytes long, or so it was\":[[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]]]}",
+     "{\"number\":123456789012345678901234567890123456789012345678901234567890}",
+     "[1,2,3] 4", // trailing characters
+     "{\"a\":1}",
+     NULL,
+};
+
+static char *write(json_value_t *value) {
+     char *out_source;
+     cad_output_stream_t *out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     json_visitor_t *writer = json_write_to(out, stdlib_memory, json_compact);
+     value->accept(value, writer);
+     writer->free(writer);
+     out->free(out);
+     return out_source;
+}
+
+/* a parser gives the same results as json_parse_with() each time */
+static void check(json_parser_t *parser) {
+     cad_input_stream_t *stream;
+     json_value_t *expected, *actual;
+     char *expected_source, *actual_source;
+     int i, expected_errors;
+
+     for (i = 0; sources[i] != NULL; i++) {
+          errors = 0;
+          stream = new_cad_input_stream_from_string(sources[i], stdlib_memory);
+          expected = json_parse_with(stream, on_error, &errors, stdlib_memory, json_lazy_numbers);
+          stream->free(stream);
+          expected_errors = errors;
+
+          errors = 0;
+          stream = new_cad_input_stream_from_string(sources[i], stdlib_memory);
+          actual = parser->parse(parser, stream);
+          stream->free(stream);
+          assert(errors == expected_errors);
+
+          expected_source = write(expected);
+          actual_source = write(actual);
+          assert(0 == strcmp(expected_source, actual_source));
+          stdlib_memory.free(expected_source);
+          stdlib_memory.free(actual_source);
+          expected->accept(expected, json_kill());
+          actual->accept(actual, json_kill());
+     }
+}
+
+/* documents shorter than the encoding header, or just as long */
+static void check_short(json_parser_t *parser) {
+     static char *short_sources[] = { "[]", "\"\"", "[1]", "{} ", "true", "[0]\n", NULL };
+     static char *expected[] = { "[]", "\"\"", "[1]", "{}", "true", "[0]", NULL };
+     cad_input_stream_t *stream;
+     json_value_t *value;
+     char *actual;
+     int i;
+
+     for (i = 0; short_sources[i] != NULL; i++) {
+          errors = 0;
+          stream = new_cad_input_stream_from_string(short_sources[i], stdlib_memory);
+          value = parser->parse(parser, stream);
+          stream->free(stream);
+          assert(errors == 0);
+          actual = write(value);
+          assert(0 == strcmp(expected[i], actual));
+          stdlib_memory.free(actual);
+          value->accept(value, json_kill());
+     }
+}
+
+int main() {
+     json_parser_t *parser = json_new_parser(on_error, &errors, stdlib_memory, json_lazy_numbers, JSON_DEFAULT_MAX_DEPTH);
+     check(parser);
+     check(parser);
+     parser->reset(parser);
+     check(parser);
+     check_short(parser);
+     parser->free(parser);
+     return 0;
+}
@@ -0,0 +1,108 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "json.h"
+
+static void on_error(cad_input_stream_t *s, int line, int column, void *data, const char *format, ...) {
+     assert(0);
+}
+
+static char buffer[4096];
+
+static json_string_t *parse_string(const char *text, size_t length) {
+     static char source[1024];
+     cad_input_stream_t *stream;
+     json_value_t *result;
+     source[0] = '"';
+     memcpy(source + 1, text, length);
+     source[length + 1] = '"';
+     source[length + 2] = '\0';
+     stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     result = json_parse(stream, on_error, NULL, stdlib_memory);
+     stream->free(stream);
+     assert(json_type(result) == json_type_string);
+     return (json_string_t*)result;
+}
+
+static char *utf8(json_string_t *string) {
+     size_t n = string->utf8(string, buffer, sizeof(buffer));
+     assert(n < sizeof(buffer));
+     return buffer;
+}
+
+/* some valid UTF-8, and some not */
+static const char *pieces[] = {
+     "a", "z", " ", "\303\251", "\342\202\254", "\360\237\230\200", "\364\217\277\277",
+     "\200", "\277", "\300\200", "\301\277", "\340\200\200", "\355\240\200", "\364\220\200\200",
+     "\370\210\200\200\200", "\377", "\303", "\342\202", "\360\237\230", "\357\277\277",
+};
+
+static int random_text(char *text) {
+     int n = 0, count = rand() % 200, i;
+     for (i = 0; i < count; i++) {
+          const char *piece = pieces[rand() % (sizeof(pieces) / sizeof(pieces[0]))];
+          /* mostly valid, mostly ASCII */
+          if (rand() % 4 != 0 && (unsigned char)piece[0] >= 0x80 && i % 3 != 0) {
+               piece = pieces[rand() % 3];
+          }
+          memcpy(text + n, piece, strlen(piece));
+          n += strlen(piece);
+     }
+     return n;
+}
+
+int main() {
+     json_string_t *string, *expected;
+     char text[1024], expected_utf8[4096];
+     int round, n, i;
+
+     string = parse_string("caf\303\251 \360\237\230\200 \342\202\254", 14);
+     assert(string->count(string) == 8);
+     assert(string->get(string, 3) == 0xE9);
+     assert(string->get(string, 5) == 0x1F600);
+     assert(string->get(string, 7) == 0x20AC);
+     assert(0 == strcmp("caf\303\251 \360\237\230\200 \342\202\254", utf8(string)));
+     string->free(string);
+
+     string = parse_string("a\377b\355\240\200c", 7); // invalid byte, surrogate
+     assert(string->get(string, 0) == 'a');
+     assert(string->get(string, 1) == 0xFFFD);
+     assert(string->get(string, 2) == 'b');
+     string->free(string);
+
+     /* the same as adding the bytes one by one */
+     srand(42);
+     for (round = 0; round < 2000; round++) {
+          n = random_text(text);
+          string = parse_string(text, n);
+          expected = json_new_string(stdlib_memory);
+          for (i = 0; i < n; i++) {
+               expected->add_utf8(expected, text[i]);
+          }
+          strcpy(expected_utf8, utf8(expected));
+          assert(string->count(string) == expected->count(expected));
+          assert(0 == strcmp(expected_utf8, utf8(string)));
+          string->free(string);
+          expected->free(expected);
+     }
+
+     return 0;
+}
@@ -0,0 +1,149 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "json.h"
+
+/* counts the live allocations; used from both threads */
+static long live = 0;
+
+static void *counting_malloc(size_t size) {
+     __atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
+     return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, size_t size) {
+     if (ptr == NULL) {
+          __atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
+     }
+     return realloc(ptr, size);
+}
+
+static void counting_free(void *ptr) {
+     if (ptr != NULL) {
+          __atomic_sub_fetch(&live, 1, __ATOMIC_RELAXED);
+     }
+     free(ptr);
+}
+
+static cad_memory_t counting_memory = { counting_malloc, counting_realloc, counting_free };
+
+static void on_error(cad_input_stream_t *s, int line, int column, void *data, const char *format, ...) {
+     assert(0);
+}
+
+static json_value_t *parse(void) {
+     static char *source = "{\"a\":[1,2,{\"b\":[[],{},\"x\"]}],\"c\":{\"d\":\"text\",\"e\":[0.5,true,null]},\"f\":-1}";
+     cad_input_stream_t *stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     json_value_t *result = json_parse(stream, on_error, NULL, counting_memory);
+     stream->free(stream);
+     return result;
+}
+
+static void sleep_ms(long ms) {
+     struct timespec t = { ms / 1000, (ms % 1000) * 1000000L };
+     nanosleep(&t, NULL);
+}
+
+/* the rate limit counts all the values, not only the containers */
+static void test_rate(void) {
+     json_array_t *array = json_new_array(counting_memory);
+     json_string_t *string;
+     long before;
+     int i;
+
+     for (i = 0; i < 2000; i++) {
+          string = json_new_string(counting_memory);
+          string->add_string(string, "s");
+          array->add(array, (json_value_t*)string);
+     }
+     before = live;
+     json_reclaimer_configure(0, 10000); // 2001 values: about 200 ms
+     json_kill_async((json_value_t*)array);
+     sleep_ms(50);
+     assert(__atomic_load_n(&live, __ATOMIC_RELAXED) > before / 2);
+     json_reclaimer_drain();
+     assert(live == 0);
+}
+
+/* a forked child starts its own reclaimer for the trees still queued */
+static void test_fork(void) {
+     pid_t pid;
+     int i, status;
+
+     json_reclaimer_configure(0, 1000);
+     for (i = 0; i < 10; i++) {
+          json_kill_async(parse());
+     }
+     pid = fork();
+     assert(pid >= 0);
+     if (pid == 0) {
+          alarm(10); // rather than waiting forever
+          json_kill_async(parse());
+          json_reclaimer_drain();
+          _exit(0);
+     }
+     assert(pid == waitpid(pid, &status, 0));
+     assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+     json_reclaimer_drain();
+     assert(live == 0);
+     json_reclaimer_configure(0, 0);
+}
+
+int main() {
+     json_string_t *string;
+     int i;
+
+     json_reclaimer_drain(); // nothing to wait for
+
+     for (i = 0; i < 100; i++) {
+          json_kill_async(parse());
+     }
+     json_kill_async(NULL);
+     string = json_new_string(counting_memory);
+     string->add_string(string, "freed at once");
+     json_kill_async((json_value_t*)string);
+     json_reclaimer_drain();
+     assert(live == 0);
+
+     /* a small queue: the trees that do not fit are freed by the caller */
+     json_reclaimer_configure(2, 0);
+     for (i = 0; i < 100; i++) {
+          json_kill_async(parse());
+     }
+     json_reclaimer_drain();
+     assert(live == 0);
+
+     /* the rate limit is lifted by json_reclaimer_drain() */
+     json_reclaimer_configure(0, 10);
+     for (i = 0; i < 10; i++) {
+          json_kill_async(parse());
+     }
+     json_reclaimer_drain();
+     assert(live == 0);
+
+     test_rate();
+     test_fork();
+
+     return 0;
+}
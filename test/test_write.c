@@ -14,6 +14,8 @@
   along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <math.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "test.h"
@@ -28,6 +30,344 @@ static void on_error(cad_input_stream_t *s, int line, int column, void *data, co
 
 static char *source = "{\"foo\":\"data\",\"key\":[1,2],\"bat\":{\"a\":1.4e+9}}";
 
+static void test_escapes(void) {
+     json_string_t *string = json_new_string(stdlib_memory);
+     char *out_source;
+     const char *text = "a\"b\\c\001\n\tz";
+     while (*text) {
+          string->add_utf8(string, *text++);
+     }
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     string->accept(string, json_write_to(out, stdlib_memory, json_compact));
+     assert(0 == strcmp("\"a\\\"b\\\\c\\u0001\\n\\tz\"", out_source));
+}
+
+/* escapes found at any position of long strings, and in keys */
+static void test_scan(void) {
+     static const char specials[] = "\"\\\n\037";
+     static const char *escaped[] = { "\\\"", "\\\\", "\\n", "\\u001f" };
+     char expected[128], *out_source;
+     int length, position, k;
+     for (length = 1; length < 40; length++) {
+          for (position = 0; position < length; position++) {
+               for (k = 0; k < 4; k++) {
+                    json_object_t *object = json_new_object(stdlib_memory);
+                    json_string_t *string = json_new_string(stdlib_memory);
+                    char text[64];
+                    memset(text, 'x', length);
+                    text[length] = '\0';
+                    text[position] = specials[k];
+                    object->set(object, text, (json_value_t*)json_const(json_null));
+                    for (int i = 0; i < length; i++) {
+                         string->add_utf8(string, text[i]);
+                    }
+                    out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+                    string->accept(string, json_write_to(out, stdlib_memory, json_compact));
+                    snprintf(expected, sizeof(expected), "\"%.*s%s%s\"", position, text, escaped[k], text + position + 1);
+                    assert(0 == strcmp(expected, out_source));
+                    out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+                    object->accept(object, json_write_to(out, stdlib_memory, json_compact));
+                    snprintf(expected, sizeof(expected), "{\"%.*s%s%s\":null}", position, text, escaped[k], text + position + 1);
+                    assert(0 == strcmp(expected, out_source));
+                    object->accept(object, json_kill());
+               }
+          }
+     }
+
+     {
+          json_object_t *object = json_new_object(stdlib_memory);
+          object->set(object, "caf\303\251 \360\237\230\200", (json_value_t*)json_const(json_true));
+          out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+          object->accept(object, json_write_to(out, stdlib_memory, json_extend_unicode));
+          assert(0 == strcmp("{\"caf\\u00e9 \\ud83d\\ude00\":true}", out_source));
+          out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+          object->accept(object, json_write_to(out, stdlib_memory, json_compact));
+          assert(0 == strcmp("{\"caf\303\251 \360\237\230\200\":true}", out_source));
+     }
+
+     /* DEL is escaped along with the non-ASCII characters */
+     for (length = 1; length < 40; length++) {
+          for (position = 0; position < length; position++) {
+               json_object_t *object = json_new_object(stdlib_memory);
+               char text[64];
+               memset(text, 'x', length);
+               text[length] = '\0';
+               text[position] = '\177';
+               object->set(object, text, (json_value_t*)json_const(json_null));
+               out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+               object->accept(object, json_write_to(out, stdlib_memory, json_extend_unicode));
+               snprintf(expected, sizeof(expected), "{\"%.*s\\u007f%s\":null}", position, text, text + position + 1);
+               assert(0 == strcmp(expected, out_source));
+               out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+               object->accept(object, json_write_to(out, stdlib_memory, json_compact));
+               snprintf(expected, sizeof(expected), "{\"%s\":null}", text);
+               assert(0 == strcmp(expected, out_source));
+               object->accept(object, json_kill());
+          }
+     }
+}
+
+/* non-ASCII string values, parsed or built, written back as they came */
+static void test_unicode(void) {
+     static char *text = "caf\303\251 \360\237\230\200 \342\202\254 \360\220\200\200";
+     json_string_t *string = json_new_string(stdlib_memory);
+     json_value_t *value;
+     char buffer[64], *out_source, *p;
+
+     for (p = text; *p; p++) {
+          string->add_utf8(string, *p);
+     }
+     assert(10 == string->count(string));
+     assert(0x00E9 == string->get(string, 3));
+     assert(0x1F600 == string->get(string, 5));
+     assert(0x20AC == string->get(string, 7));
+     assert(0x10000 == string->get(string, 9));
+     assert(strlen(text) == string->utf8(string, buffer, sizeof(buffer)));
+     assert(0 == strcmp(text, buffer));
+
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     string->accept(string, json_write_to(out, stdlib_memory, json_extend_unicode));
+     assert(0 == strcmp("\"caf\\u00e9 \\ud83d\\ude00 \\u20ac \\ud800\\udc00\"", out_source));
+     string->accept(string, json_kill());
+
+     snprintf(buffer, sizeof(buffer), "[\"%s\"]", text);
+     stream = new_cad_input_stream_from_string(buffer, stdlib_memory);
+     value = json_parse(stream, on_error, NULL, stdlib_memory);
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     value->accept(value, json_write_to(out, stdlib_memory, json_compact));
+     assert(0 == strcmp(buffer, out_source));
+     value->accept(value, json_kill());
+}
+
+static void test_blocks(void) {
+     json_array_t *array = json_new_array(stdlib_memory);
+     char *out_source;
+     int i;
+     for (i = 0; i < 10000; i++) {
+          array->add_int(array, 1000000 + i);
+     }
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     array->accept(array, json_write_to(out, stdlib_memory, json_compact));
+     assert(strlen(out_source) == 10000 * 8 + 1);
+     assert(0 == strncmp("[1000000,1000001,", out_source, 17));
+     assert(0 == strcmp(",1009999]", out_source + strlen(out_source) - 9));
+}
+
+/* the measured and serialized output is the streamed one */
+static void test_serialize(void) {
+     json_array_t *array = json_new_array(stdlib_memory);
+     json_string_t *string = json_new_string(stdlib_memory);
+     short options[] = { json_compact, json_extend_spaces, json_extend_unicode };
+     char *out_source, *result;
+     size_t length;
+     int i, k;
+     for (i = 0; i < 3000; i++) {
+          string->add_utf8(string, i % 100 == 99 ? '\n' : 'a' + i % 26);
+     }
+     array->add(array, (json_value_t*)string);
+     for (i = 0; i < 2000; i++) {
+          array->add_double(array, i + 0.25);
+     }
+     stream = new_cad_input_stream_from_string(source, stdlib_memory);
+     array->add(array, json_parse(stream, on_error, NULL, stdlib_memory));
+     for (k = 0; k < 3; k++) {
+          out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+          array->accept(array, json_write_to(out, stdlib_memory, options[k]));
+          assert(json_measure((json_value_t*)array, options[k]) == strlen(out_source));
+          result = json_serialize((json_value_t*)array, options[k], stdlib_memory, &length);
+          assert(length == strlen(out_source));
+          assert(0 == strcmp(out_source, result));
+          stdlib_memory.free(result);
+     }
+     array->accept(array, json_kill());
+}
+
+static char *write_with(json_value_t *value, short options) {
+     char *out_source;
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     value->accept(value, json_write_to(out, stdlib_memory, options));
+     return out_source;
+}
+
+/* only the changed paths are written again */
+static void test_cache(void) {
+     json_object_t *root = json_new_object(stdlib_memory);
+     json_array_t *list = json_new_array(stdlib_memory);
+     json_object_t *item = NULL, *moved;
+     json_string_t *name = NULL;
+     short options[] = { json_cache_subtrees, json_cache_subtrees | json_extend_spaces };
+     char key[16];
+     int i, j, k;
+
+     for (i = 0; i < 100; i++) {
+          item = json_new_object(stdlib_memory);
+          for (j = 0; j < 10; j++) {
+               snprintf(key, sizeof(key), "field%d", j);
+               item->set_int(item, key, i * 100 + j);
+          }
+          name = json_new_string(stdlib_memory);
+          name->add_string(name, "item");
+          item->set(item, "name", (json_value_t*)name);
+          list->add(list, (json_value_t*)item);
+     }
+     root->set(root, "list", (json_value_t*)list);
+     root->set_int(root, "version", 1);
+
+     for (k = 0; k < 2; k++) {
+          short plain = options[k] & ~json_cache_subtrees;
+          assert(0 == strcmp(write_with((json_value_t*)root, plain), write_with((json_value_t*)root, options[k])));
+          item = (json_object_t*)list->get(list, 42);
+          item->set_int(item, "field3", -1);
+          root->set_int(root, "version", 2 + k);
+          assert(0 == strcmp(write_with((json_value_t*)root, plain), write_with((json_value_t*)root, options[k])));
+          assert(strstr(write_with((json_value_t*)root, options[k]), "-1") != NULL);
+
+          /* moved subtrees, at another depth */
+          moved = (json_object_t*)list->get(list, 7);
+          list->del(list, 7);
+          root->set(root, "moved", (json_value_t*)moved);
+          moved->set_int(moved, "field0", -2);
+          assert(0 == strcmp(write_with((json_value_t*)root, plain), write_with((json_value_t*)root, options[k])));
+          assert(0 == strcmp(write_with((json_value_t*)moved, plain), write_with((json_value_t*)moved, options[k])));
+          list->ins(list, 0, root->del(root, "moved"));
+          assert(0 == strcmp(write_with((json_value_t*)root, plain), write_with((json_value_t*)root, options[k])));
+     }
+
+     /* changes in place are not seen until touched */
+     name = (json_string_t*)((json_object_t*)list->get(list, 99))->get((json_object_t*)list->get(list, 99), "name");
+     write_with((json_value_t*)root, json_cache_subtrees);
+     name->add(name, '!');
+     assert(strstr(write_with((json_value_t*)root, json_cache_subtrees), "item!") == NULL);
+     json_touch(list->get(list, 99));
+     assert(strstr(write_with((json_value_t*)root, json_cache_subtrees), "item!") != NULL);
+     assert(0 == strcmp(write_with((json_value_t*)root, json_compact), write_with((json_value_t*)root, json_cache_subtrees)));
+
+     root->accept(root, json_kill());
+}
+
+/* the parallel output is the sequential one */
+static void test_parallel(void) {
+     json_object_t *root = json_new_object(stdlib_memory);
+     json_array_t *list = json_new_array(stdlib_memory);
+     json_object_t *table = json_new_object(stdlib_memory);
+     short options[] = { json_compact, json_extend_spaces, json_extend_spaces | json_cache_subtrees };
+     char key[16], *expected, *out_source;
+     int i, k;
+
+     for (i = 0; i < 10000; i++) {
+          json_object_t *item = json_new_object(stdlib_memory);
+          json_string_t *name = json_new_string(stdlib_memory);
+          name->add_string(name, "item \"%d\"", i);
+          item->set(item, "name", (json_value_t*)name);
+          item->set_double(item, "x", i * 0.5);
+          list->add(list, (json_value_t*)item);
+          list->add_int(list, i);
+          snprintf(key, sizeof(key), "k%d", i);
+          table->set_int(table, key, i);
+     }
+     for (i = 0; i < 10000; i += 3) {
+          snprintf(key, sizeof(key), "k%d", i);
+          table->del(table, key); // holes in the entries
+     }
+     root->set(root, "list", (json_value_t*)list);
+     root->set(root, "table", (json_value_t*)table);
+
+     for (k = 0; k < 3; k++) {
+          expected = write_with((json_value_t*)root, options[k]);
+          out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+          root->accept(root, json_write_to_parallel(out, stdlib_memory, options[k], 4));
+          assert(0 == strcmp(expected, out_source));
+          out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+          list->accept(list, json_write_to_parallel(out, stdlib_memory, options[k], 3));
+          assert(0 == strcmp(write_with((json_value_t*)list, options[k]), out_source));
+     }
+
+     root->accept(root, json_kill());
+}
+
+/* RFC 8785, appendix B and section 3.2.3 */
+static void test_canonical(void) {
+     static const struct { uint64_t bits; const char *expected; } numbers[] = {
+          { 0x0000000000000000ULL, "0" },
+          { 0x8000000000000000ULL, "0" },
+          { 0x0000000000000001ULL, "5e-324" },
+          { 0x8000000000000001ULL, "-5e-324" },
+          { 0x7fefffffffffffffULL, "1.7976931348623157e+308" },
+          { 0x4340000000000000ULL, "9007199254740992" },
+          { 0xc340000000000000ULL, "-9007199254740992" },
+          { 0x4430000000000000ULL, "295147905179352830000" },
+          { 0x44b52d02c7e14af5ULL, "9.999999999999997e+22" },
+          { 0x44b52d02c7e14af6ULL, "1e+23" },
+          { 0x44b52d02c7e14af7ULL, "1.0000000000000001e+23" },
+          { 0x444b1ae4d6e2ef4eULL, "999999999999999700000" },
+          { 0x444b1ae4d6e2ef4fULL, "999999999999999900000" },
+          { 0x444b1ae4d6e2ef50ULL, "1e+21" },
+          { 0x3eb0c6f7a0b5ed8cULL, "9.999999999999997e-7" },
+          { 0x3eb0c6f7a0b5ed8dULL, "0.000001" },
+          { 0x41b3de4355555553ULL, "333333333.3333332" },
+          { 0x41b3de4355555554ULL, "333333333.33333325" },
+          { 0x41b3de4355555555ULL, "333333333.3333333" },
+          { 0x41b3de4355555556ULL, "333333333.3333334" },
+          { 0x41b3de4355555557ULL, "333333333.33333343" },
+          { 0xbecbf647612f3696ULL, "-0.0000033333333333333333" },
+          { 0x43143ff3c1cb0959ULL, "1424953923781206.2" },
+          { 0x7ff8000000000000ULL, "null" },
+     };
+     static const char *keys[] = {
+          "\342\202\254", "\r", "\357\254\263", "1", "\360\237\230\200", "\302\200", "\303\266",
+     };
+     static char *document = "{\"numbers\":[333333333.33333329,1E30,4.50,2e-3,0.000000000000000000000000001,-0,12345678901234567890],"
+          "\"string\":\"$\\u000F\\u000aA'\\u0042\\u0022\\u005c\\\\\\\"\\/\",\"literals\":[null,true,false]}";
+     json_object_t *object = json_new_object(stdlib_memory);
+     json_value_t *value;
+     char *out_source;
+     int i;
+
+     for (i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+          json_number_t *number = json_new_number(stdlib_memory);
+          double d;
+          memcpy(&d, &numbers[i].bits, sizeof(d));
+          number->set_double(number, d);
+          assert(0 == strcmp(numbers[i].expected, write_with((json_value_t*)number, json_canonical)));
+          number->free(number);
+     }
+
+     for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+          object->set(object, keys[i], (json_value_t*)json_const(json_null));
+     }
+     assert(0 == strcmp("{\"\\r\":null,\"1\":null,\"\302\200\":null,\"\303\266\":null,\"\342\202\254\":null,"
+                        "\"\360\237\230\200\":null,\"\357\254\263\":null}",
+                        write_with((json_value_t*)object, json_canonical | json_extend_spaces | json_extend_unicode)));
+     object->set_int(object, "0", 1); // the order is computed again
+     object->del(object, "1");
+     assert(0 == strncmp("{\"\\r\":null,\"0\":1,\"\302\200\":null,", write_with((json_value_t*)object, json_canonical), 23));
+     object->accept(object, json_kill());
+
+     stream = new_cad_input_stream_from_string(document, stdlib_memory);
+     value = json_parse_with(stream, on_error, NULL, stdlib_memory, json_lazy_numbers);
+     out_source = write_with(value, json_canonical);
+     assert(0 == strcmp("{\"literals\":[null,true,false],\"numbers\":[333333333.3333333,1e+30,4.5,0.002,1e-27,0,12345678901234567000],"
+                        "\"string\":\"$\\u000f\\nA'B\\\"\\\\\\\\\\\"/\"}", out_source));
+     value->accept(value, json_kill());
+}
+
+/* NaN and infinities are not JSON numbers: they are written as null */
+static void test_non_finite(void) {
+     json_array_t *array = json_new_array(stdlib_memory);
+     json_number_t *number = json_new_number(stdlib_memory);
+
+     array->add_double(array, NAN);
+     array->add_double(array, 0.5);
+     array->add_double(array, -INFINITY);
+     assert(0 == strcmp("[null,0.5,null]", write_with((json_value_t*)array, json_compact)));
+     number->set_double(number, INFINITY);
+     array->add(array, (json_value_t*)number);
+     array->add_int(array, 1);
+     assert(0 == strcmp("[null,0.5,null,null,1]", write_with((json_value_t*)array, json_compact)));
+     assert(0 == strcmp("null", write_with((json_value_t*)number, json_compact)));
+     array->accept(array, json_kill());
+}
+
 int main() {
      set_hash_salt(no_salt);
 
@@ -46,5 +386,15 @@ int main() {
      assert(NULL != out_source);
      assert(0 == strcmp(source, out_source));
 
+     test_escapes();
+     test_blocks();
+     test_scan();
+     test_unicode();
+     test_serialize();
+     test_cache();
+     test_parallel();
+     test_canonical();
+     test_non_finite();
+
      return 0;
 }
@@ -0,0 +1,233 @@
+/*
+  This file is part of YACJP.
+
+  YacJP is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, version 3 of the License.
+
+  YacJP is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with YacJP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "json.h"
+
+static void on_error(cad_input_stream_t *s, int line, int column, void *data, const char *format, ...) {
+     assert(0);
+}
+
+static void write_document(json_writer_t *writer) {
+     assert(0 == writer->begin_object(writer));
+     assert(0 == writer->key(writer, "id", 2));
+     assert(0 == writer->int64(writer, -9007199254740993LL));
+     assert(0 == writer->key(writer, "name", 4));
+     assert(0 == writer->string(writer, "a \"b\"\n", 6));
+     assert(0 == writer->key(writer, "values", 6));
+     assert(0 == writer->begin_array(writer));
+     assert(0 == writer->double_(writer, 0.1));
+     assert(0 == writer->bool_(writer, 1));
+     assert(0 == writer->null(writer));
+     assert(0 == writer->begin_object(writer));
+     assert(0 == writer->end_object(writer));
+     assert(0 == writer->end_array(writer));
+     assert(0 == writer->end_object(writer));
+}
+
+static char *document = "{\"id\":-9007199254740993,\"name\":\"a \\\"b\\\"\\n\",\"values\":[0.1,true,null,{}]}";
+
+static char *read_all(FILE *file) {
+     static char result[1 << 20];
+     size_t n;
+     fflush(file);
+     rewind(file);
+     n = fread(result, 1, sizeof(result) - 1, file);
+     result[n] = '\0';
+     return result;
+}
+
+/* the same output through writev(2), with large strings referenced */
+static void test_fd(void) {
+     static char blob[3000];
+     cad_output_stream_t *out;
+     json_writer_t *writer;
+     char *out_source;
+     FILE *file;
+     int i, round;
+
+     for (i = 0; i < sizeof(blob) - 1; i++) {
+          blob[i] = (i % 700 == 699) ? '"' : 'a' + i % 26;
+     }
+     for (round = 0; round < 2; round++) {
+          /* compact, then pretty-printed */
+          short options = round ? json_extend_spaces : json_compact;
+          out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+          writer = json_new_writer(out, stdlib_memory, options);
+          file = tmpfile();
+          for (i = 0; i < 2; i++) {
+               writer->begin_array(writer);
+               for (int j = 0; j < 100; j++) {
+                    writer->string(writer, blob, sizeof(blob) - 1 - j);
+                    writer->int64(writer, j);
+               }
+               writer->end_array(writer);
+               if (i == 0) {
+                    writer->free(writer);
+                    writer = json_new_fd_writer(fileno(file), stdlib_memory, options);
+               }
+          }
+          writer->free(writer);
+          assert(strlen(out_source) > 300000 / 2);
+          assert(0 == strcmp(out_source, read_all(file)));
+          fclose(file);
+     }
+
+     {
+          json_array_t *array = json_new_array(stdlib_memory);
+          json_string_t *string = json_new_string(stdlib_memory);
+          json_visitor_t *visitor;
+          for (i = 0; i < sizeof(blob) - 1; i++) {
+               string->add_utf8(string, blob[i]);
+          }
+          array->add(array, (json_value_t*)string);
+          array->add_int(array, 42);
+          out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+          array->accept(array, json_write_to(out, stdlib_memory, json_extend_spaces));
+          file = tmpfile();
+          visitor = json_write_to_fd(fileno(file), stdlib_memory, json_extend_spaces);
+          array->accept(array, visitor);
+          visitor->free(visitor);
+          assert(0 == strcmp(out_source, read_all(file)));
+          fclose(file);
+          array->accept(array, json_kill());
+     }
+}
+
+/* many referenced runs between two flushes */
+static void test_fd_batch(void) {
+     static char text[100 * 601];
+     cad_output_stream_t *out;
+     json_writer_t *writer;
+     char *out_source;
+     FILE *file;
+     int i;
+
+     for (i = 0; i < sizeof(text) - 1; i++) {
+          text[i] = (i % 601 == 600) ? '\n' : 'a' + i % 26;
+     }
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     writer = json_new_writer(out, stdlib_memory, json_compact);
+     assert(0 == writer->string(writer, text, sizeof(text) - 1));
+     writer->free(writer);
+
+     file = tmpfile();
+     writer = json_new_fd_writer(fileno(file), stdlib_memory, json_compact);
+     assert(0 == writer->string(writer, text, sizeof(text) - 1));
+     assert(0 == writer->error(writer));
+     writer->free(writer);
+     assert(0 == strcmp(out_source, read_all(file)));
+     fclose(file);
+}
+
+/* the output errors are kept, and stop the output */
+static void test_fd_error(void) {
+     int fd = open("/dev/full", O_WRONLY);
+     json_array_t *array;
+     json_visitor_t *visitor;
+     json_writer_t *writer;
+
+     assert(fd >= 0);
+     writer = json_new_fd_writer(fd, stdlib_memory, json_compact);
+     assert(0 == writer->begin_array(writer));
+     assert(0 == writer->int64(writer, 1));
+     assert(-1 == writer->end_array(writer));
+     assert(ENOSPC == writer->error(writer));
+     writer->free(writer);
+
+     array = json_new_array(stdlib_memory);
+     array->add_int(array, 1);
+     visitor = json_write_to_fd(fd, stdlib_memory, json_compact);
+     array->accept(array, visitor);
+     assert(ENOSPC == json_write_error(visitor));
+     visitor->free(visitor);
+     array->accept(array, json_kill());
+     close(fd);
+}
+
+int main() {
+     cad_output_stream_t *out;
+     cad_input_stream_t *in;
+     json_writer_t *writer;
+     json_value_t *value;
+     char *out_source, *dom_source;
+
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     writer = json_new_writer(out, stdlib_memory, json_compact);
+     write_document(writer);
+     assert(0 == strcmp(document, out_source)); // flushed when complete
+
+     /* nesting validation */
+     assert(-1 == writer->null(writer)); // only one top-level value
+     writer->free(writer);
+
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     writer = json_new_writer(out, stdlib_memory, json_compact);
+     assert(-1 == writer->end_array(writer));
+     assert(-1 == writer->key(writer, "k", 1));
+     assert(0 == writer->begin_object(writer));
+     assert(-1 == writer->int64(writer, 1)); // no key
+     assert(0 == writer->key(writer, "k", 1));
+     assert(-1 == writer->key(writer, "l", 1)); // no value
+     assert(-1 == writer->end_object(writer));
+     assert(0 == writer->begin_array(writer));
+     assert(-1 == writer->end_object(writer));
+     assert(-1 == writer->key(writer, "l", 1));
+     assert(0 == writer->end_array(writer));
+     assert(0 == writer->end_object(writer));
+     assert(0 == strcmp("{\"k\":[]}", out_source));
+     writer->free(writer);
+
+     /* no JSON form for NaN and infinities */
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     writer = json_new_writer(out, stdlib_memory, json_compact);
+     assert(0 == writer->begin_array(writer));
+     assert(0 == writer->double_(writer, NAN));
+     assert(0 == writer->double_(writer, INFINITY));
+     assert(0 == writer->double_(writer, -INFINITY));
+     assert(0 == writer->double_(writer, 1.5));
+     assert(0 == writer->end_array(writer));
+     assert(0 == strcmp("[null,null,null,1.5]", out_source));
+     writer->free(writer);
+
+     /* same layout as the visitor */
+     out = new_cad_output_stream_from_string(&out_source, stdlib_memory);
+     writer = json_new_writer(out, stdlib_memory, json_extend_spaces);
+     write_document(writer);
+     writer->free(writer);
+
+     in = new_cad_input_stream_from_string(document, stdlib_memory);
+     value = json_parse(in, on_error, NULL, stdlib_memory);
+     out = new_cad_output_stream_from_string(&dom_source, stdlib_memory);
+     value->accept(value, json_write_to(out, stdlib_memory, json_extend_spaces));
+     assert(0 == strcmp("{\n    \"id\": -9007199254740993,\n    \"name\": \"a \\\"b\\\"\\n\",\n    \"values\": [\n        0.1,\n        true,\n        null,\n        {}\n    ]\n}", out_source));
+     assert(0 != strcmp(dom_source, out_source)); // the visitor aligns the values
+
+     value->accept(value, json_kill());
+
+     test_fd();
+     test_fd_batch();
+     test_fd_error();
+
+     return 0;
+}